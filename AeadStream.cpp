@@ -0,0 +1,522 @@
+#include "AeadStream.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+#if !defined(USE_BCRYPT)
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#endif
+
+namespace TWN
+{
+  static size_t GetAeadKeySize(AeadAlgorithm algorithm)
+  {
+    switch(algorithm)
+    {
+    case AeadAlgorithm::Aes128Gcm:
+      return 16;
+    case AeadAlgorithm::Aes256Gcm:
+    case AeadAlgorithm::ChaCha20Poly1305:
+      return 32;
+    }
+
+    return 0;
+  }
+
+  static void WriteBigEndian32(uint8_t* dst, uint32_t value)
+  {
+    dst[0] = static_cast<uint8_t>(value >> 24);
+    dst[1] = static_cast<uint8_t>(value >> 16);
+    dst[2] = static_cast<uint8_t>(value >> 8);
+    dst[3] = static_cast<uint8_t>(value);
+  }
+
+  static uint32_t ReadBigEndian32(const uint8_t* src)
+  {
+    return (static_cast<uint32_t>(src[0]) << 24) | (static_cast<uint32_t>(src[1]) << 16) | (static_cast<uint32_t>(src[2]) << 8) | src[3];
+  }
+
+  static bool GenerateRandom(uint8_t* dst, size_t len)
+  {
+#if defined(USE_BCRYPT)
+    return BCRYPT_SUCCESS(BCryptGenRandom(nullptr, dst, static_cast<ULONG>(len), BCRYPT_USE_SYSTEM_PREFERRED_RNG));
+#else
+    return RAND_bytes(dst, static_cast<int>(len)) == 1;
+#endif
+  }
+
+  static bool HmacSha256(const uint8_t* key, size_t keyLen, const uint8_t* data, size_t dataLen, uint8_t* out)
+  {
+#if defined(USE_BCRYPT)
+    BCRYPT_ALG_HANDLE provider = nullptr;
+    BCRYPT_HASH_HANDLE hash = nullptr;
+
+    bool ok = BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&provider, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG))
+      && BCRYPT_SUCCESS(BCryptCreateHash(provider, &hash, nullptr, 0, const_cast<PUCHAR>(key), static_cast<ULONG>(keyLen), 0))
+      && BCRYPT_SUCCESS(BCryptHashData(hash, const_cast<PUCHAR>(data), static_cast<ULONG>(dataLen), 0))
+      && BCRYPT_SUCCESS(BCryptFinishHash(hash, out, 32, 0));
+
+    if(hash != nullptr)
+    {
+      BCryptDestroyHash(hash);
+    }
+
+    if(provider != nullptr)
+    {
+      BCryptCloseAlgorithmProvider(provider, 0);
+    }
+
+    return ok;
+#else
+    unsigned int outLen = 0;
+    return HMAC(EVP_sha256(), key, static_cast<int>(keyLen), data, dataLen, out, &outLen) != nullptr && outLen == 32;
+#endif
+  }
+
+  // HKDF-SHA256 (RFC 5869) for up to one hash length of output
+  static bool DeriveKey(const void* key, size_t keySize, const uint8_t* salt, size_t saltSize, const uint8_t* info, size_t infoSize, uint8_t* out, size_t outSize)
+  {
+    TWN_REQUIRE(outSize <= 32 && infoSize < 64);
+
+    uint8_t prk[32];
+    uint8_t block[64 + 1];
+    uint8_t okm[32];
+
+    memcpy(block, info, infoSize);
+    block[infoSize] = 1;
+
+    bool ok = HmacSha256(salt, saltSize, static_cast<const uint8_t*>(key), keySize, prk) && HmacSha256(prk, sizeof(prk), block, infoSize + 1, okm);
+
+    if(ok)
+    {
+      memcpy(out, okm, outSize);
+    }
+
+    volatile uint8_t* p = prk;
+    volatile uint8_t* q = okm;
+    for(size_t i = 0; i < 32; ++i)
+    {
+      p[i] = 0;
+      q[i] = 0;
+    }
+
+    return ok;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // AeadSegmentCipher
+  //////////////////////////////////////////////////////////////////////////
+
+  AeadSegmentCipher::AeadSegmentCipher()
+    : m_algorithm(AeadAlgorithm::Aes256Gcm)
+    , m_native(false)
+#if defined(USE_BCRYPT)
+    , m_provider(nullptr)
+    , m_key(nullptr)
+#else
+    , m_ctx(nullptr)
+#endif
+  {
+    memset(m_header, 0, sizeof(m_header));
+  }
+
+  AeadSegmentCipher::~AeadSegmentCipher()
+  {
+    Release();
+  }
+
+  void AeadSegmentCipher::Release()
+  {
+    m_native = false;
+
+#if defined(USE_BCRYPT)
+    if(m_key != nullptr)
+    {
+      BCryptDestroyKey(m_key);
+      m_key = nullptr;
+    }
+
+    if(m_provider != nullptr)
+    {
+      BCryptCloseAlgorithmProvider(m_provider, 0);
+      m_provider = nullptr;
+    }
+#else
+    if(m_ctx != nullptr)
+    {
+      EVP_CIPHER_CTX_free(m_ctx);
+      m_ctx = nullptr;
+    }
+#endif
+  }
+
+  /*static*/ bool AeadSegmentCipher::CreateHeader(AeadAlgorithm algorithm, uint32_t segmentSize, uint8_t* header)
+  {
+    if(GetAeadKeySize(algorithm) == 0 || segmentSize == 0 || segmentSize > MaxSegmentSize)
+    {
+      return false;
+    }
+
+    header[0] = Version;
+    header[1] = static_cast<uint8_t>(algorithm);
+    WriteBigEndian32(header + 2, segmentSize);
+
+    return GenerateRandom(header + 6, SaltSize + NoncePrefixSize);
+  }
+
+  /*static*/ bool AeadSegmentCipher::ParseHeader(const uint8_t* header, AeadAlgorithm& algorithm, uint32_t& segmentSize)
+  {
+    algorithm = static_cast<AeadAlgorithm>(header[1]);
+    segmentSize = ReadBigEndian32(header + 2);
+
+    return header[0] == Version && GetAeadKeySize(algorithm) != 0 && segmentSize > 0 && segmentSize <= MaxSegmentSize;
+  }
+
+  bool AeadSegmentCipher::Init(const void* key, size_t keySize, const uint8_t* header)
+  {
+    Release();
+
+    uint32_t segmentSize = 0;
+    if(!ParseHeader(header, m_algorithm, segmentSize) || keySize < 16)
+    {
+      return false;
+    }
+
+    memcpy(m_header, header, HeaderSize);
+
+    // Derive this stream's key from the caller's key and the salt, binding in the version, algorithm and segment size
+    uint8_t segmentKey[32];
+    size_t segmentKeySize = GetAeadKeySize(m_algorithm);
+
+    if(!DeriveKey(key, keySize, header + 6, SaltSize, header, 6, segmentKey, segmentKeySize))
+    {
+      return false;
+    }
+
+    bool ok = false;
+
+    if(m_algorithm != AeadAlgorithm::ChaCha20Poly1305 && m_gcm.Init(segmentKey, segmentKeySize))
+    {
+      m_native = ok = true;
+    }
+#if defined(USE_BCRYPT)
+    else if(m_algorithm != AeadAlgorithm::ChaCha20Poly1305)
+    {
+      ok = BCRYPT_SUCCESS(BCryptOpenAlgorithmProvider(&m_provider, BCRYPT_AES_ALGORITHM, nullptr, 0))
+        && BCRYPT_SUCCESS(BCryptSetProperty(m_provider, BCRYPT_CHAINING_MODE, (PUCHAR)BCRYPT_CHAIN_MODE_GCM, sizeof(BCRYPT_CHAIN_MODE_GCM), 0))
+        && BCRYPT_SUCCESS(BCryptGenerateSymmetricKey(m_provider, &m_key, nullptr, 0, segmentKey, static_cast<ULONG>(segmentKeySize), 0));
+    }
+#else
+    else
+    {
+      const EVP_CIPHER* cipher = nullptr;
+
+      switch(m_algorithm)
+      {
+      case AeadAlgorithm::Aes128Gcm:
+        cipher = EVP_aes_128_gcm();
+        break;
+      case AeadAlgorithm::Aes256Gcm:
+        cipher = EVP_aes_256_gcm();
+        break;
+      case AeadAlgorithm::ChaCha20Poly1305:
+        cipher = EVP_chacha20_poly1305();
+        break;
+      }
+
+      m_ctx = EVP_CIPHER_CTX_new();
+      ok = m_ctx != nullptr
+        && EVP_CipherInit_ex(m_ctx, cipher, nullptr, nullptr, nullptr, 1) == 1
+        && EVP_CIPHER_CTX_ctrl(m_ctx, EVP_CTRL_AEAD_SET_IVLEN, NonceSize, nullptr) == 1
+        && EVP_CipherInit_ex(m_ctx, nullptr, nullptr, segmentKey, nullptr, 1) == 1;
+    }
+#endif
+
+    volatile uint8_t* p = segmentKey;
+    for(size_t i = 0; i < sizeof(segmentKey); ++i)
+    {
+      p[i] = 0;
+    }
+
+    if(!ok)
+    {
+      Release();
+    }
+
+    return ok;
+  }
+
+  void AeadSegmentCipher::MakeNonce(uint32_t segmentIndex, bool lastSegment, uint8_t* nonce) const
+  {
+    memcpy(nonce, m_header + 6 + SaltSize, NoncePrefixSize);
+    WriteBigEndian32(nonce + NoncePrefixSize, segmentIndex);
+    nonce[NonceSize - 1] = lastSegment ? 1 : 0;
+  }
+
+  bool AeadSegmentCipher::Seal(uint32_t segmentIndex, bool lastSegment, uint8_t* data, size_t len)
+  {
+    uint8_t nonce[NonceSize];
+    MakeNonce(segmentIndex, lastSegment, nonce);
+
+    if(m_native)
+    {
+      m_gcm.Seal(nonce, m_header, HeaderSize, data, len, data + len);
+      return true;
+    }
+
+#if defined(USE_BCRYPT)
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = nonce;
+    info.cbNonce = NonceSize;
+    info.pbAuthData = m_header;
+    info.cbAuthData = HeaderSize;
+    info.pbTag = data + len;
+    info.cbTag = TagSize;
+
+    ULONG written = 0;
+    return m_key != nullptr && BCRYPT_SUCCESS(BCryptEncrypt(m_key, data, static_cast<ULONG>(len), &info, nullptr, 0, data, static_cast<ULONG>(len), &written, 0));
+#else
+    int outLen = 0;
+    return m_ctx != nullptr
+      && EVP_CipherInit_ex(m_ctx, nullptr, nullptr, nullptr, nonce, 1) == 1
+      && EVP_CipherUpdate(m_ctx, nullptr, &outLen, m_header, HeaderSize) == 1
+      && EVP_CipherUpdate(m_ctx, data, &outLen, data, static_cast<int>(len)) == 1
+      && EVP_CipherFinal_ex(m_ctx, data + outLen, &outLen) == 1
+      && EVP_CIPHER_CTX_ctrl(m_ctx, EVP_CTRL_AEAD_GET_TAG, TagSize, data + len) == 1;
+#endif
+  }
+
+  bool AeadSegmentCipher::Open(uint32_t segmentIndex, bool lastSegment, uint8_t* data, size_t len)
+  {
+    uint8_t nonce[NonceSize];
+    MakeNonce(segmentIndex, lastSegment, nonce);
+
+    if(m_native)
+    {
+      return m_gcm.Open(nonce, m_header, HeaderSize, data, len, data + len);
+    }
+
+#if defined(USE_BCRYPT)
+    BCRYPT_AUTHENTICATED_CIPHER_MODE_INFO info;
+    BCRYPT_INIT_AUTH_MODE_INFO(info);
+    info.pbNonce = nonce;
+    info.cbNonce = NonceSize;
+    info.pbAuthData = m_header;
+    info.cbAuthData = HeaderSize;
+    info.pbTag = data + len;
+    info.cbTag = TagSize;
+
+    ULONG written = 0;
+    return m_key != nullptr && BCRYPT_SUCCESS(BCryptDecrypt(m_key, data, static_cast<ULONG>(len), &info, nullptr, 0, data, static_cast<ULONG>(len), &written, 0));
+#else
+    int outLen = 0;
+    return m_ctx != nullptr
+      && EVP_CipherInit_ex(m_ctx, nullptr, nullptr, nullptr, nonce, 0) == 1
+      && EVP_CipherUpdate(m_ctx, nullptr, &outLen, m_header, HeaderSize) == 1
+      && EVP_CipherUpdate(m_ctx, data, &outLen, data, static_cast<int>(len)) == 1
+      && EVP_CIPHER_CTX_ctrl(m_ctx, EVP_CTRL_AEAD_SET_TAG, TagSize, data + len) == 1
+      && EVP_CipherFinal_ex(m_ctx, data + outLen, &outLen) == 1;
+#endif
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // AeadEncryptionStream
+  //////////////////////////////////////////////////////////////////////////
+
+  AeadEncryptionStream::AeadEncryptionStream(WriteStream* dest, size_t segmentSize)
+    : m_dest(dest)
+    , m_segment(segmentSize + AeadSegmentCipher::TagSize)
+    , m_segmentSize(static_cast<int>(segmentSize))
+    , m_segmentUsed(0)
+    , m_segmentIndex(0)
+    , m_finished(false)
+  {
+    TWN_REQUIRE(segmentSize > 0 && segmentSize <= AeadSegmentCipher::MaxSegmentSize);
+  }
+
+  bool AeadEncryptionStream::Init(AeadAlgorithm algorithm, const void* key, size_t keySize)
+  {
+    uint8_t header[AeadSegmentCipher::HeaderSize];
+
+    m_segmentUsed = 0;
+    m_segmentIndex = 0;
+    m_finished = false;
+
+    return AeadSegmentCipher::CreateHeader(algorithm, static_cast<uint32_t>(m_segmentSize), header)
+      && m_cipher.Init(key, keySize, header)
+      && Stream::Copy(header, *m_dest, sizeof(header));
+  }
+
+  bool AeadEncryptionStream::NextWrite(Buffer& buffer)
+  {
+    TWN_REQUIRE(!m_finished);
+
+    // More data is coming, so a full segment can't be the last one
+    if(m_segmentUsed == m_segmentSize && !SealSegment(false))
+    {
+      return false;
+    }
+
+    buffer.SetData(m_segment.GetData() + m_segmentUsed, m_segmentSize - m_segmentUsed);
+    return true;
+  }
+
+  bool AeadEncryptionStream::AdvanceWrite(int bytes)
+  {
+    TWN_REQUIRE(bytes <= m_segmentSize - m_segmentUsed);
+
+    m_segmentUsed += bytes;
+    return true;
+  }
+
+  bool AeadEncryptionStream::Flush()
+  {
+    if(m_finished)
+    {
+      return true;
+    }
+
+    // The last segment is sealed even if it's empty, because its last flag is what shows the stream wasn't cut short
+    m_finished = true;
+    return SealSegment(true);
+  }
+
+  bool AeadEncryptionStream::SealSegment(bool lastSegment)
+  {
+    PROF_EX(AeadEncryptionStream, SealSegment);
+
+    if(m_segmentIndex == UINT32_MAX && !lastSegment)
+    {
+      TWN_BUG("AeadEncryptionStream: Too many segments");
+      return false;
+    }
+
+    if(!m_cipher.Seal(m_segmentIndex, lastSegment, m_segment.GetData(), m_segmentUsed))
+    {
+      return false;
+    }
+
+    bool ok = Stream::Copy(m_segment.GetData(), *m_dest, m_segmentUsed + AeadSegmentCipher::TagSize);
+
+    ++m_segmentIndex;
+    m_segmentUsed = 0;
+
+    return ok;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // AeadDecryptionStream
+  //////////////////////////////////////////////////////////////////////////
+
+  AeadDecryptionStream::AeadDecryptionStream(ReadStream* source)
+    : m_source(source)
+    , m_segment(0)
+    , m_segmentSize(0)
+    , m_segmentIndex(0)
+    , m_readPos(nullptr)
+    , m_readEnd(nullptr)
+    , m_finished(false)
+    , m_failed(false)
+  {
+
+  }
+
+  bool AeadDecryptionStream::Init(AeadAlgorithm algorithm, const void* key, size_t keySize)
+  {
+    uint8_t header[AeadSegmentCipher::HeaderSize];
+    AeadAlgorithm headerAlgorithm;
+    uint32_t segmentSize = 0;
+
+    m_segmentIndex = 0;
+    m_readPos = m_readEnd = nullptr;
+    m_finished = false;
+    m_failed = true;
+
+    if(!ReadExact(*m_source, header, sizeof(header))
+      || !AeadSegmentCipher::ParseHeader(header, headerAlgorithm, segmentSize)
+      || headerAlgorithm != algorithm
+      || !m_cipher.Init(key, keySize, header))
+    {
+      return false;
+    }
+
+    if(static_cast<int>(segmentSize) != m_segmentSize)
+    {
+      m_segment.Allocate(segmentSize + AeadSegmentCipher::TagSize);
+      m_segmentSize = static_cast<int>(segmentSize);
+    }
+
+    m_failed = false;
+    return true;
+  }
+
+  bool AeadDecryptionStream::NextRead(Buffer& buffer)
+  {
+    if(GetAvailableRead() == 0 && !OpenSegment())
+    {
+      return false;
+    }
+
+    buffer.SetData(m_readPos, m_readEnd - m_readPos);
+    return true;
+  }
+
+  bool AeadDecryptionStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(bytes <= GetAvailableRead());
+
+    if(bytes <= GetAvailableRead())
+    {
+      m_readPos += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool AeadDecryptionStream::OpenSegment()
+  {
+    PROF_EX(AeadDecryptionStream, OpenSegment);
+
+    if(m_finished || m_failed)
+    {
+      return false;
+    }
+
+    uint8_t* segment = m_segment.GetData();
+    int encryptedSize = m_segmentSize + AeadSegmentCipher::TagSize;
+    int len = 0;
+
+    Buffer buffer;
+    while(len < encryptedSize && m_source->NextRead(buffer) && buffer.GetDataLen() > 0)
+    {
+      int chunk = twn::min<int>(encryptedSize - len, static_cast<int>(buffer.GetDataLen()));
+      memcpy(segment + len, buffer.GetData(), chunk);
+      m_source->AdvanceRead(chunk);
+      len += chunk;
+    }
+
+    // A short segment is the last one; a full one is the last if the source has nothing after it
+    bool lastSegment = len < encryptedSize || !m_source->NextRead(buffer) || buffer.GetDataLen() == 0;
+
+    if(len < AeadSegmentCipher::TagSize || !m_cipher.Open(m_segmentIndex, lastSegment, segment, len - AeadSegmentCipher::TagSize))
+    {
+      // Truncated, reordered or tampered with
+      m_failed = true;
+      m_readPos = m_readEnd = nullptr;
+      return false;
+    }
+
+    ++m_segmentIndex;
+    m_finished = lastSegment;
+    m_readPos = segment;
+    m_readEnd = segment + len - AeadSegmentCipher::TagSize;
+
+    return true;
+  }
+}
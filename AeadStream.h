@@ -0,0 +1,139 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+#if defined(USE_BCRYPT)
+#include <windows.h>
+#include <bcrypt.h>
+#endif
+
+namespace TWN
+{
+  enum class AeadAlgorithm : uint8_t
+  {
+    Aes128Gcm = 1,
+    Aes256Gcm = 2,
+    ChaCha20Poly1305 = 3, // Not available with BCrypt
+  };
+
+  // Seals and opens single segments of the segmented AEAD stream format:
+  //
+  //   header:  version (1) | algorithm (1) | segment size (4, big-endian) | salt (16) | nonce prefix (7)
+  //   segment: ciphertext (segment size, or less for the last one) | tag (16)
+  //
+  // Each stream derives its own segment key from the caller's key and the random salt (HKDF-SHA256), so a key can be reused across streams.
+  // Segment i is sealed with nonce = prefix | i (4, big-endian) | last flag (1) and the header as associated data, which means segments can't be
+  // reordered or moved between streams, and a stream cut off on a segment boundary fails to open because its last segment isn't marked as last.
+  // Segments are independent, so they can be sealed and opened in any order, on any thread, given one AeadSegmentCipher per thread.
+  // AES-GCM runs on the native kernels (see CipherKernels) when the CPU has them.
+  class AeadSegmentCipher
+  {
+  public:
+    static const int Version = 1;
+    static const int SaltSize = 16;
+    static const int NoncePrefixSize = 7;
+    static const int NonceSize = 12;
+    static const int TagSize = 16;
+    static const int HeaderSize = 6 + SaltSize + NoncePrefixSize;
+    static const uint32_t MaxSegmentSize = 16 * 1024 * 1024;
+
+    AeadSegmentCipher();
+    ~AeadSegmentCipher();
+
+    // Fill in a header with a fresh salt and nonce prefix, for encrypting a new stream
+    static bool CreateHeader(AeadAlgorithm algorithm, uint32_t segmentSize, uint8_t* header);
+    static bool ParseHeader(const uint8_t* header, AeadAlgorithm& algorithm, uint32_t& segmentSize);
+
+    bool Init(const void* key, size_t keySize, const uint8_t* header);
+
+    // Encrypt len bytes in place and write the tag straight after them
+    bool Seal(uint32_t segmentIndex, bool lastSegment, uint8_t* data, size_t len);
+
+    // Verify the tag straight after len bytes of ciphertext and decrypt them in place. Returns false if the segment isn't authentic,
+    // in which case the contents of data must not be used.
+    bool Open(uint32_t segmentIndex, bool lastSegment, uint8_t* data, size_t len);
+
+  private:
+    AeadSegmentCipher(const AeadSegmentCipher&) = delete;
+    AeadSegmentCipher& operator=(const AeadSegmentCipher&) = delete;
+
+    void MakeNonce(uint32_t segmentIndex, bool lastSegment, uint8_t* nonce) const;
+    void Release();
+
+    AeadAlgorithm m_algorithm;
+    uint8_t m_header[HeaderSize];
+    GcmKernel m_gcm; // Used instead of the platform library for AES-GCM when the CPU has native kernels for it
+    bool m_native;
+#if defined(USE_BCRYPT)
+    BCRYPT_ALG_HANDLE m_provider;
+    BCRYPT_KEY_HANDLE m_key;
+#else
+    EVP_CIPHER_CTX* m_ctx;
+#endif
+  };
+
+  // Encrypts and authenticates data in fixed-size segments (see AeadSegmentCipher for the format).
+  // A segment is sealed once it is full and more room is asked for; Flush() seals the rest as the last segment and must be called at the end.
+  class AeadEncryptionStream : public WriteStream
+  {
+  public:
+    static const size_t DefaultSegmentSize = 64 * 1024;
+
+    AeadEncryptionStream(WriteStream* dest, size_t segmentSize = DefaultSegmentSize);
+
+    // Writes the stream header to dest
+    bool Init(AeadAlgorithm algorithm, const void* key, size_t keySize);
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    bool Flush();
+
+  protected:
+    bool SealSegment(bool lastSegment);
+
+    WriteStream* m_dest;
+    AeadSegmentCipher m_cipher;
+
+    CryptoBuffer m_segment; // Segment size plus room for the tag
+    int m_segmentSize;
+    int m_segmentUsed;
+    uint32_t m_segmentIndex;
+    bool m_finished;
+  };
+
+  // Decrypts data written by an AeadEncryptionStream, handing out each segment only once it has been verified.
+  // NextRead returns false both at the end of the data and when a segment fails to verify; use IsComplete() to tell them apart.
+  class AeadDecryptionStream : public ReadStream
+  {
+  public:
+    AeadDecryptionStream(ReadStream* source);
+
+    // Reads and checks the stream header from source
+    bool Init(AeadAlgorithm algorithm, const void* key, size_t keySize);
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    // True once the last segment has been verified, so the whole stream was authentic and nothing was cut off
+    bool IsComplete() const { return m_finished && !m_failed; }
+    bool HasFailed() const { return m_failed; }
+
+    void SetSource(ReadStream* source) { m_source = source; }
+
+  protected:
+    bool OpenSegment();
+    int GetAvailableRead() const { return m_readEnd - m_readPos; }
+
+    ReadStream* m_source;
+    AeadSegmentCipher m_cipher;
+
+    CryptoBuffer m_segment;
+    int m_segmentSize;
+    uint32_t m_segmentIndex;
+    uint8_t* m_readPos;
+    uint8_t* m_readEnd;
+    bool m_finished;
+    bool m_failed;
+  };
+}
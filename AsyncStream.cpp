@@ -0,0 +1,277 @@
+#include "AsyncStream.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // AsyncWriteStream
+  //////////////////////////////////////////////////////////////////////////
+
+  AsyncWriteStream::AsyncWriteStream(WriteStream* dest, int bufferCount, size_t bufferSize)
+    : m_dest(dest)
+    , m_bufferSize(static_cast<int>(bufferSize))
+    , m_fill(0)
+    , m_drain(0)
+    , m_queued(0)
+    , m_failed(false)
+    , m_stopping(false)
+  {
+    TWN_REQUIRE(bufferCount >= 2);
+
+    for(int i = 0; i < bufferCount; ++i)
+    {
+      m_slots.emplace_back(new Slot(bufferSize));
+    }
+
+    m_writer = std::thread(&AsyncWriteStream::WriterMain, this);
+  }
+
+  AsyncWriteStream::~AsyncWriteStream()
+  {
+    Flush();
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_slotQueued.notify_one();
+    m_writer.join();
+  }
+
+  bool AsyncWriteStream::NextWrite(Buffer& buffer)
+  {
+    if(m_slots[m_fill]->used == m_bufferSize && !Submit())
+    {
+      return false;
+    }
+
+    Slot* slot = m_slots[m_fill].get();
+    buffer.SetData(slot->buffer.GetData() + slot->used, m_bufferSize - slot->used);
+    return true;
+  }
+
+  bool AsyncWriteStream::AdvanceWrite(int bytes)
+  {
+    Slot& slot = *m_slots[m_fill];
+    TWN_REQUIRE(bytes <= m_bufferSize - slot.used);
+
+    slot.used += bytes;
+
+    // Start writing a full buffer straight away rather than on the next NextWrite
+    if(slot.used == m_bufferSize)
+    {
+      return Submit();
+    }
+
+    return true;
+  }
+
+  bool AsyncWriteStream::Flush()
+  {
+    PROF_EX(AsyncWriteStream, Flush);
+
+    if(m_slots[m_fill]->used > 0)
+    {
+      Submit();
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_slotWritten.wait(lock, [this]() { return m_queued == 0; });
+
+    return !m_failed;
+  }
+
+  bool AsyncWriteStream::Submit()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    ++m_queued;
+    m_fill = (m_fill + 1) % m_slots.size();
+    m_slotQueued.notify_one();
+
+    // Wait for the next slot to be written if every slot is queued
+    m_slotWritten.wait(lock, [this]() { return m_queued < m_slots.size(); });
+    m_slots[m_fill]->used = 0;
+
+    return !m_failed;
+  }
+
+  void AsyncWriteStream::WriterMain()
+  {
+    for(;;)
+    {
+      Slot* slot = nullptr;
+      bool failed = false;
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_slotQueued.wait(lock, [this]() { return m_stopping || m_queued > 0; });
+
+        if(m_queued == 0)
+        {
+          return;
+        }
+
+        slot = m_slots[m_drain].get();
+        failed = m_failed;
+      }
+
+      // Once a write fails, the rest are dropped but still drained so the caller doesn't block
+      bool ok = !failed && Stream::Copy(slot->buffer.GetData(), *m_dest, slot->used);
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_failed = m_failed || !ok;
+        m_drain = (m_drain + 1) % m_slots.size();
+        --m_queued;
+      }
+
+      m_slotWritten.notify_one();
+    }
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // AsyncReadStream
+  //////////////////////////////////////////////////////////////////////////
+
+  AsyncReadStream::AsyncReadStream(ReadStream* source, int bufferCount, size_t bufferSize)
+    : m_source(source)
+    , m_bufferSize(static_cast<int>(bufferSize))
+    , m_read(0)
+    , m_filled(0)
+    , m_open(false)
+    , m_sourceDone(false)
+    , m_stopping(false)
+  {
+    TWN_REQUIRE(bufferCount >= 2);
+
+    for(int i = 0; i < bufferCount; ++i)
+    {
+      m_slots.emplace_back(new Slot(bufferSize));
+    }
+
+    m_reader = std::thread(&AsyncReadStream::ReaderMain, this);
+  }
+
+  AsyncReadStream::~AsyncReadStream()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_slotFreed.notify_one();
+    m_reader.join();
+  }
+
+  bool AsyncReadStream::NextRead(Buffer& buffer)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    // Give a finished buffer back to the reader
+    if(m_open && m_slots[m_read]->readPos == m_slots[m_read]->used)
+    {
+      m_read = (m_read + 1) % m_slots.size();
+      --m_filled;
+      m_open = false;
+      m_slotFreed.notify_one();
+    }
+
+    if(!m_open)
+    {
+      PROF_EX(AsyncReadStream, Wait);
+
+      m_slotFilled.wait(lock, [this]() { return m_filled > 0 || m_sourceDone; });
+
+      if(m_filled == 0)
+      {
+        return false;
+      }
+
+      m_open = true;
+    }
+
+    Slot& slot = *m_slots[m_read];
+    buffer.SetData(slot.buffer.GetData() + slot.readPos, slot.used - slot.readPos);
+    return true;
+  }
+
+  bool AsyncReadStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(m_open);
+
+    Slot& slot = *m_slots[m_read];
+    TWN_REQUIRE(bytes <= slot.used - slot.readPos);
+
+    if(bytes <= slot.used - slot.readPos)
+    {
+      slot.readPos += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  void AsyncReadStream::ReaderMain()
+  {
+    for(;;)
+    {
+      Slot* slot = nullptr;
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_slotFreed.wait(lock, [this]() { return m_stopping || m_filled < m_slots.size(); });
+
+        if(m_stopping)
+        {
+          return;
+        }
+
+        slot = m_slots[(m_read + m_filled) % m_slots.size()].get();
+      }
+
+      // Fill the whole buffer, so the consumer sees large chunks however small the source's are
+      uint8_t* data = slot->buffer.GetData();
+      int len = 0;
+      bool sourceDone = false;
+
+      Buffer buffer;
+      while(len < m_bufferSize)
+      {
+        if(!m_source->NextRead(buffer) || buffer.GetDataLen() == 0)
+        {
+          sourceDone = true;
+          break;
+        }
+
+        int chunk = twn::min<int>(m_bufferSize - len, static_cast<int>(buffer.GetDataLen()));
+        memcpy(data + len, buffer.GetData(), chunk);
+        m_source->AdvanceRead(chunk);
+        len += chunk;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if(len > 0)
+        {
+          slot->used = len;
+          slot->readPos = 0;
+          ++m_filled;
+        }
+
+        m_sourceDone = sourceDone;
+        m_slotFilled.notify_one();
+      }
+
+      if(sourceDone)
+      {
+        return;
+      }
+    }
+  }
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TWN
+{
+  // Buffers writes in a ring of bufferCount buffers and writes them to dest on a background thread, so the caller can fill (and encrypt)
+  // buffer N + 1 while buffer N is being written. Once all buffers are waiting to be written, NextWrite blocks until the oldest is done.
+  // dest is only used by the background thread until Flush() returns.
+  class AsyncWriteStream : public WriteStream
+  {
+  public:
+    static const int DefaultBufferCount = 4;
+    static const size_t DefaultBufferSize = 256 * 1024;
+
+    AsyncWriteStream(WriteStream* dest, int bufferCount = DefaultBufferCount, size_t bufferSize = DefaultBufferSize);
+
+    // Flushes, then stops the background thread
+    ~AsyncWriteStream();
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    // Queue the buffer being filled and wait until everything queued has been written; returns false if any write to dest failed
+    bool Flush();
+
+  private:
+    AsyncWriteStream(const AsyncWriteStream&) = delete;
+    AsyncWriteStream& operator=(const AsyncWriteStream&) = delete;
+
+    struct Slot
+    {
+      Slot(size_t size) : buffer(size), used(0) {}
+
+      CryptoBuffer buffer;
+      int used;
+    };
+
+    bool Submit();
+    void WriterMain();
+
+    WriteStream* m_dest;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    int m_bufferSize;
+
+    // The writer drains m_queued slots starting at m_drain; the caller fills the slot after them, m_fill
+    size_t m_fill;
+    size_t m_drain;
+    size_t m_queued;
+    bool m_failed;
+    bool m_stopping;
+
+    std::mutex m_mutex;
+    std::condition_variable m_slotQueued;
+    std::condition_variable m_slotWritten;
+    std::thread m_writer;
+  };
+
+  // Reads ahead from source on a background thread into a ring of bufferCount buffers, so source latency overlaps with whatever the caller
+  // does with the data. The buffers handed out are writable and stay valid until the next NextRead, so they can be decrypted in place.
+  // source is only used by the background thread.
+  class AsyncReadStream : public ReadStream
+  {
+  public:
+    static const int DefaultBufferCount = 4;
+    static const size_t DefaultBufferSize = 256 * 1024;
+
+    AsyncReadStream(ReadStream* source, int bufferCount = DefaultBufferCount, size_t bufferSize = DefaultBufferSize);
+
+    // Stops the background thread, which finishes the read it is doing first
+    ~AsyncReadStream();
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+  private:
+    AsyncReadStream(const AsyncReadStream&) = delete;
+    AsyncReadStream& operator=(const AsyncReadStream&) = delete;
+
+    struct Slot
+    {
+      Slot(size_t size) : buffer(size), used(0), readPos(0) {}
+
+      CryptoBuffer buffer;
+      int used;
+      int readPos;
+    };
+
+    void ReaderMain();
+
+    ReadStream* m_source;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+    int m_bufferSize;
+
+    // m_filled slots starting at m_read are ready to be read, including the one being read when m_open is set; the reader fills the slot after them
+    size_t m_read;
+    size_t m_filled;
+    bool m_open;
+    bool m_sourceDone;
+    bool m_stopping;
+
+    std::mutex m_mutex;
+    std::condition_variable m_slotFilled;
+    std::condition_variable m_slotFreed;
+    std::thread m_reader;
+  };
+}
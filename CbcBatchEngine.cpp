@@ -0,0 +1,96 @@
+#include "CbcBatchEngine.h"
+
+#include "Common/Assert.h"
+
+namespace TWN
+{
+  CbcBatchEngine::CbcBatchEngine(int batchSize)
+    : m_batchSize(batchSize)
+  {
+    TWN_REQUIRE(batchSize > 0 && batchSize <= AesKernel::MaxCbcLanes);
+  }
+
+  std::vector<CbcBatchJob*>& CbcBatchEngine::GetQueue(const CbcBatchJob* job)
+  {
+    return m_queues[job->lane.key->GetRounds() == 10 ? 0 : 1];
+  }
+
+  void CbcBatchEngine::Submit(CbcBatchJob* job)
+  {
+    TWN_REQUIRE(job->state != CbcBatchJob::Queued && job->state != CbcBatchJob::Running);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    std::vector<CbcBatchJob*>& queue = GetQueue(job);
+    job->state = CbcBatchJob::Queued;
+    queue.push_back(job);
+
+    if(static_cast<int>(queue.size()) >= m_batchSize)
+    {
+      RunBatch(lock, queue);
+    }
+  }
+
+  void CbcBatchEngine::Wait(CbcBatchJob* job)
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    while(job->state != CbcBatchJob::Done)
+    {
+      if(job->state == CbcBatchJob::Queued)
+      {
+        // Batches take jobs oldest first, so running batches until this one is taken never takes more than the jobs queued before it
+        RunBatch(lock, GetQueue(job));
+      }
+      else
+      {
+        m_batchDone.wait(lock);
+      }
+    }
+
+    job->state = CbcBatchJob::Idle;
+  }
+
+  void CbcBatchEngine::RunAll()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+
+    for(std::vector<CbcBatchJob*>& queue : m_queues)
+    {
+      while(!queue.empty())
+      {
+        RunBatch(lock, queue);
+      }
+    }
+  }
+
+  void CbcBatchEngine::RunBatch(std::unique_lock<std::mutex>& lock, std::vector<CbcBatchJob*>& queue)
+  {
+    PROF_EX(CbcBatchEngine, RunBatch);
+
+    CbcBatchJob* jobs[AesKernel::MaxCbcLanes];
+    CbcLane lanes[AesKernel::MaxCbcLanes];
+    int count = twn::min<int>(static_cast<int>(queue.size()), AesKernel::MaxCbcLanes);
+
+    for(int i = 0; i < count; ++i)
+    {
+      jobs[i] = queue[i];
+      jobs[i]->state = CbcBatchJob::Running;
+      lanes[i] = jobs[i]->lane;
+    }
+
+    queue.erase(queue.begin(), queue.begin() + count);
+
+    // Other threads can keep queueing while this batch runs
+    lock.unlock();
+    AesKernel::CbcEncryptInterleaved(lanes, count);
+    lock.lock();
+
+    for(int i = 0; i < count; ++i)
+    {
+      jobs[i]->state = CbcBatchJob::Done;
+    }
+
+    m_batchDone.notify_all();
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "CipherKernels.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+namespace TWN
+{
+  // A run of blocks queued on a CbcBatchEngine by one stream
+  struct CbcBatchJob
+  {
+    enum State
+    {
+      Idle,
+      Queued,
+      Running,
+      Done,
+    };
+
+    CbcBatchJob() : state(Idle) {}
+
+    CbcLane lane;
+    State state; // Guarded by the engine's mutex
+  };
+
+  // Collects CBC encryption runs from many streams and encrypts up to AesKernel::MaxCbcLanes of them at once, interleaved in one kernel.
+  // A single CBC chain is serial, so it leaves the AES units idle most of the time; independent chains fill those gaps.
+  // A batch runs as soon as enough jobs are queued, or when a stream needs its job finished (Wait), so no stream waits on others for long.
+  // Streams may be on different threads; a batch runs on whichever thread fills it or waits on it.
+  class CbcBatchEngine
+  {
+  public:
+    // batchSize is the number of jobs that triggers a batch, at most AesKernel::MaxCbcLanes
+    CbcBatchEngine(int batchSize = AesKernel::MaxCbcLanes);
+
+    // The job's lane must be filled in, and the job left alone until Wait returns
+    void Submit(CbcBatchJob* job);
+
+    // Return once the job has been encrypted, running it (along with whatever else is queued) if no one has yet
+    void Wait(CbcBatchJob* job);
+
+    // Run everything queued
+    void RunAll();
+
+  private:
+    CbcBatchEngine(const CbcBatchEngine&) = delete;
+    CbcBatchEngine& operator=(const CbcBatchEngine&) = delete;
+
+    std::vector<CbcBatchJob*>& GetQueue(const CbcBatchJob* job);
+    void RunBatch(std::unique_lock<std::mutex>& lock, std::vector<CbcBatchJob*>& queue);
+
+    std::mutex m_mutex;
+    std::condition_variable m_batchDone;
+    std::vector<CbcBatchJob*> m_queues[2]; // AES-128 and AES-256 chains, since a batch has to share one round count
+    int m_batchSize;
+  };
+}
@@ -0,0 +1,554 @@
+// Checks the native cipher kernels against the platform library (EVP): AES-CTR and AES-CBC through StreamCrypto, and AES-GCM through
+// GcmKernel, on random keys, lengths and chunkings, at every kernel level this CPU supports (selected with CipherKernels::Limit).
+// Interleaved CBC chains, directly and through CbcBatchEngine, are checked against serial CBC the same way. ChaCha20 and XChaCha20 are
+// checked against the RFC 8439 and draft-irtf-cfrg-xchacha vectors and against EVP_chacha20 at every ChaCha kernel level.
+// Prints each failed check and exits with a non-zero status if there were any.
+//
+//   CipherKernelTest [--seed N]
+
+#include "CipherKernels.h"
+#include "CbcBatchEngine.h"
+
+#include "Common/Assert.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace TWN
+{
+  namespace
+  {
+    int g_failures = 0;
+
+    void Check(bool condition, const char* expression, const char* file, int line)
+    {
+      if(!condition)
+      {
+        fprintf(stderr, "%s(%d): check failed: %s\n", file, line, expression);
+        ++g_failures;
+      }
+    }
+
+#define TWN_TEST_CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+    typedef std::mt19937 Random;
+
+    std::vector<uint8_t> RandomBytes(Random& random, size_t len)
+    {
+      std::vector<uint8_t> bytes(len);
+      for(uint8_t& byte : bytes)
+      {
+        byte = static_cast<uint8_t>(random());
+      }
+
+      return bytes;
+    }
+
+    // Whole buffer through EVP, without padding
+    std::vector<uint8_t> EvpCipher(const EVP_CIPHER* cipher, const uint8_t* key, const uint8_t* iv, bool encrypt, const std::vector<uint8_t>& src)
+    {
+      std::vector<uint8_t> dst(src.size() + 64);
+      int written = 0;
+      int finalWritten = 0;
+
+      EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+      bool ok = EVP_CipherInit_ex(ctx, cipher, nullptr, key, iv, encrypt ? 1 : 0) == 1
+        && EVP_CIPHER_CTX_set_padding(ctx, 0) == 1
+        && EVP_CipherUpdate(ctx, dst.data(), &written, src.data(), static_cast<int>(src.size())) == 1
+        && EVP_CipherFinal_ex(ctx, dst.data() + written, &finalWritten) == 1;
+      EVP_CIPHER_CTX_free(ctx);
+
+      TWN_TEST_CHECK(ok);
+      dst.resize(ok ? written + finalWritten : 0);
+      return dst;
+    }
+
+    // Through a StreamCrypto in random-sized pieces, so partial blocks are carried between calls
+    std::vector<uint8_t> CipherChunked(StreamCrypto& crypto, const std::vector<uint8_t>& src, Random& random)
+    {
+      std::vector<uint8_t> dst(src.size());
+      size_t read = 0;
+      size_t written = 0;
+
+      while(read < src.size())
+      {
+        // Mostly small and odd-sized, sometimes large enough for the wide kernels to get going
+        size_t chunk = (random() % 4 == 0) ? random() % 4096 : random() % 40;
+        chunk = twn::min<size_t>(chunk + 1, src.size() - read);
+
+        written += crypto.Cipher(src.data() + read, dst.data() + written, chunk);
+        read += chunk;
+      }
+
+      dst.resize(written);
+      return dst;
+    }
+
+    void WriteBigEndian64(uint8_t* dst, uint64_t value)
+    {
+      for(int i = 7; i >= 0; --i)
+      {
+        dst[i] = static_cast<uint8_t>(value);
+        value >>= 8;
+      }
+    }
+
+    struct AesLevel
+    {
+      CipherKernel aes;
+      GhashKernel ghash;
+    };
+
+    const AesLevel AesLevels[] =
+    {
+      { CipherKernel::AesNi, GhashKernel::Clmul },
+      { CipherKernel::VaesAvx512, GhashKernel::Clmul },
+      { CipherKernel::VaesAvx512, GhashKernel::VpclmulAvx512 },
+    };
+
+    struct AesAlgorithm
+    {
+      size_t keySize;
+      int ctr;
+      int cbc;
+      const EVP_CIPHER* (*evpCtr)();
+      const EVP_CIPHER* (*evpCbc)();
+      const EVP_CIPHER* (*evpGcm)();
+    };
+
+    const AesAlgorithm AesAlgorithms[] =
+    {
+      { 16, NativeAes128Ctr, NativeAes128Cbc, EVP_aes_128_ctr, EVP_aes_128_cbc, EVP_aes_128_gcm },
+      { 32, NativeAes256Ctr, NativeAes256Cbc, EVP_aes_256_ctr, EVP_aes_256_cbc, EVP_aes_256_gcm },
+    };
+
+    void TestAesCtr(const AesAlgorithm& algorithm, Random& random)
+    {
+      for(int i = 0; i < 40; ++i)
+      {
+        std::vector<uint8_t> key = RandomBytes(random, algorithm.keySize);
+        std::vector<uint8_t> iv = RandomBytes(random, 16);
+
+        // Start some runs just short of the low half of the counter carrying into the high half, or of the whole counter wrapping
+        if(i % 4 == 1)
+        {
+          WriteBigEndian64(iv.data() + 8, UINT64_MAX - random() % 8);
+        }
+        else if(i % 4 == 2)
+        {
+          WriteBigEndian64(iv.data(), UINT64_MAX);
+          WriteBigEndian64(iv.data() + 8, UINT64_MAX - random() % 8);
+        }
+
+        std::vector<uint8_t> plain = RandomBytes(random, random() % 20000);
+
+        StreamCrypto crypto;
+        TWN_TEST_CHECK(crypto.Init(algorithm.ctr, key.data(), key.size(), iv.data(), iv.size(), true, true));
+        TWN_TEST_CHECK(CipherChunked(crypto, plain, random) == EvpCipher(algorithm.evpCtr(), key.data(), iv.data(), true, plain));
+      }
+    }
+
+    void TestAesCbc(const AesAlgorithm& algorithm, Random& random)
+    {
+      for(int i = 0; i < 40; ++i)
+      {
+        std::vector<uint8_t> key = RandomBytes(random, algorithm.keySize);
+        std::vector<uint8_t> iv = RandomBytes(random, 16);
+        std::vector<uint8_t> plain = RandomBytes(random, (random() % 1250) * 16);
+
+        std::vector<uint8_t> expected = EvpCipher(algorithm.evpCbc(), key.data(), iv.data(), true, plain);
+
+        StreamCrypto encrypt;
+        TWN_TEST_CHECK(encrypt.Init(algorithm.cbc, key.data(), key.size(), iv.data(), iv.size(), true, false));
+        TWN_TEST_CHECK(CipherChunked(encrypt, plain, random) == expected);
+
+        StreamCrypto decrypt;
+        TWN_TEST_CHECK(decrypt.Init(algorithm.cbc, key.data(), key.size(), iv.data(), iv.size(), false, false));
+        TWN_TEST_CHECK(CipherChunked(decrypt, expected, random) == plain);
+      }
+    }
+
+    void TestAesGcm(const AesAlgorithm& algorithm, Random& random)
+    {
+      for(int i = 0; i < 40; ++i)
+      {
+        std::vector<uint8_t> key = RandomBytes(random, algorithm.keySize);
+        std::vector<uint8_t> nonce = RandomBytes(random, GcmKernel::NonceSize);
+        std::vector<uint8_t> aad = RandomBytes(random, (i % 3 == 0) ? 0 : random() % 100);
+        std::vector<uint8_t> plain = RandomBytes(random, random() % 5000);
+
+        // EVP's ciphertext and tag
+        std::vector<uint8_t> expected(plain.size() + 16);
+        uint8_t expectedTag[GcmKernel::TagSize];
+        int written = 0;
+        int finalWritten = 0;
+
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        bool ok = EVP_EncryptInit_ex(ctx, algorithm.evpGcm(), nullptr, key.data(), nonce.data()) == 1
+          && EVP_EncryptUpdate(ctx, nullptr, &written, aad.data(), static_cast<int>(aad.size())) == 1
+          && EVP_EncryptUpdate(ctx, expected.data(), &written, plain.data(), static_cast<int>(plain.size())) == 1
+          && EVP_EncryptFinal_ex(ctx, expected.data() + written, &finalWritten) == 1
+          && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, GcmKernel::TagSize, expectedTag) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+
+        TWN_TEST_CHECK(ok);
+        expected.resize(written + finalWritten);
+
+        GcmKernel gcm;
+        TWN_TEST_CHECK(gcm.Init(key.data(), key.size()));
+
+        std::vector<uint8_t> data = plain;
+        uint8_t tag[GcmKernel::TagSize];
+        gcm.Seal(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag);
+
+        TWN_TEST_CHECK(data == expected);
+        TWN_TEST_CHECK(memcmp(tag, expectedTag, sizeof(tag)) == 0);
+
+        TWN_TEST_CHECK(gcm.Open(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag));
+        TWN_TEST_CHECK(data == plain);
+
+        // A bad tag is rejected and leaves the data alone
+        gcm.Seal(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag);
+        tag[random() % sizeof(tag)] ^= static_cast<uint8_t>(1 << (random() % 8));
+        TWN_TEST_CHECK(!gcm.Open(nonce.data(), aad.data(), aad.size(), data.data(), data.size(), tag));
+        TWN_TEST_CHECK(data == expected);
+      }
+    }
+
+    void TestAes(Random& random)
+    {
+      for(const AesLevel& level : AesLevels)
+      {
+        CipherKernels::Limit(level.aes, level.ghash);
+
+        if(CipherKernels::GetAesKernel() != level.aes || CipherKernels::GetGhashKernel() != level.ghash)
+        {
+          printf("Skipping aes: %s, ghash: %s: not supported by this CPU\n", CipherKernels::GetName(level.aes), CipherKernels::GetName(level.ghash));
+          continue;
+        }
+
+        printf("Testing %s\n", CipherKernels::Describe());
+
+        for(const AesAlgorithm& algorithm : AesAlgorithms)
+        {
+          TestAesCtr(algorithm, random);
+          TestAesCbc(algorithm, random);
+          TestAesGcm(algorithm, random);
+        }
+      }
+
+      CipherKernels::Limit(CipherKernel::VaesAvx512, GhashKernel::VpclmulAvx512);
+    }
+
+    // RFC 8439 section 2.4.2: key 00..1f, counter 1
+    const uint8_t ChaChaNonce[12] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00 };
+    const char ChaChaPlain[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+    const uint8_t ChaChaCipherText[] =
+    {
+      0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68, 0xf9, 0x80, 0x41, 0xba, 0x07, 0x28, 0xdd, 0x0d, 0x69, 0x81,
+      0xe9, 0x7e, 0x7a, 0xec, 0x1d, 0x43, 0x60, 0xc2, 0x0a, 0x27, 0xaf, 0xcc, 0xfd, 0x9f, 0xae, 0x0b,
+      0xf9, 0x1b, 0x65, 0xc5, 0x52, 0x47, 0x33, 0xab, 0x8f, 0x59, 0x3d, 0xab, 0xcd, 0x62, 0xb3, 0x57,
+      0x16, 0x39, 0xd6, 0x24, 0xe6, 0x51, 0x52, 0xab, 0x8f, 0x53, 0x0c, 0x35, 0x9f, 0x08, 0x61, 0xd8,
+      0x07, 0xca, 0x0d, 0xbf, 0x50, 0x0d, 0x6a, 0x61, 0x56, 0xa3, 0x8e, 0x08, 0x8a, 0x22, 0xb6, 0x5e,
+      0x52, 0xbc, 0x51, 0x4d, 0x16, 0xcc, 0xf8, 0x06, 0x81, 0x8c, 0xe9, 0x1a, 0xb7, 0x79, 0x37, 0x36,
+      0x5a, 0xf9, 0x0b, 0xbf, 0x74, 0xa3, 0x5b, 0xe6, 0xb4, 0x0b, 0x8e, 0xed, 0xf2, 0x78, 0x5e, 0x42,
+      0x87, 0x4d,
+    };
+
+    // draft-irtf-cfrg-xchacha section 2.2.1: key 00..1f
+    const uint8_t HChaChaNonce[16] = { 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, 0x4a, 0x00, 0x00, 0x00, 0x00, 0x31, 0x41, 0x59, 0x27 };
+    const uint8_t HChaChaSubkey[32] =
+    {
+      0x82, 0x41, 0x3b, 0x42, 0x27, 0xb2, 0x7b, 0xfe, 0xd3, 0x0e, 0x42, 0x50, 0x8a, 0x87, 0x7d, 0x73,
+      0xa0, 0xf9, 0xe4, 0xd5, 0x8a, 0x74, 0xa8, 0x53, 0xc1, 0x2e, 0xc4, 0x13, 0x26, 0xd3, 0xec, 0xdc,
+    };
+
+    const ChaChaKernel ChaChaLevels[] = { ChaChaKernel::Scalar, ChaChaKernel::Avx2, ChaChaKernel::Avx512 };
+
+    void TestChaChaVectors()
+    {
+      uint8_t key[32];
+      for(int i = 0; i < 32; ++i)
+      {
+        key[i] = static_cast<uint8_t>(i);
+      }
+
+      // The 12-byte nonce starts at counter 0, so the RFC's counter of 1 needs the 16-byte form
+      uint8_t iv[16] = { 0x01, 0x00, 0x00, 0x00 };
+      memcpy(iv + 4, ChaChaNonce, sizeof(ChaChaNonce));
+
+      std::vector<uint8_t> data(ChaChaPlain, ChaChaPlain + sizeof(ChaChaPlain) - 1);
+      TWN_TEST_CHECK(data.size() == sizeof(ChaChaCipherText));
+
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(crypto.Init(NativeChaCha20, key, sizeof(key), iv, sizeof(iv), true, true));
+      crypto.Cipher(data.data(), data.size());
+      TWN_TEST_CHECK(memcmp(data.data(), ChaChaCipherText, sizeof(ChaChaCipherText)) == 0);
+
+      uint8_t subkey[32];
+      ChaChaCipher::HChaCha20(key, HChaChaNonce, subkey);
+      TWN_TEST_CHECK(memcmp(subkey, HChaChaSubkey, sizeof(subkey)) == 0);
+    }
+
+    void TestChaCha20(Random& random)
+    {
+      for(int i = 0; i < 40; ++i)
+      {
+        std::vector<uint8_t> key = RandomBytes(random, 32);
+        std::vector<uint8_t> iv = RandomBytes(random, 16);
+
+        // Start some runs just short of the 32-bit block counter carrying into the next word
+        uint32_t counter = (i % 2 == 1) ? UINT32_MAX - random() % 8 : random() % 1000;
+        for(int byte = 0; byte < 4; ++byte)
+        {
+          iv[byte] = static_cast<uint8_t>(counter >> (8 * byte));
+        }
+
+        std::vector<uint8_t> plain = RandomBytes(random, random() % 20000);
+        std::vector<uint8_t> expected = EvpCipher(EVP_chacha20(), key.data(), iv.data(), true, plain);
+
+        StreamCrypto crypto;
+        TWN_TEST_CHECK(crypto.Init(NativeChaCha20, key.data(), key.size(), iv.data(), iv.size(), true, true));
+        TWN_TEST_CHECK(CipherChunked(crypto, plain, random) == expected);
+
+        // Seeking to any byte and ciphering from there gives the same bytes
+        for(int seek = 0; seek < 4; ++seek)
+        {
+          size_t offset = plain.empty() ? 0 : random() % plain.size();
+          std::vector<uint8_t> tail(plain.begin() + offset, plain.end());
+
+          TWN_TEST_CHECK(crypto.Init(NativeChaCha20, key.data(), key.size(), iv.data(), iv.size(), true, true));
+          TWN_TEST_CHECK(crypto.SeekKeystream(offset));
+          TWN_TEST_CHECK(CipherChunked(crypto, tail, random) == std::vector<uint8_t>(expected.begin() + offset, expected.end()));
+        }
+      }
+    }
+
+    // XChaCha20 is ChaCha20 from counter 0 under the HChaCha20 subkey, with the last 8 bytes of the nonce after four zero bytes
+    void TestXChaCha20(Random& random)
+    {
+      for(int i = 0; i < 20; ++i)
+      {
+        std::vector<uint8_t> key = RandomBytes(random, 32);
+        std::vector<uint8_t> nonce = RandomBytes(random, 24);
+        std::vector<uint8_t> plain = RandomBytes(random, random() % 20000);
+
+        uint8_t subkey[32];
+        uint8_t iv[16] = {};
+        ChaChaCipher::HChaCha20(key.data(), nonce.data(), subkey);
+        memcpy(iv + 8, nonce.data() + 16, 8);
+
+        StreamCrypto crypto;
+        TWN_TEST_CHECK(crypto.Init(NativeXChaCha20, key.data(), key.size(), nonce.data(), nonce.size(), true, true));
+        TWN_TEST_CHECK(CipherChunked(crypto, plain, random) == EvpCipher(EVP_chacha20(), subkey, iv, true, plain));
+      }
+    }
+
+    void TestChaCha(Random& random)
+    {
+      for(ChaChaKernel level : ChaChaLevels)
+      {
+        CipherKernels::Limit(CipherKernel::VaesAvx512, GhashKernel::VpclmulAvx512, level);
+
+        if(CipherKernels::GetChaChaKernel() != level)
+        {
+          printf("Skipping chacha: %s: not supported by this CPU\n", CipherKernels::GetName(level));
+          continue;
+        }
+
+        printf("Testing chacha: %s\n", CipherKernels::GetName(level));
+
+        TestChaChaVectors();
+        TestChaCha20(random);
+        TestXChaCha20(random);
+      }
+
+      CipherKernels::Limit(CipherKernel::VaesAvx512, GhashKernel::VpclmulAvx512);
+
+      // Only the ChaCha counters can be sought this way
+      uint8_t key[32] = {};
+      uint8_t iv[16] = {};
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(crypto.Init(NativeAes256Ctr, key, sizeof(key), iv, sizeof(iv), true, true));
+      TWN_TEST_CHECK(!crypto.SeekKeystream(16));
+    }
+
+    // One CBC chain for the interleaved tests, with what serial CBC makes of the same input
+    struct CbcChain
+    {
+      CbcChain(Random& random, size_t keySize, size_t blocks)
+        : keyBytes(RandomBytes(random, keySize))
+        , iv(RandomBytes(random, 16))
+        , plain(RandomBytes(random, blocks * 16))
+        , cipher(plain.size())
+      {
+        memcpy(chain, iv.data(), sizeof(chain));
+      }
+
+      bool Init() { return key.Init(keyBytes.data(), keyBytes.size()); }
+
+      CbcLane GetLane(size_t offset, size_t blocks)
+      {
+        CbcLane lane;
+        lane.key = &key;
+        lane.chain = chain;
+        lane.src = plain.data() + offset;
+        lane.dst = cipher.data() + offset;
+        lane.blocks = blocks;
+        return lane;
+      }
+
+      // The whole chain, and the chain block left after it, match EVP's CBC
+      bool Matches()
+      {
+        std::vector<uint8_t> expected = EvpCipher(keyBytes.size() == 16 ? EVP_aes_128_cbc() : EVP_aes_256_cbc(), keyBytes.data(), iv.data(), true, plain);
+        const uint8_t* lastBlock = expected.empty() ? iv.data() : expected.data() + expected.size() - 16;
+
+        return cipher == expected && memcmp(chain, lastBlock, sizeof(chain)) == 0;
+      }
+
+      AesKernel key;
+      std::vector<uint8_t> keyBytes;
+      std::vector<uint8_t> iv;
+      std::vector<uint8_t> plain;
+      std::vector<uint8_t> cipher;
+      uint8_t chain[16];
+    };
+
+    // 1 to MaxCbcLanes chains of uneven lengths, including empty ones, interleaved in one call
+    void TestCbcInterleaved(Random& random)
+    {
+      const size_t KeySizes[] = { 16, 32 };
+
+      for(size_t keySize : KeySizes)
+      {
+        for(int count = 1; count <= AesKernel::MaxCbcLanes; ++count)
+        {
+          for(int i = 0; i < 10; ++i)
+          {
+            std::vector<std::unique_ptr<CbcChain>> chains;
+            CbcLane lanes[AesKernel::MaxCbcLanes];
+
+            for(int lane = 0; lane < count; ++lane)
+            {
+              size_t blocks = (random() % 5 == 0) ? 0 : random() % 300;
+              chains.emplace_back(new CbcChain(random, keySize, blocks));
+              TWN_TEST_CHECK(chains.back()->Init());
+              lanes[lane] = chains.back()->GetLane(0, blocks);
+            }
+
+            AesKernel::CbcEncryptInterleaved(lanes, count);
+
+            for(const std::unique_ptr<CbcChain>& chain : chains)
+            {
+              TWN_TEST_CHECK(chain->Matches());
+            }
+          }
+        }
+      }
+    }
+
+    // Chains of mixed key sizes encrypted in several runs each through one engine, from one thread and then from several at once
+    void TestCbcBatchEngine(Random& random)
+    {
+      const int ChainCount = 12;
+      const int RunCount = 4;
+
+      for(int threads = 1; threads <= 4; threads += 3)
+      {
+        CbcBatchEngine engine(3);
+
+        std::vector<std::unique_ptr<CbcChain>> chains;
+        std::vector<std::vector<size_t>> runs(ChainCount);
+
+        for(int i = 0; i < ChainCount; ++i)
+        {
+          size_t total = 0;
+          for(int run = 0; run < RunCount; ++run)
+          {
+            runs[i].push_back(random() % 100);
+            total += runs[i].back();
+          }
+
+          chains.emplace_back(new CbcChain(random, (i % 3 == 0) ? 32 : 16, total));
+          TWN_TEST_CHECK(chains.back()->Init());
+        }
+
+        // Each worker owns every threads-th chain, and queues one run of each of them before waiting on them all
+        auto worker = [&](int first)
+        {
+          std::vector<CbcBatchJob> jobs(ChainCount);
+          std::vector<size_t> offsets(ChainCount, 0);
+
+          for(int run = 0; run < RunCount; ++run)
+          {
+            for(int i = first; i < ChainCount; i += threads)
+            {
+              jobs[i].lane = chains[i]->GetLane(offsets[i], runs[i][run]);
+              offsets[i] += runs[i][run] * 16;
+              engine.Submit(&jobs[i]);
+            }
+
+            for(int i = first; i < ChainCount; i += threads)
+            {
+              engine.Wait(&jobs[i]);
+            }
+          }
+        };
+
+        std::vector<std::thread> workers;
+        for(int first = 0; first < threads; ++first)
+        {
+          workers.emplace_back(worker, first);
+        }
+
+        for(std::thread& thread : workers)
+        {
+          thread.join();
+        }
+
+        for(const std::unique_ptr<CbcChain>& chain : chains)
+        {
+          TWN_TEST_CHECK(chain->Matches());
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  using namespace TWN;
+
+  unsigned seed = 1;
+  if(argc == 3 && strcmp(argv[1], "--seed") == 0)
+  {
+    seed = static_cast<unsigned>(strtoul(argv[2], nullptr, 10));
+  }
+  else if(argc != 1)
+  {
+    fprintf(stderr, "usage: %s [--seed N]\n", argv[0]);
+    return 1;
+  }
+
+  Random random(seed);
+
+  TestAes(random);
+  TestCbcInterleaved(random);
+  TestCbcBatchEngine(random);
+  TestChaCha(random);
+
+  if(g_failures > 0)
+  {
+    fprintf(stderr, "%d checks failed (seed %u)\n", g_failures, seed);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,1725 @@
+#include "CipherKernels.h"
+
+#include "Common/Assert.h"
+
+#include <atomic>
+#include <cstdio>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TWN_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TWN_TARGET(features) __attribute__((target(features)))
+#else
+#define TWN_TARGET(features)
+#endif
+
+namespace TWN
+{
+  static uint64_t ReadBigEndian64(const uint8_t* src)
+  {
+    uint64_t value = 0;
+    for(int i = 0; i < 8; ++i)
+    {
+      value = (value << 8) | src[i];
+    }
+
+    return value;
+  }
+
+  static void WriteBigEndian64(uint8_t* dst, uint64_t value)
+  {
+    for(int i = 7; i >= 0; --i)
+    {
+      dst[i] = static_cast<uint8_t>(value);
+      value >>= 8;
+    }
+  }
+
+  static void SecureZero(void* data, size_t len)
+  {
+    volatile uint8_t* p = static_cast<uint8_t*>(data);
+    for(size_t i = 0; i < len; ++i)
+    {
+      p[i] = 0;
+    }
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CpuFeatures
+  //////////////////////////////////////////////////////////////////////////
+
+#if defined(TWN_X86_KERNELS)
+  static void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+  {
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for(int i = 0; i < 4; ++i)
+    {
+      regs[i] = static_cast<uint32_t>(r[i]);
+    }
+#else
+    regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    __get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3]);
+#endif
+  }
+
+  static uint64_t ReadXcr0()
+  {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t low = 0;
+    uint32_t high = 0;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return (static_cast<uint64_t>(high) << 32) | low;
+#endif
+  }
+#endif
+
+  static CpuFeatures DetectCpuFeatures()
+  {
+    CpuFeatures features;
+    memset(&features, 0, sizeof(features));
+
+#if defined(TWN_X86_KERNELS)
+    uint32_t regs[4];
+    Cpuid(0, 0, regs);
+    uint32_t maxLeaf = regs[0];
+
+    Cpuid(1, 0, regs);
+    features.aesni = (regs[2] & (1u << 25)) != 0;
+    features.pclmulqdq = (regs[2] & (1u << 1)) != 0;
+
+    // The wide registers are only usable if the OS saves them on context switches
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    uint64_t xcr0 = osxsave ? ReadXcr0() : 0;
+    bool avxState = (xcr0 & 0x6) == 0x6;
+    bool avx512State = avxState && (xcr0 & 0xe0) == 0xe0;
+
+    if(maxLeaf >= 7)
+    {
+      Cpuid(7, 0, regs);
+      features.avx2 = avxState && (regs[1] & (1u << 5)) != 0;
+      features.avx512 = avx512State && (regs[1] & (1u << 16)) != 0 && (regs[1] & (1u << 30)) != 0 && (regs[1] & (1u << 31)) != 0;
+      features.vaes = avxState && (regs[2] & (1u << 9)) != 0;
+      features.vpclmulqdq = avxState && (regs[2] & (1u << 10)) != 0;
+    }
+#endif
+
+    return features;
+  }
+
+  /*static*/ const CpuFeatures& CpuFeatures::Get()
+  {
+    static const CpuFeatures features = DetectCpuFeatures();
+    return features;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CipherKernels
+  //////////////////////////////////////////////////////////////////////////
+
+  static std::atomic<int> s_maxAesKernel(static_cast<int>(CipherKernel::VaesAvx512));
+  static std::atomic<int> s_maxGhashKernel(static_cast<int>(GhashKernel::VpclmulAvx512));
+  static std::atomic<int> s_maxChaChaKernel(static_cast<int>(ChaChaKernel::Avx512));
+
+  /*static*/ CipherKernel CipherKernels::GetAesKernel()
+  {
+    const CpuFeatures& cpu = CpuFeatures::Get();
+    int limit = s_maxAesKernel.load(std::memory_order_relaxed);
+
+    if(cpu.aesni && cpu.avx512 && cpu.vaes && limit >= static_cast<int>(CipherKernel::VaesAvx512))
+    {
+      return CipherKernel::VaesAvx512;
+    }
+
+    if(cpu.aesni && limit >= static_cast<int>(CipherKernel::AesNi))
+    {
+      return CipherKernel::AesNi;
+    }
+
+    return CipherKernel::None;
+  }
+
+  /*static*/ GhashKernel CipherKernels::GetGhashKernel()
+  {
+    const CpuFeatures& cpu = CpuFeatures::Get();
+    int limit = s_maxGhashKernel.load(std::memory_order_relaxed);
+
+    if(cpu.pclmulqdq && cpu.avx512 && cpu.vpclmulqdq && limit >= static_cast<int>(GhashKernel::VpclmulAvx512))
+    {
+      return GhashKernel::VpclmulAvx512;
+    }
+
+    if(cpu.pclmulqdq && limit >= static_cast<int>(GhashKernel::Clmul))
+    {
+      return GhashKernel::Clmul;
+    }
+
+    return GhashKernel::None;
+  }
+
+  /*static*/ ChaChaKernel CipherKernels::GetChaChaKernel()
+  {
+    const CpuFeatures& cpu = CpuFeatures::Get();
+    int limit = s_maxChaChaKernel.load(std::memory_order_relaxed);
+
+    if(cpu.avx2 && cpu.avx512 && limit >= static_cast<int>(ChaChaKernel::Avx512))
+    {
+      return ChaChaKernel::Avx512;
+    }
+
+    if(cpu.avx2 && limit >= static_cast<int>(ChaChaKernel::Avx2))
+    {
+      return ChaChaKernel::Avx2;
+    }
+
+    return ChaChaKernel::Scalar;
+  }
+
+  /*static*/ void CipherKernels::Limit(CipherKernel maxAes, GhashKernel maxGhash, ChaChaKernel maxChaCha)
+  {
+    s_maxAesKernel.store(static_cast<int>(maxAes), std::memory_order_relaxed);
+    s_maxGhashKernel.store(static_cast<int>(maxGhash), std::memory_order_relaxed);
+    s_maxChaChaKernel.store(static_cast<int>(maxChaCha), std::memory_order_relaxed);
+  }
+
+  /*static*/ const char* CipherKernels::GetName(CipherKernel kernel)
+  {
+    switch(kernel)
+    {
+    case CipherKernel::None:
+      return "platform";
+    case CipherKernel::AesNi:
+      return "aes-ni";
+    case CipherKernel::VaesAvx512:
+      return "vaes-avx512";
+    }
+
+    return "unknown";
+  }
+
+  /*static*/ const char* CipherKernels::GetName(GhashKernel kernel)
+  {
+    switch(kernel)
+    {
+    case GhashKernel::None:
+      return "platform";
+    case GhashKernel::Clmul:
+      return "pclmulqdq";
+    case GhashKernel::VpclmulAvx512:
+      return "vpclmulqdq-avx512";
+    }
+
+    return "unknown";
+  }
+
+  /*static*/ const char* CipherKernels::GetName(ChaChaKernel kernel)
+  {
+    switch(kernel)
+    {
+    case ChaChaKernel::Scalar:
+      return "portable";
+    case ChaChaKernel::Avx2:
+      return "avx2";
+    case ChaChaKernel::Avx512:
+      return "avx512";
+    }
+
+    return "unknown";
+  }
+
+  /*static*/ const char* CipherKernels::Describe()
+  {
+    static thread_local char description[96];
+    snprintf(description, sizeof(description), "aes: %s, ghash: %s, chacha20: %s", GetName(GetAesKernel()), GetName(GetGhashKernel()), GetName(GetChaChaKernel()));
+    return description;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // Kernels
+  //////////////////////////////////////////////////////////////////////////
+
+#if defined(TWN_X86_KERNELS)
+  template<int Rcon>
+  TWN_TARGET("aes,sse2") static __m128i ExpandAes128Key(__m128i key)
+  {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(key, Rcon), 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+  }
+
+  TWN_TARGET("aes,sse2") static void ExpandAes128(const uint8_t* key, __m128i* roundKeys)
+  {
+    roundKeys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+    roundKeys[1] = ExpandAes128Key<0x01>(roundKeys[0]);
+    roundKeys[2] = ExpandAes128Key<0x02>(roundKeys[1]);
+    roundKeys[3] = ExpandAes128Key<0x04>(roundKeys[2]);
+    roundKeys[4] = ExpandAes128Key<0x08>(roundKeys[3]);
+    roundKeys[5] = ExpandAes128Key<0x10>(roundKeys[4]);
+    roundKeys[6] = ExpandAes128Key<0x20>(roundKeys[5]);
+    roundKeys[7] = ExpandAes128Key<0x40>(roundKeys[6]);
+    roundKeys[8] = ExpandAes128Key<0x80>(roundKeys[7]);
+    roundKeys[9] = ExpandAes128Key<0x1b>(roundKeys[8]);
+    roundKeys[10] = ExpandAes128Key<0x36>(roundKeys[9]);
+  }
+
+  // The even AES-256 round keys mix in the rotated, substituted last word of the previous key; the odd ones just the substituted word
+  template<int Rcon>
+  TWN_TARGET("aes,sse2") static __m128i ExpandAes256EvenKey(__m128i previousEven, __m128i previousOdd)
+  {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(previousOdd, Rcon), 0xff);
+    previousEven = _mm_xor_si128(previousEven, _mm_slli_si128(previousEven, 4));
+    previousEven = _mm_xor_si128(previousEven, _mm_slli_si128(previousEven, 4));
+    previousEven = _mm_xor_si128(previousEven, _mm_slli_si128(previousEven, 4));
+    return _mm_xor_si128(previousEven, assist);
+  }
+
+  TWN_TARGET("aes,sse2") static __m128i ExpandAes256OddKey(__m128i even, __m128i previousOdd)
+  {
+    __m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(even, 0), 0xaa);
+    previousOdd = _mm_xor_si128(previousOdd, _mm_slli_si128(previousOdd, 4));
+    previousOdd = _mm_xor_si128(previousOdd, _mm_slli_si128(previousOdd, 4));
+    previousOdd = _mm_xor_si128(previousOdd, _mm_slli_si128(previousOdd, 4));
+    return _mm_xor_si128(previousOdd, assist);
+  }
+
+  TWN_TARGET("aes,sse2") static void ExpandAes256(const uint8_t* key, __m128i* roundKeys)
+  {
+    roundKeys[0] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+    roundKeys[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+    roundKeys[2] = ExpandAes256EvenKey<0x01>(roundKeys[0], roundKeys[1]);
+    roundKeys[3] = ExpandAes256OddKey(roundKeys[2], roundKeys[1]);
+    roundKeys[4] = ExpandAes256EvenKey<0x02>(roundKeys[2], roundKeys[3]);
+    roundKeys[5] = ExpandAes256OddKey(roundKeys[4], roundKeys[3]);
+    roundKeys[6] = ExpandAes256EvenKey<0x04>(roundKeys[4], roundKeys[5]);
+    roundKeys[7] = ExpandAes256OddKey(roundKeys[6], roundKeys[5]);
+    roundKeys[8] = ExpandAes256EvenKey<0x08>(roundKeys[6], roundKeys[7]);
+    roundKeys[9] = ExpandAes256OddKey(roundKeys[8], roundKeys[7]);
+    roundKeys[10] = ExpandAes256EvenKey<0x10>(roundKeys[8], roundKeys[9]);
+    roundKeys[11] = ExpandAes256OddKey(roundKeys[10], roundKeys[9]);
+    roundKeys[12] = ExpandAes256EvenKey<0x20>(roundKeys[10], roundKeys[11]);
+    roundKeys[13] = ExpandAes256OddKey(roundKeys[12], roundKeys[11]);
+    roundKeys[14] = ExpandAes256EvenKey<0x40>(roundKeys[12], roundKeys[13]);
+  }
+
+  TWN_TARGET("aes,sse2") static void EncryptBlockAesNi(const uint8_t* roundKeys, int rounds, const uint8_t* src, uint8_t* dst)
+  {
+    const __m128i* keys = reinterpret_cast<const __m128i*>(roundKeys);
+
+    __m128i block = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), _mm_load_si128(&keys[0]));
+    for(int round = 1; round < rounds; ++round)
+    {
+      block = _mm_aesenc_si128(block, _mm_load_si128(&keys[round]));
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_aesenclast_si128(block, _mm_load_si128(&keys[rounds])));
+  }
+
+  // Eight blocks at a time, so the AES units always have independent work queued
+  TWN_TARGET("aes,ssse3") static void CtrAesNi(const uint8_t* roundKeys, int rounds, uint64_t& high, uint64_t& low, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const int Lanes = 8;
+    const __m128i* keys = reinterpret_cast<const __m128i*>(roundKeys);
+    const __m128i byteSwap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+    while(blocks > 0)
+    {
+      // The counters are built by adding to the low half, which is only valid while it doesn't wrap
+      if(blocks >= static_cast<size_t>(Lanes) && low <= UINT64_MAX - Lanes)
+      {
+        // Spelled out rather than looped over an array, so the compiler keeps every lane in a register
+        __m128i base = _mm_set_epi64x(static_cast<long long>(high), static_cast<long long>(low));
+        __m128i key = _mm_load_si128(&keys[0]);
+        __m128i s0 = _mm_xor_si128(_mm_shuffle_epi8(base, byteSwap), key);
+        __m128i s1 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 1)), byteSwap), key);
+        __m128i s2 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 2)), byteSwap), key);
+        __m128i s3 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 3)), byteSwap), key);
+        __m128i s4 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 4)), byteSwap), key);
+        __m128i s5 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 5)), byteSwap), key);
+        __m128i s6 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 6)), byteSwap), key);
+        __m128i s7 = _mm_xor_si128(_mm_shuffle_epi8(_mm_add_epi64(base, _mm_set_epi64x(0, 7)), byteSwap), key);
+
+        for(int round = 1; round < rounds; ++round)
+        {
+          key = _mm_load_si128(&keys[round]);
+          s0 = _mm_aesenc_si128(s0, key);
+          s1 = _mm_aesenc_si128(s1, key);
+          s2 = _mm_aesenc_si128(s2, key);
+          s3 = _mm_aesenc_si128(s3, key);
+          s4 = _mm_aesenc_si128(s4, key);
+          s5 = _mm_aesenc_si128(s5, key);
+          s6 = _mm_aesenc_si128(s6, key);
+          s7 = _mm_aesenc_si128(s7, key);
+        }
+
+        key = _mm_load_si128(&keys[rounds]);
+        const __m128i* in = reinterpret_cast<const __m128i*>(src);
+        __m128i* out = reinterpret_cast<__m128i*>(dst);
+        _mm_storeu_si128(out + 0, _mm_xor_si128(_mm_loadu_si128(in + 0), _mm_aesenclast_si128(s0, key)));
+        _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_loadu_si128(in + 1), _mm_aesenclast_si128(s1, key)));
+        _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_loadu_si128(in + 2), _mm_aesenclast_si128(s2, key)));
+        _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_loadu_si128(in + 3), _mm_aesenclast_si128(s3, key)));
+        _mm_storeu_si128(out + 4, _mm_xor_si128(_mm_loadu_si128(in + 4), _mm_aesenclast_si128(s4, key)));
+        _mm_storeu_si128(out + 5, _mm_xor_si128(_mm_loadu_si128(in + 5), _mm_aesenclast_si128(s5, key)));
+        _mm_storeu_si128(out + 6, _mm_xor_si128(_mm_loadu_si128(in + 6), _mm_aesenclast_si128(s6, key)));
+        _mm_storeu_si128(out + 7, _mm_xor_si128(_mm_loadu_si128(in + 7), _mm_aesenclast_si128(s7, key)));
+
+        low += Lanes;
+        src += Lanes * 16;
+        dst += Lanes * 16;
+        blocks -= Lanes;
+      }
+      else
+      {
+        uint8_t counter[16];
+        WriteBigEndian64(counter, high);
+        WriteBigEndian64(counter + 8, low);
+
+        uint8_t keystream[16];
+        EncryptBlockAesNi(roundKeys, rounds, counter, keystream);
+        for(int i = 0; i < 16; ++i)
+        {
+          dst[i] = src[i] ^ keystream[i];
+        }
+
+        if(++low == 0)
+        {
+          ++high;
+        }
+
+        src += 16;
+        dst += 16;
+        --blocks;
+      }
+    }
+  }
+
+  // Four 512-bit registers of four blocks each; whatever is left over goes to the AES-NI kernel
+  TWN_TARGET("aes,ssse3,avx512f,avx512bw,vaes") static void CtrVaes(const uint8_t* roundKeys, int rounds, uint64_t& high, uint64_t& low, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const int Lanes = 16;
+
+    __m512i keys[15];
+    for(int round = 0; round <= rounds; ++round)
+    {
+      keys[round] = _mm512_broadcast_i32x4(_mm_load_si128(reinterpret_cast<const __m128i*>(roundKeys) + round));
+    }
+
+    const __m512i byteSwap = _mm512_broadcast_i32x4(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    const __m512i laneOffsets = _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0);
+    const __m512i registerStep = _mm512_set_epi64(0, 4, 0, 4, 0, 4, 0, 4);
+
+    while(blocks >= static_cast<size_t>(Lanes) && low <= UINT64_MAX - Lanes)
+    {
+      __m512i c0 = _mm512_add_epi64(_mm512_broadcast_i32x4(_mm_set_epi64x(static_cast<long long>(high), static_cast<long long>(low))), laneOffsets);
+      __m512i c1 = _mm512_add_epi64(c0, registerStep);
+      __m512i c2 = _mm512_add_epi64(c1, registerStep);
+      __m512i c3 = _mm512_add_epi64(c2, registerStep);
+
+      __m512i s0 = _mm512_xor_si512(_mm512_shuffle_epi8(c0, byteSwap), keys[0]);
+      __m512i s1 = _mm512_xor_si512(_mm512_shuffle_epi8(c1, byteSwap), keys[0]);
+      __m512i s2 = _mm512_xor_si512(_mm512_shuffle_epi8(c2, byteSwap), keys[0]);
+      __m512i s3 = _mm512_xor_si512(_mm512_shuffle_epi8(c3, byteSwap), keys[0]);
+
+      for(int round = 1; round < rounds; ++round)
+      {
+        s0 = _mm512_aesenc_epi128(s0, keys[round]);
+        s1 = _mm512_aesenc_epi128(s1, keys[round]);
+        s2 = _mm512_aesenc_epi128(s2, keys[round]);
+        s3 = _mm512_aesenc_epi128(s3, keys[round]);
+      }
+
+      _mm512_storeu_si512(dst, _mm512_xor_si512(_mm512_loadu_si512(src), _mm512_aesenclast_epi128(s0, keys[rounds])));
+      _mm512_storeu_si512(dst + 64, _mm512_xor_si512(_mm512_loadu_si512(src + 64), _mm512_aesenclast_epi128(s1, keys[rounds])));
+      _mm512_storeu_si512(dst + 128, _mm512_xor_si512(_mm512_loadu_si512(src + 128), _mm512_aesenclast_epi128(s2, keys[rounds])));
+      _mm512_storeu_si512(dst + 192, _mm512_xor_si512(_mm512_loadu_si512(src + 192), _mm512_aesenclast_epi128(s3, keys[rounds])));
+
+      low += Lanes;
+      src += Lanes * 16;
+      dst += Lanes * 16;
+      blocks -= Lanes;
+    }
+
+    CtrAesNi(roundKeys, rounds, high, low, src, dst, blocks);
+  }
+
+  TWN_TARGET("aes,sse2") static void ExpandDecryptKeys(const uint8_t* roundKeys, int rounds, uint8_t* decryptKeys)
+  {
+    // The equivalent inverse cipher uses the round keys backwards, with InvMixColumns applied to all but the first and last
+    const __m128i* keys = reinterpret_cast<const __m128i*>(roundKeys);
+    __m128i* inverse = reinterpret_cast<__m128i*>(decryptKeys);
+
+    inverse[0] = _mm_load_si128(&keys[rounds]);
+    for(int round = 1; round < rounds; ++round)
+    {
+      inverse[round] = _mm_aesimc_si128(_mm_load_si128(&keys[rounds - round]));
+    }
+
+    inverse[rounds] = _mm_load_si128(&keys[0]);
+  }
+
+  TWN_TARGET("aes,sse2") static void CbcEncryptAesNi(const uint8_t* roundKeys, int rounds, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const __m128i* keys = reinterpret_cast<const __m128i*>(roundKeys);
+    __m128i state = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chain));
+
+    for(; blocks > 0; --blocks, src += 16, dst += 16)
+    {
+      state = _mm_xor_si128(state, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+      state = _mm_xor_si128(state, _mm_load_si128(&keys[0]));
+      for(int round = 1; round < rounds; ++round)
+      {
+        state = _mm_aesenc_si128(state, _mm_load_si128(&keys[round]));
+      }
+
+      state = _mm_aesenclast_si128(state, _mm_load_si128(&keys[rounds]));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), state);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(chain), state);
+  }
+
+  // Unlike encryption, CBC decryption has no dependency between blocks, so eight are decrypted at a time
+  TWN_TARGET("aes,sse2") static void CbcDecryptAesNi(const uint8_t* decryptKeys, int rounds, uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const __m128i* keys = reinterpret_cast<const __m128i*>(decryptKeys);
+    const __m128i* in = reinterpret_cast<const __m128i*>(src);
+    __m128i* out = reinterpret_cast<__m128i*>(dst);
+    __m128i previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chain));
+
+    for(; blocks >= 8; blocks -= 8, in += 8, out += 8)
+    {
+      // All of the ciphertext is loaded before anything is stored, so this works in place
+      __m128i c0 = _mm_loadu_si128(in + 0);
+      __m128i c1 = _mm_loadu_si128(in + 1);
+      __m128i c2 = _mm_loadu_si128(in + 2);
+      __m128i c3 = _mm_loadu_si128(in + 3);
+      __m128i c4 = _mm_loadu_si128(in + 4);
+      __m128i c5 = _mm_loadu_si128(in + 5);
+      __m128i c6 = _mm_loadu_si128(in + 6);
+      __m128i c7 = _mm_loadu_si128(in + 7);
+
+      __m128i key = _mm_load_si128(&keys[0]);
+      __m128i s0 = _mm_xor_si128(c0, key);
+      __m128i s1 = _mm_xor_si128(c1, key);
+      __m128i s2 = _mm_xor_si128(c2, key);
+      __m128i s3 = _mm_xor_si128(c3, key);
+      __m128i s4 = _mm_xor_si128(c4, key);
+      __m128i s5 = _mm_xor_si128(c5, key);
+      __m128i s6 = _mm_xor_si128(c6, key);
+      __m128i s7 = _mm_xor_si128(c7, key);
+
+      for(int round = 1; round < rounds; ++round)
+      {
+        key = _mm_load_si128(&keys[round]);
+        s0 = _mm_aesdec_si128(s0, key);
+        s1 = _mm_aesdec_si128(s1, key);
+        s2 = _mm_aesdec_si128(s2, key);
+        s3 = _mm_aesdec_si128(s3, key);
+        s4 = _mm_aesdec_si128(s4, key);
+        s5 = _mm_aesdec_si128(s5, key);
+        s6 = _mm_aesdec_si128(s6, key);
+        s7 = _mm_aesdec_si128(s7, key);
+      }
+
+      key = _mm_load_si128(&keys[rounds]);
+      _mm_storeu_si128(out + 0, _mm_xor_si128(_mm_aesdeclast_si128(s0, key), previous));
+      _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_aesdeclast_si128(s1, key), c0));
+      _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_aesdeclast_si128(s2, key), c1));
+      _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_aesdeclast_si128(s3, key), c2));
+      _mm_storeu_si128(out + 4, _mm_xor_si128(_mm_aesdeclast_si128(s4, key), c3));
+      _mm_storeu_si128(out + 5, _mm_xor_si128(_mm_aesdeclast_si128(s5, key), c4));
+      _mm_storeu_si128(out + 6, _mm_xor_si128(_mm_aesdeclast_si128(s6, key), c5));
+      _mm_storeu_si128(out + 7, _mm_xor_si128(_mm_aesdeclast_si128(s7, key), c6));
+      previous = c7;
+    }
+
+    for(; blocks > 0; --blocks, ++in, ++out)
+    {
+      __m128i c = _mm_loadu_si128(in);
+      __m128i state = _mm_xor_si128(c, _mm_load_si128(&keys[0]));
+      for(int round = 1; round < rounds; ++round)
+      {
+        state = _mm_aesdec_si128(state, _mm_load_si128(&keys[round]));
+      }
+
+      _mm_storeu_si128(out, _mm_xor_si128(_mm_aesdeclast_si128(state, _mm_load_si128(&keys[rounds])), previous));
+      previous = c;
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(chain), previous);
+  }
+
+  // Eight CBC chains side by side, one block from each per step. Lanes that run out of blocks keep going on a dummy block until the
+  // step ends, so the eight states can stay in registers; steps last as long as the shortest remaining chain.
+  TWN_TARGET("aes,sse2") static void CbcEncryptLanesAesNi(const CbcLane* lanes, int count, int rounds)
+  {
+    const int Lanes = AesKernel::MaxCbcLanes;
+    alignas(16) uint8_t dummy[16] = {};
+    alignas(16) uint8_t discard[16];
+
+    const __m128i* keys[Lanes];
+    const uint8_t* src[Lanes];
+    uint8_t* dst[Lanes];
+    size_t left[Lanes];
+    size_t stride[Lanes];
+    __m128i chain[Lanes];
+
+    for(int i = 0; i < Lanes; ++i)
+    {
+      bool active = i < count && lanes[i].blocks > 0;
+      keys[i] = reinterpret_cast<const __m128i*>(lanes[i < count ? i : 0].key->GetRoundKeys());
+      src[i] = active ? lanes[i].src : dummy;
+      dst[i] = active ? lanes[i].dst : discard;
+      left[i] = active ? lanes[i].blocks : 0;
+      stride[i] = active ? 16 : 0;
+      chain[i] = i < count ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(lanes[i].chain)) : _mm_setzero_si128();
+    }
+
+    __m128i c0 = chain[0], c1 = chain[1], c2 = chain[2], c3 = chain[3], c4 = chain[4], c5 = chain[5], c6 = chain[6], c7 = chain[7];
+
+    for(;;)
+    {
+      size_t step = SIZE_MAX;
+      for(int i = 0; i < Lanes; ++i)
+      {
+        if(left[i] > 0)
+        {
+          step = twn::min(step, left[i]);
+        }
+      }
+
+      if(step == SIZE_MAX)
+      {
+        break;
+      }
+
+      for(size_t block = 0; block < step; ++block)
+      {
+        c0 = _mm_xor_si128(_mm_xor_si128(c0, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[0]))), _mm_load_si128(&keys[0][0]));
+        c1 = _mm_xor_si128(_mm_xor_si128(c1, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[1]))), _mm_load_si128(&keys[1][0]));
+        c2 = _mm_xor_si128(_mm_xor_si128(c2, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[2]))), _mm_load_si128(&keys[2][0]));
+        c3 = _mm_xor_si128(_mm_xor_si128(c3, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[3]))), _mm_load_si128(&keys[3][0]));
+        c4 = _mm_xor_si128(_mm_xor_si128(c4, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[4]))), _mm_load_si128(&keys[4][0]));
+        c5 = _mm_xor_si128(_mm_xor_si128(c5, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[5]))), _mm_load_si128(&keys[5][0]));
+        c6 = _mm_xor_si128(_mm_xor_si128(c6, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[6]))), _mm_load_si128(&keys[6][0]));
+        c7 = _mm_xor_si128(_mm_xor_si128(c7, _mm_loadu_si128(reinterpret_cast<const __m128i*>(src[7]))), _mm_load_si128(&keys[7][0]));
+
+        for(int round = 1; round < rounds; ++round)
+        {
+          c0 = _mm_aesenc_si128(c0, _mm_load_si128(&keys[0][round]));
+          c1 = _mm_aesenc_si128(c1, _mm_load_si128(&keys[1][round]));
+          c2 = _mm_aesenc_si128(c2, _mm_load_si128(&keys[2][round]));
+          c3 = _mm_aesenc_si128(c3, _mm_load_si128(&keys[3][round]));
+          c4 = _mm_aesenc_si128(c4, _mm_load_si128(&keys[4][round]));
+          c5 = _mm_aesenc_si128(c5, _mm_load_si128(&keys[5][round]));
+          c6 = _mm_aesenc_si128(c6, _mm_load_si128(&keys[6][round]));
+          c7 = _mm_aesenc_si128(c7, _mm_load_si128(&keys[7][round]));
+        }
+
+        c0 = _mm_aesenclast_si128(c0, _mm_load_si128(&keys[0][rounds]));
+        c1 = _mm_aesenclast_si128(c1, _mm_load_si128(&keys[1][rounds]));
+        c2 = _mm_aesenclast_si128(c2, _mm_load_si128(&keys[2][rounds]));
+        c3 = _mm_aesenclast_si128(c3, _mm_load_si128(&keys[3][rounds]));
+        c4 = _mm_aesenclast_si128(c4, _mm_load_si128(&keys[4][rounds]));
+        c5 = _mm_aesenclast_si128(c5, _mm_load_si128(&keys[5][rounds]));
+        c6 = _mm_aesenclast_si128(c6, _mm_load_si128(&keys[6][rounds]));
+        c7 = _mm_aesenclast_si128(c7, _mm_load_si128(&keys[7][rounds]));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[0]), c0);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[1]), c1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[2]), c2);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[3]), c3);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[4]), c4);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[5]), c5);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[6]), c6);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst[7]), c7);
+
+        for(int i = 0; i < Lanes; ++i)
+        {
+          src[i] += stride[i];
+          dst[i] += stride[i];
+        }
+      }
+
+      // Save the chains of lanes that just finished, and park them on the dummy block
+      __m128i states[Lanes] = { c0, c1, c2, c3, c4, c5, c6, c7 };
+      for(int i = 0; i < Lanes; ++i)
+      {
+        if(left[i] > 0)
+        {
+          left[i] -= step;
+
+          if(left[i] == 0)
+          {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes[i].chain), states[i]);
+            src[i] = dummy;
+            dst[i] = discard;
+            stride[i] = 0;
+          }
+        }
+      }
+    }
+  }
+
+  // GF(2^128) multiply for GHASH on byte-reversed operands, from Intel's carry-less multiplication white paper: a 256-bit carry-less product,
+  // shifted left one bit because GHASH's bit order is reflected, then reduced modulo x^128 + x^7 + x^2 + x + 1
+  TWN_TARGET("pclmul,sse2") static __m128i GfMul(__m128i a, __m128i b)
+  {
+    __m128i low = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    __m128i high = _mm_clmulepi64_si128(a, b, 0x11);
+
+    low = _mm_xor_si128(low, _mm_slli_si128(middle, 8));
+    high = _mm_xor_si128(high, _mm_srli_si128(middle, 8));
+
+    __m128i lowCarry = _mm_srli_epi32(low, 31);
+    __m128i highCarry = _mm_srli_epi32(high, 31);
+    low = _mm_slli_epi32(low, 1);
+    high = _mm_slli_epi32(high, 1);
+    high = _mm_or_si128(high, _mm_or_si128(_mm_slli_si128(highCarry, 4), _mm_srli_si128(lowCarry, 12)));
+    low = _mm_or_si128(low, _mm_slli_si128(lowCarry, 4));
+
+    __m128i fold = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(low, 31), _mm_slli_epi32(low, 30)), _mm_slli_epi32(low, 25));
+    __m128i foldHigh = _mm_srli_si128(fold, 4);
+    low = _mm_xor_si128(low, _mm_slli_si128(fold, 12));
+
+    __m128i reduced = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(low, 1), _mm_srli_epi32(low, 2)), _mm_srli_epi32(low, 7));
+    reduced = _mm_xor_si128(reduced, foldHigh);
+    low = _mm_xor_si128(low, reduced);
+
+    return _mm_xor_si128(high, low);
+  }
+
+  // The same multiply on four independent pairs of blocks at once
+  TWN_TARGET("avx512f,avx512bw,vpclmulqdq") static __m512i GfMul4(__m512i a, __m512i b)
+  {
+    __m512i low = _mm512_clmulepi64_epi128(a, b, 0x00);
+    __m512i middle = _mm512_xor_si512(_mm512_clmulepi64_epi128(a, b, 0x10), _mm512_clmulepi64_epi128(a, b, 0x01));
+    __m512i high = _mm512_clmulepi64_epi128(a, b, 0x11);
+
+    low = _mm512_xor_si512(low, _mm512_bslli_epi128(middle, 8));
+    high = _mm512_xor_si512(high, _mm512_bsrli_epi128(middle, 8));
+
+    __m512i lowCarry = _mm512_srli_epi32(low, 31);
+    __m512i highCarry = _mm512_srli_epi32(high, 31);
+    low = _mm512_slli_epi32(low, 1);
+    high = _mm512_slli_epi32(high, 1);
+    high = _mm512_or_si512(high, _mm512_or_si512(_mm512_bslli_epi128(highCarry, 4), _mm512_bsrli_epi128(lowCarry, 12)));
+    low = _mm512_or_si512(low, _mm512_bslli_epi128(lowCarry, 4));
+
+    __m512i fold = _mm512_xor_si512(_mm512_xor_si512(_mm512_slli_epi32(low, 31), _mm512_slli_epi32(low, 30)), _mm512_slli_epi32(low, 25));
+    __m512i foldHigh = _mm512_bsrli_epi128(fold, 4);
+    low = _mm512_xor_si512(low, _mm512_bslli_epi128(fold, 12));
+
+    __m512i reduced = _mm512_xor_si512(_mm512_xor_si512(_mm512_srli_epi32(low, 1), _mm512_srli_epi32(low, 2)), _mm512_srli_epi32(low, 7));
+    reduced = _mm512_xor_si512(reduced, foldHigh);
+    low = _mm512_xor_si512(low, reduced);
+
+    return _mm512_xor_si512(high, low);
+  }
+
+  // Blocks are hashed four at a time against H^4..H, so the four multiplies don't depend on each other:
+  // X' = (X ^ B0) H^4 ^ B1 H^3 ^ B2 H^2 ^ B3 H
+  TWN_TARGET("pclmul,ssse3") static void GhashClmul(const uint8_t (*hashKeys)[16], uint8_t* state, const uint8_t* data, size_t blocks)
+  {
+    const __m128i byteSwap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i h4 = _mm_load_si128(reinterpret_cast<const __m128i*>(hashKeys[0]));
+    __m128i h3 = _mm_load_si128(reinterpret_cast<const __m128i*>(hashKeys[1]));
+    __m128i h2 = _mm_load_si128(reinterpret_cast<const __m128i*>(hashKeys[2]));
+    __m128i h1 = _mm_load_si128(reinterpret_cast<const __m128i*>(hashKeys[3]));
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+
+    for(; blocks >= 4; blocks -= 4, data += 64)
+    {
+      __m128i b0 = _mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), byteSwap));
+      __m128i b1 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16)), byteSwap);
+      __m128i b2 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 32)), byteSwap);
+      __m128i b3 = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 48)), byteSwap);
+
+      x = _mm_xor_si128(_mm_xor_si128(GfMul(b0, h4), GfMul(b1, h3)), _mm_xor_si128(GfMul(b2, h2), GfMul(b3, h1)));
+    }
+
+    for(; blocks > 0; --blocks, data += 16)
+    {
+      x = GfMul(_mm_xor_si128(x, _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), byteSwap)), h1);
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), x);
+  }
+
+  TWN_TARGET("pclmul,ssse3,avx512f,avx512bw,vpclmulqdq") static void GhashVpclmul(const uint8_t (*hashKeys)[16], uint8_t* state, const uint8_t* data, size_t blocks)
+  {
+    const __m512i byteSwap = _mm512_broadcast_i32x4(_mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    __m512i keys = _mm512_loadu_si512(hashKeys[0]);
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+
+    for(; blocks >= 4; blocks -= 4, data += 64)
+    {
+      __m512i input = _mm512_xor_si512(_mm512_shuffle_epi8(_mm512_loadu_si512(data), byteSwap), _mm512_zextsi128_si512(x));
+      __m512i product = GfMul4(input, keys);
+
+      x = _mm_xor_si128(_mm_xor_si128(_mm512_extracti32x4_epi32(product, 0), _mm512_extracti32x4_epi32(product, 1)),
+        _mm_xor_si128(_mm512_extracti32x4_epi32(product, 2), _mm512_extracti32x4_epi32(product, 3)));
+    }
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), x);
+
+    GhashClmul(hashKeys, state, data, blocks);
+  }
+
+  TWN_TARGET("ssse3") static void ReflectBlock(const uint8_t* src, uint8_t* dst)
+  {
+    const __m128i byteSwap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), byteSwap));
+  }
+
+  // ChaCha20 with the state held vertically: register i holds word i of eight (or sixteen) consecutive blocks, so each quarter round
+  // works on all the blocks at once, and the output is transposed back into blocks at the end
+  TWN_TARGET("avx2") static inline __m256i Rotl32Avx2(__m256i v, int bits)
+  {
+    return _mm256_or_si256(_mm256_slli_epi32(v, bits), _mm256_srli_epi32(v, 32 - bits));
+  }
+
+  TWN_TARGET("avx2") static inline void QuarterRoundAvx2(__m256i& a, __m256i& b, __m256i& c, __m256i& d, __m256i rot16, __m256i rot8)
+  {
+    a = _mm256_add_epi32(a, b);
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16);
+    c = _mm256_add_epi32(c, d);
+    b = Rotl32Avx2(_mm256_xor_si256(b, c), 12);
+    a = _mm256_add_epi32(a, b);
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);
+    c = _mm256_add_epi32(c, d);
+    b = Rotl32Avx2(_mm256_xor_si256(b, c), 7);
+  }
+
+  // Four words of eight blocks in, in each 128-bit lane the same four words of one block out: a holds block 0 (low lane) and 4 (high lane), b 1 and 5, ...
+  TWN_TARGET("avx2") static inline void TransposeAvx2(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+  {
+    __m256i t0 = _mm256_unpacklo_epi32(a, b);
+    __m256i t1 = _mm256_unpackhi_epi32(a, b);
+    __m256i t2 = _mm256_unpacklo_epi32(c, d);
+    __m256i t3 = _mm256_unpackhi_epi32(c, d);
+
+    a = _mm256_unpacklo_epi64(t0, t2);
+    b = _mm256_unpackhi_epi64(t0, t2);
+    c = _mm256_unpacklo_epi64(t1, t3);
+    d = _mm256_unpackhi_epi64(t1, t3);
+  }
+
+  TWN_TARGET("avx2") static inline void XorBlockAvx2(const uint8_t* src, uint8_t* dst, __m256i low, __m256i high)
+  {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), _mm256_xor_si256(low, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src))));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 32), _mm256_xor_si256(high, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32))));
+  }
+
+  // Returns the number of blocks done; stops short of the block counter wrapping, which is left to the portable code
+  TWN_TARGET("avx2") static size_t ChaChaXorAvx2(uint32_t* state, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const __m256i rot16 = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, 13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+    const __m256i rot8 = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, 14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+    const __m256i counterOffsets = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t done = 0;
+
+    for(; blocks - done >= 8 && state[12] <= 0xffffffffu - 8; done += 8)
+    {
+      __m256i x0 = _mm256_set1_epi32(state[0]), x1 = _mm256_set1_epi32(state[1]), x2 = _mm256_set1_epi32(state[2]), x3 = _mm256_set1_epi32(state[3]);
+      __m256i x4 = _mm256_set1_epi32(state[4]), x5 = _mm256_set1_epi32(state[5]), x6 = _mm256_set1_epi32(state[6]), x7 = _mm256_set1_epi32(state[7]);
+      __m256i x8 = _mm256_set1_epi32(state[8]), x9 = _mm256_set1_epi32(state[9]), x10 = _mm256_set1_epi32(state[10]), x11 = _mm256_set1_epi32(state[11]);
+      __m256i x12 = _mm256_add_epi32(_mm256_set1_epi32(state[12]), counterOffsets);
+      __m256i x13 = _mm256_set1_epi32(state[13]), x14 = _mm256_set1_epi32(state[14]), x15 = _mm256_set1_epi32(state[15]);
+      const __m256i counters = x12;
+
+      for(int round = 0; round < 10; ++round)
+      {
+        QuarterRoundAvx2(x0, x4, x8, x12, rot16, rot8);
+        QuarterRoundAvx2(x1, x5, x9, x13, rot16, rot8);
+        QuarterRoundAvx2(x2, x6, x10, x14, rot16, rot8);
+        QuarterRoundAvx2(x3, x7, x11, x15, rot16, rot8);
+        QuarterRoundAvx2(x0, x5, x10, x15, rot16, rot8);
+        QuarterRoundAvx2(x1, x6, x11, x12, rot16, rot8);
+        QuarterRoundAvx2(x2, x7, x8, x13, rot16, rot8);
+        QuarterRoundAvx2(x3, x4, x9, x14, rot16, rot8);
+      }
+
+      x0 = _mm256_add_epi32(x0, _mm256_set1_epi32(state[0]));
+      x1 = _mm256_add_epi32(x1, _mm256_set1_epi32(state[1]));
+      x2 = _mm256_add_epi32(x2, _mm256_set1_epi32(state[2]));
+      x3 = _mm256_add_epi32(x3, _mm256_set1_epi32(state[3]));
+      x4 = _mm256_add_epi32(x4, _mm256_set1_epi32(state[4]));
+      x5 = _mm256_add_epi32(x5, _mm256_set1_epi32(state[5]));
+      x6 = _mm256_add_epi32(x6, _mm256_set1_epi32(state[6]));
+      x7 = _mm256_add_epi32(x7, _mm256_set1_epi32(state[7]));
+      x8 = _mm256_add_epi32(x8, _mm256_set1_epi32(state[8]));
+      x9 = _mm256_add_epi32(x9, _mm256_set1_epi32(state[9]));
+      x10 = _mm256_add_epi32(x10, _mm256_set1_epi32(state[10]));
+      x11 = _mm256_add_epi32(x11, _mm256_set1_epi32(state[11]));
+      x12 = _mm256_add_epi32(x12, counters);
+      x13 = _mm256_add_epi32(x13, _mm256_set1_epi32(state[13]));
+      x14 = _mm256_add_epi32(x14, _mm256_set1_epi32(state[14]));
+      x15 = _mm256_add_epi32(x15, _mm256_set1_epi32(state[15]));
+
+      TransposeAvx2(x0, x1, x2, x3);
+      TransposeAvx2(x4, x5, x6, x7);
+      TransposeAvx2(x8, x9, x10, x11);
+      TransposeAvx2(x12, x13, x14, x15);
+
+      // Block k is the low lanes of the k-th registers of the four groups, block k + 4 the high lanes
+      XorBlockAvx2(src, dst, _mm256_permute2x128_si256(x0, x4, 0x20), _mm256_permute2x128_si256(x8, x12, 0x20));
+      XorBlockAvx2(src + 64, dst + 64, _mm256_permute2x128_si256(x1, x5, 0x20), _mm256_permute2x128_si256(x9, x13, 0x20));
+      XorBlockAvx2(src + 128, dst + 128, _mm256_permute2x128_si256(x2, x6, 0x20), _mm256_permute2x128_si256(x10, x14, 0x20));
+      XorBlockAvx2(src + 192, dst + 192, _mm256_permute2x128_si256(x3, x7, 0x20), _mm256_permute2x128_si256(x11, x15, 0x20));
+      XorBlockAvx2(src + 256, dst + 256, _mm256_permute2x128_si256(x0, x4, 0x31), _mm256_permute2x128_si256(x8, x12, 0x31));
+      XorBlockAvx2(src + 320, dst + 320, _mm256_permute2x128_si256(x1, x5, 0x31), _mm256_permute2x128_si256(x9, x13, 0x31));
+      XorBlockAvx2(src + 384, dst + 384, _mm256_permute2x128_si256(x2, x6, 0x31), _mm256_permute2x128_si256(x10, x14, 0x31));
+      XorBlockAvx2(src + 448, dst + 448, _mm256_permute2x128_si256(x3, x7, 0x31), _mm256_permute2x128_si256(x11, x15, 0x31));
+
+      src += 512;
+      dst += 512;
+      state[12] += 8;
+    }
+
+    return done;
+  }
+
+  TWN_TARGET("avx512f") static inline void QuarterRoundAvx512(__m512i& a, __m512i& b, __m512i& c, __m512i& d)
+  {
+    a = _mm512_add_epi32(a, b);
+    d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16);
+    c = _mm512_add_epi32(c, d);
+    b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12);
+    a = _mm512_add_epi32(a, b);
+    d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8);
+    c = _mm512_add_epi32(c, d);
+    b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);
+  }
+
+  // As TransposeAvx2, with blocks 4L + k in lane L of register k
+  TWN_TARGET("avx512f") static inline void TransposeAvx512(__m512i& a, __m512i& b, __m512i& c, __m512i& d)
+  {
+    __m512i t0 = _mm512_unpacklo_epi32(a, b);
+    __m512i t1 = _mm512_unpackhi_epi32(a, b);
+    __m512i t2 = _mm512_unpacklo_epi32(c, d);
+    __m512i t3 = _mm512_unpackhi_epi32(c, d);
+
+    a = _mm512_unpacklo_epi64(t0, t2);
+    b = _mm512_unpackhi_epi64(t0, t2);
+    c = _mm512_unpacklo_epi64(t1, t3);
+    d = _mm512_unpackhi_epi64(t1, t3);
+  }
+
+  // Gather lane L of words 0-3, 4-7, 8-11 and 12-15 of the same k into block 4L + k, and XOR the four blocks into the data
+  TWN_TARGET("avx512f") static inline void XorBlocksAvx512(const uint8_t* src, uint8_t* dst, __m512i a, __m512i b, __m512i c, __m512i d)
+  {
+    __m512i v0 = _mm512_shuffle_i32x4(a, b, 0x44);
+    __m512i v1 = _mm512_shuffle_i32x4(a, b, 0xee);
+    __m512i v2 = _mm512_shuffle_i32x4(c, d, 0x44);
+    __m512i v3 = _mm512_shuffle_i32x4(c, d, 0xee);
+
+    __m512i blocks[4] = { _mm512_shuffle_i32x4(v0, v2, 0x88), _mm512_shuffle_i32x4(v0, v2, 0xdd), _mm512_shuffle_i32x4(v1, v3, 0x88), _mm512_shuffle_i32x4(v1, v3, 0xdd) };
+
+    for(int lane = 0; lane < 4; ++lane)
+    {
+      size_t offset = lane * 256;
+      _mm512_storeu_si512(dst + offset, _mm512_xor_si512(blocks[lane], _mm512_loadu_si512(src + offset)));
+    }
+  }
+
+  TWN_TARGET("avx512f") static size_t ChaChaXorAvx512(uint32_t* state, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+    const __m512i counterOffsets = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    size_t done = 0;
+
+    for(; blocks - done >= 16 && state[12] <= 0xffffffffu - 16; done += 16)
+    {
+      __m512i x0 = _mm512_set1_epi32(state[0]), x1 = _mm512_set1_epi32(state[1]), x2 = _mm512_set1_epi32(state[2]), x3 = _mm512_set1_epi32(state[3]);
+      __m512i x4 = _mm512_set1_epi32(state[4]), x5 = _mm512_set1_epi32(state[5]), x6 = _mm512_set1_epi32(state[6]), x7 = _mm512_set1_epi32(state[7]);
+      __m512i x8 = _mm512_set1_epi32(state[8]), x9 = _mm512_set1_epi32(state[9]), x10 = _mm512_set1_epi32(state[10]), x11 = _mm512_set1_epi32(state[11]);
+      __m512i x12 = _mm512_add_epi32(_mm512_set1_epi32(state[12]), counterOffsets);
+      __m512i x13 = _mm512_set1_epi32(state[13]), x14 = _mm512_set1_epi32(state[14]), x15 = _mm512_set1_epi32(state[15]);
+      const __m512i counters = x12;
+
+      for(int round = 0; round < 10; ++round)
+      {
+        QuarterRoundAvx512(x0, x4, x8, x12);
+        QuarterRoundAvx512(x1, x5, x9, x13);
+        QuarterRoundAvx512(x2, x6, x10, x14);
+        QuarterRoundAvx512(x3, x7, x11, x15);
+        QuarterRoundAvx512(x0, x5, x10, x15);
+        QuarterRoundAvx512(x1, x6, x11, x12);
+        QuarterRoundAvx512(x2, x7, x8, x13);
+        QuarterRoundAvx512(x3, x4, x9, x14);
+      }
+
+      x0 = _mm512_add_epi32(x0, _mm512_set1_epi32(state[0]));
+      x1 = _mm512_add_epi32(x1, _mm512_set1_epi32(state[1]));
+      x2 = _mm512_add_epi32(x2, _mm512_set1_epi32(state[2]));
+      x3 = _mm512_add_epi32(x3, _mm512_set1_epi32(state[3]));
+      x4 = _mm512_add_epi32(x4, _mm512_set1_epi32(state[4]));
+      x5 = _mm512_add_epi32(x5, _mm512_set1_epi32(state[5]));
+      x6 = _mm512_add_epi32(x6, _mm512_set1_epi32(state[6]));
+      x7 = _mm512_add_epi32(x7, _mm512_set1_epi32(state[7]));
+      x8 = _mm512_add_epi32(x8, _mm512_set1_epi32(state[8]));
+      x9 = _mm512_add_epi32(x9, _mm512_set1_epi32(state[9]));
+      x10 = _mm512_add_epi32(x10, _mm512_set1_epi32(state[10]));
+      x11 = _mm512_add_epi32(x11, _mm512_set1_epi32(state[11]));
+      x12 = _mm512_add_epi32(x12, counters);
+      x13 = _mm512_add_epi32(x13, _mm512_set1_epi32(state[13]));
+      x14 = _mm512_add_epi32(x14, _mm512_set1_epi32(state[14]));
+      x15 = _mm512_add_epi32(x15, _mm512_set1_epi32(state[15]));
+
+      TransposeAvx512(x0, x1, x2, x3);
+      TransposeAvx512(x4, x5, x6, x7);
+      TransposeAvx512(x8, x9, x10, x11);
+      TransposeAvx512(x12, x13, x14, x15);
+
+      XorBlocksAvx512(src, dst, x0, x4, x8, x12);
+      XorBlocksAvx512(src + 64, dst + 64, x1, x5, x9, x13);
+      XorBlocksAvx512(src + 128, dst + 128, x2, x6, x10, x14);
+      XorBlocksAvx512(src + 192, dst + 192, x3, x7, x11, x15);
+
+      src += 1024;
+      dst += 1024;
+      state[12] += 16;
+    }
+
+    return done;
+  }
+#endif
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // AesKernel
+  //////////////////////////////////////////////////////////////////////////
+
+  AesKernel::AesKernel()
+    : m_rounds(0)
+    , m_kernel(CipherKernel::None)
+  {
+
+  }
+
+  AesKernel::~AesKernel()
+  {
+    SecureZero(m_roundKeys, sizeof(m_roundKeys));
+    SecureZero(m_decryptKeys, sizeof(m_decryptKeys));
+  }
+
+  bool AesKernel::Init(const void* key, size_t keySize)
+  {
+    m_kernel = CipherKernels::GetAesKernel();
+
+#if defined(TWN_X86_KERNELS)
+    if(m_kernel != CipherKernel::None && (keySize == 16 || keySize == 32))
+    {
+      __m128i* roundKeys = reinterpret_cast<__m128i*>(m_roundKeys);
+
+      if(keySize == 16)
+      {
+        ExpandAes128(static_cast<const uint8_t*>(key), roundKeys);
+        m_rounds = 10;
+      }
+      else
+      {
+        ExpandAes256(static_cast<const uint8_t*>(key), roundKeys);
+        m_rounds = 14;
+      }
+
+      ExpandDecryptKeys(m_roundKeys, m_rounds, m_decryptKeys);
+
+      return true;
+    }
+#endif
+
+    m_kernel = CipherKernel::None;
+    return false;
+  }
+
+  void AesKernel::EncryptBlock(const uint8_t* src, uint8_t* dst) const
+  {
+    TWN_REQUIRE(m_kernel != CipherKernel::None);
+
+#if defined(TWN_X86_KERNELS)
+    EncryptBlockAesNi(m_roundKeys, m_rounds, src, dst);
+#endif
+  }
+
+  void AesKernel::Ctr(uint64_t& counterHigh, uint64_t& counterLow, const uint8_t* src, uint8_t* dst, size_t blocks) const
+  {
+    TWN_REQUIRE(m_kernel != CipherKernel::None);
+
+#if defined(TWN_X86_KERNELS)
+    if(m_kernel == CipherKernel::VaesAvx512)
+    {
+      CtrVaes(m_roundKeys, m_rounds, counterHigh, counterLow, src, dst, blocks);
+    }
+    else
+    {
+      CtrAesNi(m_roundKeys, m_rounds, counterHigh, counterLow, src, dst, blocks);
+    }
+#endif
+  }
+
+  void AesKernel::CbcEncrypt(uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks) const
+  {
+    TWN_REQUIRE(m_kernel != CipherKernel::None);
+
+#if defined(TWN_X86_KERNELS)
+    CbcEncryptAesNi(m_roundKeys, m_rounds, chain, src, dst, blocks);
+#endif
+  }
+
+  void AesKernel::CbcDecrypt(uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks) const
+  {
+    TWN_REQUIRE(m_kernel != CipherKernel::None);
+
+#if defined(TWN_X86_KERNELS)
+    CbcDecryptAesNi(m_decryptKeys, m_rounds, chain, src, dst, blocks);
+#endif
+  }
+
+  /*static*/ void AesKernel::CbcEncryptInterleaved(const CbcLane* lanes, int count)
+  {
+    TWN_REQUIRE(count > 0 && count <= MaxCbcLanes);
+
+    int rounds = lanes[0].key->GetRounds();
+    for(int i = 0; i < count; ++i)
+    {
+      TWN_REQUIRE(lanes[i].key->GetKernel() != CipherKernel::None && lanes[i].key->GetRounds() == rounds);
+    }
+
+#if defined(TWN_X86_KERNELS)
+    if(count == 1)
+    {
+      CbcEncryptAesNi(lanes[0].key->GetRoundKeys(), rounds, lanes[0].chain, lanes[0].src, lanes[0].dst, lanes[0].blocks);
+    }
+    else
+    {
+      CbcEncryptLanesAesNi(lanes, count, rounds);
+    }
+#endif
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // GcmKernel
+  //////////////////////////////////////////////////////////////////////////
+
+  GcmKernel::GcmKernel()
+    : m_ghash(GhashKernel::None)
+  {
+
+  }
+
+  GcmKernel::~GcmKernel()
+  {
+    SecureZero(m_hashKeys, sizeof(m_hashKeys));
+  }
+
+  bool GcmKernel::Init(const void* key, size_t keySize)
+  {
+    m_ghash = CipherKernels::GetGhashKernel();
+
+#if defined(TWN_X86_KERNELS)
+    if(m_ghash != GhashKernel::None && m_aes.Init(key, keySize))
+    {
+      // H = E(0), then its powers for hashing four blocks at a time
+      uint8_t zero[16] = {};
+      uint8_t h[16];
+      m_aes.EncryptBlock(zero, h);
+      ReflectBlock(h, m_hashKeys[3]);
+      SecureZero(h, sizeof(h));
+
+      __m128i h1 = _mm_load_si128(reinterpret_cast<const __m128i*>(m_hashKeys[3]));
+      __m128i power = h1;
+      for(int i = 2; i >= 0; --i)
+      {
+        power = GfMul(power, h1);
+        _mm_store_si128(reinterpret_cast<__m128i*>(m_hashKeys[i]), power);
+      }
+
+      return true;
+    }
+#endif
+
+    m_ghash = GhashKernel::None;
+    return false;
+  }
+
+  void GcmKernel::ComputeTag(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, const uint8_t* ciphertext, size_t len, uint8_t* tag) const
+  {
+#if defined(TWN_X86_KERNELS)
+    auto ghash = (m_ghash == GhashKernel::VpclmulAvx512) ? GhashVpclmul : GhashClmul;
+
+    uint8_t state[16] = {};
+    uint8_t block[16];
+
+    // The associated data and the ciphertext are each zero padded to a whole block
+    const uint8_t* parts[2] = { aad, ciphertext };
+    size_t partLens[2] = { aadLen, len };
+
+    for(int part = 0; part < 2; ++part)
+    {
+      size_t blocks = partLens[part] / 16;
+      size_t tail = partLens[part] % 16;
+      ghash(m_hashKeys, state, parts[part], blocks);
+
+      if(tail > 0)
+      {
+        memset(block, 0, sizeof(block));
+        memcpy(block, parts[part] + blocks * 16, tail);
+        ghash(m_hashKeys, state, block, 1);
+      }
+    }
+
+    WriteBigEndian64(block, static_cast<uint64_t>(aadLen) * 8);
+    WriteBigEndian64(block + 8, static_cast<uint64_t>(len) * 8);
+    ghash(m_hashKeys, state, block, 1);
+
+    // Tag = E(J0) ^ GHASH, where J0 = nonce | 1
+    uint8_t j0[16];
+    memcpy(j0, nonce, NonceSize);
+    j0[12] = j0[13] = j0[14] = 0;
+    j0[15] = 1;
+    m_aes.EncryptBlock(j0, block);
+
+    ReflectBlock(state, state);
+    for(int i = 0; i < TagSize; ++i)
+    {
+      tag[i] = block[i] ^ state[i];
+    }
+#endif
+  }
+
+  // Counter mode from J0 + 1. GCM only increments the low 32 bits of the counter, which the kernels' 128-bit increment matches as long
+  // as those bits don't wrap, i.e. for messages under 64 GiB.
+  static void GcmCtr(const AesKernel& aes, const uint8_t* nonce, uint8_t* data, size_t len)
+  {
+    TWN_REQUIRE(len / 16 < 0xfffffffeull);
+
+    uint64_t high = ReadBigEndian64(nonce);
+    uint64_t low = (static_cast<uint64_t>(nonce[8]) << 56) | (static_cast<uint64_t>(nonce[9]) << 48) | (static_cast<uint64_t>(nonce[10]) << 40)
+      | (static_cast<uint64_t>(nonce[11]) << 32) | 2;
+
+    size_t blocks = len / 16;
+    aes.Ctr(high, low, data, data, blocks);
+
+    size_t tail = len % 16;
+    if(tail > 0)
+    {
+      uint8_t keystream[16] = {};
+      aes.Ctr(high, low, keystream, keystream, 1);
+      for(size_t i = 0; i < tail; ++i)
+      {
+        data[blocks * 16 + i] ^= keystream[i];
+      }
+    }
+  }
+
+  void GcmKernel::Seal(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, uint8_t* tag) const
+  {
+    TWN_REQUIRE(m_ghash != GhashKernel::None);
+
+    GcmCtr(m_aes, nonce, data, len);
+    ComputeTag(nonce, aad, aadLen, data, len, tag);
+  }
+
+  bool GcmKernel::Open(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, const uint8_t* tag) const
+  {
+    TWN_REQUIRE(m_ghash != GhashKernel::None);
+
+    uint8_t expected[TagSize];
+    ComputeTag(nonce, aad, aadLen, data, len, expected);
+
+    // Compare in constant time so the mismatch position doesn't leak
+    uint8_t difference = 0;
+    for(int i = 0; i < TagSize; ++i)
+    {
+      difference |= expected[i] ^ tag[i];
+    }
+
+    if(difference != 0)
+    {
+      return false;
+    }
+
+    GcmCtr(m_aes, nonce, data, len);
+    return true;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // ChaChaCipher
+  //////////////////////////////////////////////////////////////////////////
+
+  static uint32_t ReadLittleEndian32(const uint8_t* src)
+  {
+    return static_cast<uint32_t>(src[0]) | (static_cast<uint32_t>(src[1]) << 8) | (static_cast<uint32_t>(src[2]) << 16) | (static_cast<uint32_t>(src[3]) << 24);
+  }
+
+  static void WriteLittleEndian32(uint8_t* dst, uint32_t value)
+  {
+    for(int i = 0; i < 4; ++i)
+    {
+      dst[i] = static_cast<uint8_t>(value);
+      value >>= 8;
+    }
+  }
+
+  static inline uint32_t Rotl32(uint32_t value, int bits)
+  {
+    return (value << bits) | (value >> (32 - bits));
+  }
+
+  static inline void QuarterRound(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+  {
+    a += b; d = Rotl32(d ^ a, 16);
+    c += d; b = Rotl32(b ^ c, 12);
+    a += b; d = Rotl32(d ^ a, 8);
+    c += d; b = Rotl32(b ^ c, 7);
+  }
+
+  static void ChaChaRounds(uint32_t* x)
+  {
+    for(int round = 0; round < 10; ++round)
+    {
+      QuarterRound(x[0], x[4], x[8], x[12]);
+      QuarterRound(x[1], x[5], x[9], x[13]);
+      QuarterRound(x[2], x[6], x[10], x[14]);
+      QuarterRound(x[3], x[7], x[11], x[15]);
+      QuarterRound(x[0], x[5], x[10], x[15]);
+      QuarterRound(x[1], x[6], x[11], x[12]);
+      QuarterRound(x[2], x[7], x[8], x[13]);
+      QuarterRound(x[3], x[4], x[9], x[14]);
+    }
+  }
+
+  /*static*/ void ChaChaCipher::InitState(uint32_t* state, const uint8_t* key, uint32_t counter, const uint8_t* nonce)
+  {
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for(int i = 0; i < 8; ++i)
+    {
+      state[4 + i] = ReadLittleEndian32(key + 4 * i);
+    }
+
+    state[12] = counter;
+
+    for(int i = 0; i < 3; ++i)
+    {
+      state[13 + i] = ReadLittleEndian32(nonce + 4 * i);
+    }
+  }
+
+  /*static*/ void ChaChaCipher::Xor(ChaChaKernel kernel, uint32_t* state, const uint8_t* src, uint8_t* dst, size_t blocks)
+  {
+#if defined(TWN_X86_KERNELS)
+    size_t done = 0;
+
+    if(kernel == ChaChaKernel::Avx512)
+    {
+      done = ChaChaXorAvx512(state, src, dst, blocks);
+    }
+
+    if(kernel != ChaChaKernel::Scalar)
+    {
+      done += ChaChaXorAvx2(state, src + done * BlockSize, dst + done * BlockSize, blocks - done);
+    }
+
+    src += done * BlockSize;
+    dst += done * BlockSize;
+    blocks -= done;
+#endif
+
+    for(; blocks > 0; --blocks)
+    {
+      uint32_t x[16];
+      memcpy(x, state, sizeof(x));
+      ChaChaRounds(x);
+
+      for(int i = 0; i < 16; ++i)
+      {
+        uint8_t word[4];
+        WriteLittleEndian32(word, x[i] + state[i]);
+
+        for(int j = 0; j < 4; ++j)
+        {
+          dst[4 * i + j] = src[4 * i + j] ^ word[j];
+        }
+      }
+
+      src += BlockSize;
+      dst += BlockSize;
+
+      if(++state[12] == 0)
+      {
+        ++state[13];
+      }
+
+      SecureZero(x, sizeof(x));
+    }
+  }
+
+  /*static*/ void ChaChaCipher::HChaCha20(const uint8_t* key, const uint8_t* nonce, uint8_t* subkey)
+  {
+    uint32_t x[16];
+    InitState(x, key, ReadLittleEndian32(nonce), nonce + 4);
+    ChaChaRounds(x);
+
+    for(int i = 0; i < 4; ++i)
+    {
+      WriteLittleEndian32(subkey + 4 * i, x[i]);
+      WriteLittleEndian32(subkey + 16 + 4 * i, x[12 + i]);
+    }
+
+    SecureZero(x, sizeof(x));
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // StreamCrypto
+  //////////////////////////////////////////////////////////////////////////
+
+  StreamCrypto::StreamCrypto()
+    : m_mode(Platform)
+    , m_encrypt(true)
+    , m_counterHigh(0)
+    , m_counterLow(0)
+    , m_keystreamUsed(sizeof(m_keystream))
+    , m_chachaStart(0)
+    , m_chachaKernel(ChaChaKernel::Scalar)
+    , m_partialLen(0)
+#if !defined(USE_BCRYPT)
+    , m_evp(nullptr)
+#endif
+  {
+
+  }
+
+  StreamCrypto::~StreamCrypto()
+  {
+    SecureZero(m_keystream, sizeof(m_keystream));
+    SecureZero(m_chachaState, sizeof(m_chachaState));
+    SecureZero(m_partial, sizeof(m_partial));
+
+#if !defined(USE_BCRYPT)
+    if(m_evp != nullptr)
+    {
+      EVP_CIPHER_CTX_free(m_evp);
+    }
+#endif
+  }
+
+  bool StreamCrypto::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize, bool encrypt, bool padding)
+  {
+    m_mode = Platform;
+
+    if(!IsNativeAlgorithm(algorithm))
+    {
+      return m_platform.Init(algorithm, key, keySize, iv, ivSize, encrypt, padding);
+    }
+
+    if(IsChaChaAlgorithm(algorithm))
+    {
+      return InitChaCha(algorithm, static_cast<const uint8_t*>(key), keySize, static_cast<const uint8_t*>(iv), ivSize, encrypt);
+    }
+
+    bool cbc = (algorithm == NativeAes128Cbc || algorithm == NativeAes256Cbc);
+    bool aes128 = (algorithm == NativeAes128Ctr || algorithm == NativeAes128Cbc);
+
+    if(ivSize != 16 || keySize != (aes128 ? 16u : 32u))
+    {
+      return false;
+    }
+
+    m_encrypt = encrypt;
+
+    if(m_aes.Init(key, keySize))
+    {
+      const uint8_t* ivBytes = static_cast<const uint8_t*>(iv);
+
+      if(cbc)
+      {
+        memcpy(m_chain, ivBytes, sizeof(m_chain));
+        m_partialLen = 0;
+        m_mode = NativeCbc;
+      }
+      else
+      {
+        // Counter mode is the same both ways
+        m_counterHigh = ReadBigEndian64(ivBytes);
+        m_counterLow = ReadBigEndian64(ivBytes + 8);
+        m_keystreamUsed = AesBlockSize;
+        m_mode = NativeCtr;
+      }
+
+      return true;
+    }
+
+#if defined(USE_BCRYPT)
+    return false;
+#else
+    if(m_evp == nullptr)
+    {
+      m_evp = EVP_CIPHER_CTX_new();
+    }
+
+    const EVP_CIPHER* cipher = cbc ? (aes128 ? EVP_aes_128_cbc() : EVP_aes_256_cbc()) : (aes128 ? EVP_aes_128_ctr() : EVP_aes_256_ctr());
+    if(m_evp == nullptr || EVP_CipherInit_ex(m_evp, cipher, nullptr, static_cast<const uint8_t*>(key), static_cast<const uint8_t*>(iv), encrypt ? 1 : 0) != 1)
+    {
+      return false;
+    }
+
+    EVP_CIPHER_CTX_set_padding(m_evp, 0);
+    m_mode = Evp;
+    return true;
+#endif
+  }
+
+  size_t StreamCrypto::Cipher(const void* src, void* dst, size_t len)
+  {
+    switch(m_mode)
+    {
+    case Platform:
+      return m_platform.Cipher(src, dst, len);
+    case NativeCtr:
+      return CipherCtr(static_cast<const uint8_t*>(src), static_cast<uint8_t*>(dst), len);
+    case NativeCbc:
+      return CipherCbc(static_cast<const uint8_t*>(src), static_cast<uint8_t*>(dst), len);
+    case NativeChaCha:
+      return CipherChaCha(static_cast<const uint8_t*>(src), static_cast<uint8_t*>(dst), len);
+#if !defined(USE_BCRYPT)
+    case Evp:
+      {
+        int written = 0;
+        return EVP_CipherUpdate(m_evp, static_cast<uint8_t*>(dst), &written, static_cast<const uint8_t*>(src), static_cast<int>(len)) == 1 ? written : 0;
+      }
+#endif
+    }
+
+    return 0;
+  }
+
+  size_t StreamCrypto::CipherCtr(const uint8_t* in, uint8_t* out, size_t len)
+  {
+    size_t remaining = len;
+
+    // Use up the keystream left over from a previous partial block first
+    while(m_keystreamUsed < AesBlockSize && remaining > 0)
+    {
+      *out++ = *in++ ^ m_keystream[m_keystreamUsed++];
+      --remaining;
+    }
+
+    size_t blocks = remaining / 16;
+    m_aes.Ctr(m_counterHigh, m_counterLow, in, out, blocks);
+    in += blocks * 16;
+    out += blocks * 16;
+    remaining -= blocks * 16;
+
+    if(remaining > 0)
+    {
+      memset(m_keystream, 0, AesBlockSize);
+      m_aes.Ctr(m_counterHigh, m_counterLow, m_keystream, m_keystream, 1);
+
+      for(m_keystreamUsed = 0; remaining > 0; --remaining)
+      {
+        *out++ = *in++ ^ m_keystream[m_keystreamUsed++];
+      }
+    }
+
+    return len;
+  }
+
+  bool StreamCrypto::InitChaCha(int algorithm, const uint8_t* key, size_t keySize, const uint8_t* iv, size_t ivSize, bool encrypt)
+  {
+    if(keySize != 32)
+    {
+      return false;
+    }
+
+    if(algorithm == NativeXChaCha20)
+    {
+      if(ivSize != 24)
+      {
+        return false;
+      }
+
+      // ChaCha20 under a subkey derived from the first 16 bytes of the nonce, with the last 8 as its nonce
+      uint8_t subkey[32];
+      uint8_t nonce[12] = {};
+      ChaChaCipher::HChaCha20(key, iv, subkey);
+      memcpy(nonce + 4, iv + 16, 8);
+      ChaChaCipher::InitState(m_chachaState, subkey, 0, nonce);
+      SecureZero(subkey, sizeof(subkey));
+    }
+    else if(ivSize == 16)
+    {
+      ChaChaCipher::InitState(m_chachaState, key, ReadLittleEndian32(iv), iv + 4);
+    }
+    else if(ivSize == 12)
+    {
+      ChaChaCipher::InitState(m_chachaState, key, 0, iv);
+    }
+    else
+    {
+      return false;
+    }
+
+    m_encrypt = encrypt;
+    m_chachaStart = m_chachaState[12] | (static_cast<uint64_t>(m_chachaState[13]) << 32);
+    m_chachaKernel = CipherKernels::GetChaChaKernel();
+    m_keystreamUsed = ChaChaCipher::BlockSize;
+    m_mode = NativeChaCha;
+    return true;
+  }
+
+  size_t StreamCrypto::CipherChaCha(const uint8_t* in, uint8_t* out, size_t len)
+  {
+    size_t remaining = len;
+
+    while(m_keystreamUsed < ChaChaCipher::BlockSize && remaining > 0)
+    {
+      *out++ = *in++ ^ m_keystream[m_keystreamUsed++];
+      --remaining;
+    }
+
+    size_t blocks = remaining / ChaChaCipher::BlockSize;
+    ChaChaCipher::Xor(m_chachaKernel, m_chachaState, in, out, blocks);
+    in += blocks * ChaChaCipher::BlockSize;
+    out += blocks * ChaChaCipher::BlockSize;
+    remaining -= blocks * ChaChaCipher::BlockSize;
+
+    if(remaining > 0)
+    {
+      memset(m_keystream, 0, sizeof(m_keystream));
+      ChaChaCipher::Xor(m_chachaKernel, m_chachaState, m_keystream, m_keystream, 1);
+
+      for(m_keystreamUsed = 0; remaining > 0; --remaining)
+      {
+        *out++ = *in++ ^ m_keystream[m_keystreamUsed++];
+      }
+    }
+
+    return len;
+  }
+
+  bool StreamCrypto::SeekKeystream(uint64_t offset)
+  {
+    if(m_mode != NativeChaCha)
+    {
+      return false;
+    }
+
+    // The block counter spans words 12 and 13 when it carries
+    uint64_t counter = m_chachaStart + offset / ChaChaCipher::BlockSize;
+    m_chachaState[12] = static_cast<uint32_t>(counter);
+    m_chachaState[13] = static_cast<uint32_t>(counter >> 32);
+    m_keystreamUsed = ChaChaCipher::BlockSize;
+
+    int skip = static_cast<int>(offset % ChaChaCipher::BlockSize);
+    if(skip > 0)
+    {
+      memset(m_keystream, 0, sizeof(m_keystream));
+      ChaChaCipher::Xor(m_chachaKernel, m_chachaState, m_keystream, m_keystream, 1);
+      m_keystreamUsed = skip;
+    }
+
+    return true;
+  }
+
+  const char* StreamCrypto::GetKernelName() const
+  {
+    switch(m_mode)
+    {
+    case NativeCtr:
+    case NativeCbc:
+      return CipherKernels::GetName(GetKernel());
+    case NativeChaCha:
+      return CipherKernels::GetName(m_chachaKernel);
+    default:
+      return "platform";
+    }
+  }
+
+  size_t StreamCrypto::CipherCbc(const uint8_t* in, uint8_t* out, size_t len)
+  {
+    size_t written = 0;
+
+    // Complete a block held back from the last call first. Ciphering in place only works on whole blocks, which is all the block streams pass.
+    if(m_partialLen > 0)
+    {
+      size_t fill = twn::min<size_t>(len, sizeof(m_partial) - m_partialLen);
+      memcpy(m_partial + m_partialLen, in, fill);
+      m_partialLen += static_cast<int>(fill);
+      in += fill;
+      len -= fill;
+
+      if(m_partialLen < static_cast<int>(sizeof(m_partial)))
+      {
+        return 0;
+      }
+
+      if(m_encrypt)
+      {
+        m_aes.CbcEncrypt(m_chain, m_partial, out, 1);
+      }
+      else
+      {
+        m_aes.CbcDecrypt(m_chain, m_partial, out, 1);
+      }
+
+      m_partialLen = 0;
+      out += 16;
+      written += 16;
+    }
+
+    size_t blocks = len / 16;
+    if(m_encrypt)
+    {
+      m_aes.CbcEncrypt(m_chain, in, out, blocks);
+    }
+    else
+    {
+      m_aes.CbcDecrypt(m_chain, in, out, blocks);
+    }
+
+    written += blocks * 16;
+
+    m_partialLen = static_cast<int>(len % 16);
+    memcpy(m_partial, in + blocks * 16, m_partialLen);
+
+    return written;
+  }
+
+  bool StreamCrypto::GetCbcLane(CbcLane& lane)
+  {
+    if(m_mode != NativeCbc || !m_encrypt || m_partialLen != 0)
+    {
+      return false;
+    }
+
+    lane.key = &m_aes;
+    lane.chain = m_chain;
+    return true;
+  }
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#if defined(_XBOX_ONE)
+#define USE_BCRYPT
+#endif
+
+#if defined(USE_BCRYPT)
+#include "XBCrypto.h"
+#else
+#include "SSLCrypto.h"
+#include <openssl/evp.h>
+#endif
+
+#include <cstddef>
+#include <cstdint>
+
+namespace TWN
+{
+#if defined(USE_BCRYPT)
+  typedef XBCrypto PlatformCrypto;
+#else
+  typedef SSLCrypto PlatformCrypto;
+#endif
+
+  // Algorithm ids for the native kernels, kept clear of the ids the platform crypto classes use.
+  // When the CPU has no native kernel for one of these, StreamCrypto falls back to the platform library (EVP only; BCrypt has no counter mode).
+  enum NativeAlgorithm
+  {
+    NativeAes128Ctr = 0x100,
+    NativeAes256Ctr = 0x101,
+    NativeAes128Cbc = 0x102, // Unpadded; BlockEncryptionStream does its own padding
+    NativeAes256Cbc = 0x103,
+    NativeChaCha20 = 0x104, // 32-byte key; 12-byte nonce, or a 16-byte IV of a 32-bit little-endian block counter then the nonce (as EVP_chacha20)
+    NativeXChaCha20 = 0x105, // 32-byte key, 24-byte nonce
+  };
+
+  enum class CipherKernel
+  {
+    None, // The platform library does the work
+    AesNi,
+    VaesAvx512,
+  };
+
+  enum class GhashKernel
+  {
+    None,
+    Clmul,
+    VpclmulAvx512,
+  };
+
+  enum class ChaChaKernel
+  {
+    Scalar,
+    Avx2, // 8 blocks at a time
+    Avx512, // 16 blocks at a time
+  };
+
+  // CPU features the native kernels need, read once from CPUID. The AVX-512 ones are only set if the OS saves the AVX-512 state.
+  struct CpuFeatures
+  {
+    bool aesni;
+    bool pclmulqdq;
+    bool avx2;
+    bool avx512; // F, BW and VL
+    bool vaes;
+    bool vpclmulqdq;
+
+    static const CpuFeatures& Get();
+  };
+
+  class CipherKernels
+  {
+  public:
+    // The kernels the crypto streams use on this CPU
+    static CipherKernel GetAesKernel();
+    static GhashKernel GetGhashKernel();
+    static ChaChaKernel GetChaChaKernel();
+
+    // Never pick anything faster than these, e.g. to compare kernels or to rule out a misbehaving one. Affects contexts initialised afterwards.
+    static void Limit(CipherKernel maxAes, GhashKernel maxGhash, ChaChaKernel maxChaCha = ChaChaKernel::Avx512);
+
+    static const char* GetName(CipherKernel kernel);
+    static const char* GetName(GhashKernel kernel);
+    static const char* GetName(ChaChaKernel kernel);
+
+    // e.g. "aes: vaes-avx512, ghash: vpclmulqdq-avx512, chacha20: avx512", for logging which implementation is in use
+    static const char* Describe();
+  };
+
+  class AesKernel;
+
+  // One CBC chain for AesKernel::CbcEncryptInterleaved: encrypts blocks blocks from src to dst, carrying on from and updating chain
+  struct CbcLane
+  {
+    const AesKernel* key;
+    uint8_t* chain;
+    const uint8_t* src;
+    uint8_t* dst;
+    size_t blocks;
+  };
+
+  // An expanded AES key for the native kernels
+  class AesKernel
+  {
+  public:
+    AesKernel();
+    ~AesKernel();
+
+    // Fails if the CPU has no native AES kernel, or for key sizes other than 16 and 32 bytes
+    bool Init(const void* key, size_t keySize);
+
+    void EncryptBlock(const uint8_t* src, uint8_t* dst) const;
+
+    // Counter mode over whole blocks. The 128-bit big-endian counter block is passed as its high and low halves and advanced by blocks.
+    void Ctr(uint64_t& counterHigh, uint64_t& counterLow, const uint8_t* src, uint8_t* dst, size_t blocks) const;
+
+    // CBC over whole blocks, starting from and updating the chain block (the IV, then the last ciphertext block).
+    // Encryption is serial; decryption works on eight blocks at a time.
+    void CbcEncrypt(uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks) const;
+    void CbcDecrypt(uint8_t* chain, const uint8_t* src, uint8_t* dst, size_t blocks) const;
+
+    // Encrypt up to MaxCbcLanes independent CBC chains interleaved, so the AES units work on one block from each chain at once
+    // instead of waiting on each block of a single chain. The keys may differ but must all be the same size.
+    static const int MaxCbcLanes = 8;
+    static void CbcEncryptInterleaved(const CbcLane* lanes, int count);
+
+    CipherKernel GetKernel() const { return m_kernel; }
+    int GetRounds() const { return m_rounds; }
+    const uint8_t* GetRoundKeys() const { return m_roundKeys; }
+
+  private:
+    AesKernel(const AesKernel&) = delete;
+    AesKernel& operator=(const AesKernel&) = delete;
+
+    alignas(16) uint8_t m_roundKeys[15 * 16];
+    alignas(16) uint8_t m_decryptKeys[15 * 16];
+    int m_rounds;
+    CipherKernel m_kernel;
+  };
+
+  // AES-GCM with 12-byte nonces on the native kernels
+  class GcmKernel
+  {
+  public:
+    static const int TagSize = 16;
+    static const int NonceSize = 12;
+
+    GcmKernel();
+    ~GcmKernel();
+
+    // Fails if the CPU has no native AES or GHASH kernel
+    bool Init(const void* key, size_t keySize);
+
+    void Seal(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, uint8_t* tag) const;
+
+    // Verifies the tag before decrypting; data is left untouched if it doesn't match
+    bool Open(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, uint8_t* data, size_t len, const uint8_t* tag) const;
+
+  private:
+    GcmKernel(const GcmKernel&) = delete;
+    GcmKernel& operator=(const GcmKernel&) = delete;
+
+    void ComputeTag(const uint8_t* nonce, const uint8_t* aad, size_t aadLen, const uint8_t* ciphertext, size_t len, uint8_t* tag) const;
+
+    AesKernel m_aes;
+    alignas(16) uint8_t m_hashKeys[4][16]; // H^4, H^3, H^2, H, in the bit-reflected form the GHASH kernels work in
+    GhashKernel m_ghash;
+  };
+
+  // ChaCha20 (RFC 8439) on whichever kernel the CPU supports; there is always at least the portable one
+  class ChaChaCipher
+  {
+  public:
+    static const int BlockSize = 64;
+
+    // state is the 16-word ChaCha20 input block; words 12 and 13 are the block counter, carried from 12 into 13 as EVP does
+    static void InitState(uint32_t* state, const uint8_t* key, uint32_t counter, const uint8_t* nonce);
+
+    // XOR the keystream for that many blocks into src, writing to dst and advancing the counter in state
+    static void Xor(ChaChaKernel kernel, uint32_t* state, const uint8_t* src, uint8_t* dst, size_t blocks);
+
+    // Derive the XChaCha20 subkey from the key and the first 16 bytes of the 24-byte nonce
+    static void HChaCha20(const uint8_t* key, const uint8_t* nonce, uint8_t* subkey);
+  };
+
+  // The crypto context the streams use: the native kernels for NativeAlgorithm ids, and the platform library for everything else
+  class StreamCrypto
+  {
+  public:
+    StreamCrypto();
+    ~StreamCrypto();
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize, bool encrypt, bool padding);
+
+    size_t Cipher(void* buffer, size_t len) { return Cipher(buffer, buffer, len); }
+    size_t Cipher(const void* src, void* dst, size_t len);
+
+    // The kernel doing the work, or CipherKernel::None for the platform library
+    CipherKernel GetKernel() const { return (m_mode == NativeCtr || m_mode == NativeCbc) ? m_aes.GetKernel() : CipherKernel::None; }
+
+    // Reposition the keystream at a byte offset from the start of the stream; only for the native ChaCha20 algorithms, whose counters
+    // aren't the plain big-endian IV increment that InitCounterAt assumes
+    bool SeekKeystream(uint64_t offset);
+
+    // Name of the kernel doing the work, for logging
+    const char* GetKernelName() const;
+
+    // For native CBC encryption with no partial block buffered, describe the chain so it can be encrypted in a batch with others.
+    // The caller must not use this context until the batch is done.
+    bool GetCbcLane(CbcLane& lane);
+
+    static bool IsNativeAlgorithm(int algorithm) { return algorithm >= NativeAes128Ctr && algorithm <= NativeXChaCha20; }
+    static bool IsChaChaAlgorithm(int algorithm) { return algorithm == NativeChaCha20 || algorithm == NativeXChaCha20; }
+
+  private:
+    StreamCrypto(const StreamCrypto&) = delete;
+    StreamCrypto& operator=(const StreamCrypto&) = delete;
+
+    static const int AesBlockSize = 16;
+
+    enum Mode
+    {
+      Platform,
+      NativeCtr,
+      NativeCbc,
+      NativeChaCha,
+#if !defined(USE_BCRYPT)
+      Evp, // Native algorithm id without a native kernel
+#endif
+    };
+
+    bool InitChaCha(int algorithm, const uint8_t* key, size_t keySize, const uint8_t* iv, size_t ivSize, bool encrypt);
+    size_t CipherCtr(const uint8_t* src, uint8_t* dst, size_t len);
+    size_t CipherChaCha(const uint8_t* src, uint8_t* dst, size_t len);
+    size_t CipherCbc(const uint8_t* src, uint8_t* dst, size_t len);
+
+    PlatformCrypto m_platform;
+    AesKernel m_aes;
+    Mode m_mode;
+    bool m_encrypt;
+    uint64_t m_counterHigh;
+    uint64_t m_counterLow;
+    uint8_t m_keystream[ChaChaCipher::BlockSize]; // Keystream left over from a partial block
+    int m_keystreamUsed;
+    uint32_t m_chachaState[16];
+    uint64_t m_chachaStart; // Block counter the stream started at
+    ChaChaKernel m_chachaKernel;
+    uint8_t m_chain[16]; // CBC chain block
+    uint8_t m_partial[16]; // Input held back until it makes up a whole CBC block, as EVP does without padding
+    int m_partialLen;
+#if !defined(USE_BCRYPT)
+    EVP_CIPHER_CTX* m_evp;
+#endif
+  };
+}
@@ -0,0 +1,116 @@
+#include "CopyAccounting.h"
+
+namespace TWN
+{
+  namespace
+  {
+#if TWN_COPY_ACCOUNTING
+    std::atomic<uint64_t> g_copied[CopySiteCount];
+    std::atomic<uint64_t> g_plaintext;
+#endif
+  }
+
+#if TWN_COPY_ACCOUNTING
+  std::atomic<bool> CopyAccounting::s_enabled(false);
+#endif
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CopyReport
+  //////////////////////////////////////////////////////////////////////////
+
+  uint64_t CopyReport::GetCopied() const
+  {
+    uint64_t total = 0;
+    for(int i = 0; i < CopySiteCount; ++i)
+    {
+      total += copied[i];
+    }
+
+    return total;
+  }
+
+  double CopyReport::GetCopiesPerByte() const
+  {
+    return (plaintext > 0) ? static_cast<double>(GetCopied()) / plaintext : 0.0;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CopyAccounting
+  //////////////////////////////////////////////////////////////////////////
+
+  /*static*/ CopyReport CopyAccounting::GetTotals()
+  {
+    CopyReport report = CopyReport();
+
+#if TWN_COPY_ACCOUNTING
+    for(int i = 0; i < CopySiteCount; ++i)
+    {
+      report.copied[i] = g_copied[i].load(std::memory_order_relaxed);
+    }
+
+    report.plaintext = g_plaintext.load(std::memory_order_relaxed);
+#endif
+
+    return report;
+  }
+
+  /*static*/ void CopyAccounting::Reset()
+  {
+#if TWN_COPY_ACCOUNTING
+    for(int i = 0; i < CopySiteCount; ++i)
+    {
+      g_copied[i].store(0, std::memory_order_relaxed);
+    }
+
+    g_plaintext.store(0, std::memory_order_relaxed);
+#endif
+  }
+
+  /*static*/ void CopyAccounting::AddCopied(CopySite site, uint64_t bytes)
+  {
+#if TWN_COPY_ACCOUNTING
+    g_copied[static_cast<int>(site)].fetch_add(bytes, std::memory_order_relaxed);
+#else
+    (void)site;
+    (void)bytes;
+#endif
+  }
+
+  /*static*/ void CopyAccounting::AddPlaintext(uint64_t bytes)
+  {
+#if TWN_COPY_ACCOUNTING
+    g_plaintext.fetch_add(bytes, std::memory_order_relaxed);
+#else
+    (void)bytes;
+#endif
+  }
+
+  /*static*/ const char* CopyAccounting::GetName(CopySite site)
+  {
+    switch(site)
+    {
+    case CopySite::EncryptionStreamCoalesce: return "EncryptionStream::Write (coalesce)";
+    case CopySite::DecryptionStreamReadInto: return "DecryptionStream::ReadInto";
+    case CopySite::BlockEncryptionStreamCarry: return "BlockEncryptionStream::AdvanceWrite (carry)";
+    case CopySite::BlockEncryptionStreamDest: return "BlockEncryptionStream (Stream::Copy to dest)";
+    case CopySite::BlockDecryptionStreamSource: return "BlockDecryptionStream::Decrypt (source)";
+    case CopySite::BlockDecryptionStreamCarry: return "BlockDecryptionStream::DecryptAvailable (carry)";
+    case CopySite::BlockDecryptionStreamReadAt: return "BlockDecryptionStream::ReadAt";
+    default: return "Unknown";
+    }
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CopyLedger
+  //////////////////////////////////////////////////////////////////////////
+
+#if TWN_COPY_ACCOUNTING
+  void CopyLedger::Reset()
+  {
+    m_report = CopyReport();
+  }
+#endif
+}
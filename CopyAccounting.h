@@ -0,0 +1,116 @@
+#pragma once
+
+#include "StreamStats.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Accounting of the bytes the stream layer moves with memcpy/memmove (or Stream::Copy) rather than ciphers, per stream instance and per
+// call site, to measure the effect of zero-copy changes and find pipelines that copy every byte several times.
+// Compiled in when TWN_COPY_ACCOUNTING is defined to 1, and then only counts while CopyAccounting::SetEnabled(true) is in effect.
+// Otherwise CopyLedger is empty and recording compiles to nothing.
+#if !defined(TWN_COPY_ACCOUNTING)
+#define TWN_COPY_ACCOUNTING 0
+#endif
+
+namespace TWN
+{
+  enum class CopySite
+  {
+    EncryptionStreamCoalesce, // EncryptionStream::Write gathering small writes in the dest buffer
+    DecryptionStreamReadInto, // DecryptionStream::ReadInto copying a partial block out of m_buffer
+    BlockEncryptionStreamCarry, // BlockEncryptionStream moving the bytes after the last whole block to the front of its buffer
+    BlockEncryptionStreamDest, // BlockEncryptionStream copying ciphertext to dest with Stream::Copy
+    BlockDecryptionStreamSource, // BlockDecryptionStream::Decrypt copying ciphertext out of the source's buffers
+    BlockDecryptionStreamCarry, // BlockDecryptionStream moving held-back ciphertext to the front of its buffer
+    BlockDecryptionStreamReadAt, // BlockDecryptionStream::ReadAt copying out of its scratch buffer
+    Count
+  };
+
+  static const int CopySiteCount = static_cast<int>(CopySite::Count);
+
+  struct CopyReport
+  {
+    uint64_t copied[CopySiteCount];
+    uint64_t plaintext;
+
+    uint64_t GetCopied() const;
+
+    // Bytes copied per plaintext byte that went through; 0 with no plaintext
+    double GetCopiesPerByte() const;
+  };
+
+  class CopyAccounting
+  {
+  public:
+#if TWN_COPY_ACCOUNTING
+    static void SetEnabled(bool enabled) { s_enabled.store(enabled, std::memory_order_relaxed); }
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+#else
+    static void SetEnabled(bool) {}
+    static bool IsEnabled() { return false; }
+#endif
+
+    // Totals over every stream since the last Reset
+    static CopyReport GetTotals();
+    static void Reset();
+
+    static void AddCopied(CopySite site, uint64_t bytes);
+    static void AddPlaintext(uint64_t bytes);
+
+    static const char* GetName(CopySite site);
+
+  private:
+#if TWN_COPY_ACCOUNTING
+    static std::atomic<bool> s_enabled;
+#endif
+  };
+
+  // Per-stream copy counts; like the stream that owns it, not thread safe
+  class CopyLedger
+  {
+  public:
+#if TWN_COPY_ACCOUNTING
+    CopyLedger() { Reset(); }
+
+    void RecordCopy(CopySite site, size_t bytes)
+    {
+      if(CopyAccounting::IsEnabled())
+      {
+        m_report.copied[static_cast<int>(site)] += bytes;
+        CopyAccounting::AddCopied(site, bytes);
+      }
+    }
+
+    void RecordPlaintext(size_t bytes)
+    {
+      if(CopyAccounting::IsEnabled())
+      {
+        m_report.plaintext += bytes;
+        CopyAccounting::AddPlaintext(bytes);
+      }
+    }
+
+    void Reset();
+    CopyReport GetReport() const { return m_report; }
+
+  private:
+    CopyReport m_report;
+#else
+    void RecordCopy(CopySite, size_t) {}
+    void RecordPlaintext(size_t) {}
+
+    void Reset() {}
+    CopyReport GetReport() const { return CopyReport(); }
+#endif
+  };
+}
+
+// Count a copy done by the stream layer, in the stream stats and in the stream's ledger
+#define TWN_STREAM_COPIED(ledger, site, bytes) \
+  do \
+  { \
+    TWN_STREAM_STAT(BytesCopied, bytes); \
+    (ledger).RecordCopy(::TWN::CopySite::site, static_cast<size_t>(bytes)); \
+  } while(0)
@@ -0,0 +1,133 @@
+#include "CryptoWorkerPool.h"
+
+#include "Common/Assert.h"
+
+#include <atomic>
+#include <memory>
+
+namespace TWN
+{
+  CryptoWorkerPool::CryptoWorkerPool(int numThreads)
+    : m_stopping(false)
+  {
+    if(numThreads <= 0)
+    {
+      numThreads = twn::max<int>(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    m_threads.reserve(numThreads);
+
+    for(int i = 0; i < numThreads; ++i)
+    {
+      m_threads.emplace_back(&CryptoWorkerPool::WorkerMain, this);
+    }
+  }
+
+  CryptoWorkerPool::~CryptoWorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+
+    m_taskReady.notify_all();
+
+    for(std::thread& thread : m_threads)
+    {
+      thread.join();
+    }
+  }
+
+  void CryptoWorkerPool::Submit(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(task));
+    }
+
+    m_taskReady.notify_one();
+  }
+
+  void CryptoWorkerPool::ParallelFor(int count, const std::function<void(int)>& task)
+  {
+    if(count <= 0)
+    {
+      return;
+    }
+
+    // Workers and the calling thread all pull indices from the same counter, so the caller never idles waiting for a busy pool.
+    // The state is shared with the helpers because one may only get to run after this call has returned; it then finds no indices left.
+    struct Shared
+    {
+      std::function<void(int)> task;
+      std::atomic<int> next;
+      int count;
+      int remaining;
+      std::mutex mutex;
+      std::condition_variable done;
+    };
+
+    std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+    shared->task = task;
+    shared->next = 0;
+    shared->count = count;
+    shared->remaining = count;
+
+    auto run = [shared]()
+    {
+      int finished = 0;
+
+      for(int i = shared->next++; i < shared->count; i = shared->next++)
+      {
+        shared->task(i);
+        ++finished;
+      }
+
+      if(finished > 0)
+      {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->remaining -= finished;
+
+        if(shared->remaining == 0)
+        {
+          shared->done.notify_all();
+        }
+      }
+    };
+
+    int helpers = twn::min<int>(count - 1, GetNumThreads());
+
+    for(int i = 0; i < helpers; ++i)
+    {
+      Submit(run);
+    }
+
+    run();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->done.wait(lock, [&shared]() { return shared->remaining == 0; });
+  }
+
+  void CryptoWorkerPool::WorkerMain()
+  {
+    for(;;)
+    {
+      std::function<void()> task;
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_taskReady.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+
+        if(m_tasks.empty())
+        {
+          return;
+        }
+
+        task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+      }
+
+      task();
+    }
+  }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace TWN
+{
+  // Fixed-size pool of worker threads that the crypto streams use to cipher independent chunks of data at the same time.
+  // A pool can be shared by any number of streams.
+  class CryptoWorkerPool
+  {
+  public:
+    // numThreads == 0 uses one thread per hardware thread
+    CryptoWorkerPool(int numThreads = 0);
+    ~CryptoWorkerPool();
+
+    int GetNumThreads() const { return static_cast<int>(m_threads.size()); }
+
+    // Queue a task to run on one of the worker threads
+    void Submit(std::function<void()> task);
+
+    // Run task(0) ... task(count - 1) on the workers and the calling thread, and return once all of them have finished
+    void ParallelFor(int count, const std::function<void(int)>& task);
+
+  private:
+    CryptoWorkerPool(const CryptoWorkerPool&) = delete;
+    CryptoWorkerPool& operator=(const CryptoWorkerPool&) = delete;
+
+    void WorkerMain();
+
+    std::vector<std::thread> m_threads;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_taskReady;
+    bool m_stopping;
+  };
+}
@@ -0,0 +1,198 @@
+#include "DecryptingWriteStream.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // DecryptingWriteStream
+  //////////////////////////////////////////////////////////////////////////
+
+  DecryptingWriteStream::DecryptingWriteStream(WriteStream* dest)
+    : m_dest(dest)
+  {
+
+  }
+
+  bool DecryptingWriteStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, false, true);
+  }
+
+  bool DecryptingWriteStream::NextWrite(Buffer& buffer)
+  {
+    bool result = m_dest->NextWrite(m_lastBuffer);
+    buffer.SetData(m_lastBuffer.GetData(), m_lastBuffer.GetDataLen());
+    return result;
+  }
+
+  bool DecryptingWriteStream::AdvanceWrite(int bytes)
+  {
+    PROF_EX(DecryptingWriteStream, AdvanceWrite);
+    size_t written = m_crypto.Cipher(m_lastBuffer.GetData(), bytes);
+    return m_dest->AdvanceWrite(static_cast<int>(written));
+  }
+
+  bool DecryptingWriteStream::Write(const void* data, size_t len)
+  {
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    Buffer buffer;
+    while(len > 0 && m_dest->NextWrite(buffer) && buffer.GetDataLen() > 0)
+    {
+      size_t chunk = twn::min<size_t>(len, buffer.GetDataLen());
+      size_t written = m_crypto.Cipher(src, buffer.GetData(), chunk);
+      if(!m_dest->AdvanceWrite(static_cast<int>(written)))
+      {
+        return false;
+      }
+
+      src += chunk;
+      len -= chunk;
+    }
+
+    return len == 0;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // BlockDecryptingWriteStream
+  //////////////////////////////////////////////////////////////////////////
+
+  BlockDecryptingWriteStream::BlockDecryptingWriteStream(WriteStream* dest, size_t bufferSize)
+    : m_dest(dest)
+    , m_blockSize(0)
+    , m_storage(bufferSize)
+    , m_buffer(m_storage.GetData())
+    , m_writePos(m_buffer)
+  {
+
+  }
+
+  bool BlockDecryptingWriteStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    TWN_REQUIRE(keySize <= TWN_ARRAY_SIZE(CipherSettings::key));
+
+    // Same block size as BlockEncryptionStream, whose padding this strips
+    m_blockSize = static_cast<int>(keySize);
+    m_writePos = m_buffer;
+
+    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, false, false);
+  }
+
+  void BlockDecryptingWriteStream::SetBuffer(void* memory, size_t size)
+  {
+    TWN_REQUIRE(GetUsedWrite() == 0);
+
+    m_storage.Attach(memory, size);
+    m_buffer = m_writePos = m_storage.GetData();
+  }
+
+  bool BlockDecryptingWriteStream::NextWrite(Buffer& buffer)
+  {
+    buffer.SetData(m_writePos, m_storage.GetSize() - GetUsedWrite());
+    return true;
+  }
+
+  bool BlockDecryptingWriteStream::AdvanceWrite(int bytes)
+  {
+    PROF_EX(BlockDecryptingWriteStream, AdvanceWrite);
+
+    TWN_REQUIRE(bytes <= m_storage.GetSize() - GetUsedWrite());
+    TWN_REQUIRE(m_storage.GetSize() >= 2 * m_blockSize);
+
+    m_writePos += bytes;
+
+    // As in BlockDecryptionStream, the final bytes are always padded bytes, so hold back the last whole block in case it is the final one
+    int availableBytes = GetUsedWrite();
+    int bytesToWrite = availableBytes - (availableBytes % m_blockSize) - m_blockSize;
+    int remainingBytes = availableBytes - bytesToWrite;
+
+    if(bytesToWrite > 0)
+    {
+      if(!DecryptToDest(m_buffer, bytesToWrite))
+      {
+        return false;
+      }
+
+      memmove(m_buffer, m_buffer + bytesToWrite, remainingBytes);
+      m_writePos = m_buffer + remainingBytes;
+    }
+
+    return true;
+  }
+
+  bool BlockDecryptingWriteStream::Flush()
+  {
+    int bytesToWrite = GetUsedWrite();
+
+    if(bytesToWrite == 0)
+    {
+      return true;
+    }
+
+    TWN_REQUIRE(bytesToWrite == m_blockSize);
+
+    uint8_t lastBlock[TWN_ARRAY_SIZE(CipherSettings::key)];
+    size_t written = m_crypto.Cipher(m_buffer, lastBlock, bytesToWrite);
+    m_writePos = m_buffer;
+
+    if(written == 0)
+    {
+      return true;
+    }
+
+    uint8_t numPaddedBytes = lastBlock[written - 1];
+
+    if(numPaddedBytes > m_blockSize || numPaddedBytes > written)
+    {
+      TWN_BUG("BlockDecryptingWriteStream: Invalid number of padded bytes {0}; maximum is {1}", numPaddedBytes, m_blockSize);
+      return false;
+    }
+
+    return Stream::Copy(lastBlock, *m_dest, written - numPaddedBytes);
+  }
+
+  bool BlockDecryptingWriteStream::DecryptToDest(const uint8_t* src, int len)
+  {
+    while(len > 0)
+    {
+      Buffer buffer;
+      if(!m_dest->NextWrite(buffer))
+      {
+        return false;
+      }
+
+      // Decrypt whole blocks, so the output never runs past the end of dest's buffer
+      int chunk = static_cast<int>(twn::min<size_t>(len, buffer.GetDataLen()));
+      chunk -= chunk % m_blockSize;
+
+      if(chunk > 0)
+      {
+        size_t written = m_crypto.Cipher(src, buffer.GetData(), chunk);
+        if(!m_dest->AdvanceWrite(static_cast<int>(written)))
+        {
+          return false;
+        }
+      }
+      else
+      {
+        // dest's buffer is smaller than a block
+        uint8_t block[TWN_ARRAY_SIZE(CipherSettings::key)];
+        chunk = m_blockSize;
+
+        size_t written = m_crypto.Cipher(src, block, chunk);
+        if(!Stream::Copy(block, *m_dest, written))
+        {
+          return false;
+        }
+      }
+
+      src += chunk;
+      len -= chunk;
+    }
+
+    return true;
+  }
+}
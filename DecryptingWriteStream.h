@@ -0,0 +1,66 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+namespace TWN
+{
+  // Decrypts on write: a WriteStream that takes ciphertext pushed into it (e.g. from network receive handlers or async completions) and
+  // passes the plaintext on to dest. Like EncryptionStream, NextWrite hands out dest's own buffer and AdvanceWrite decrypts in place in it,
+  // so nothing is copied. Decrypts what an EncryptionStream or EncryptingReadStream encrypted.
+  class DecryptingWriteStream : public WriteStream
+  {
+  public:
+    DecryptingWriteStream(WriteStream* dest);
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    // Decrypt len bytes from data out of place, straight into the destination's buffers, leaving data untouched
+    bool Write(const void* data, size_t len);
+
+    void SetDest(WriteStream* dest) { m_dest = dest; }
+
+  protected:
+    Buffer m_lastBuffer;
+    WriteStream* m_dest;
+    StreamCrypto m_crypto;
+  };
+
+  // Decrypts on write data that was encrypted by a BlockEncryptionStream or BlockEncryptingReadStream, and strips its padding.
+  // The last block written is held back, since it may be the padded final block; Flush() decrypts it once all the data has been written.
+  // Whole blocks are decrypted out of place from the stream's buffer into dest's buffers.
+  class BlockDecryptingWriteStream : public WriteStream
+  {
+  public:
+    BlockDecryptingWriteStream(WriteStream* dest, size_t bufferSize = CryptoBuffer::DefaultSize);
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    // Decrypt the final block, strip the padding and pass on the rest; call once all the data has been written
+    bool Flush();
+
+    void SetDest(WriteStream* dest) { m_dest = dest; }
+
+    // Use caller-owned memory for the ciphertext buffer, which needs room for at least two blocks.
+    // Must be called before writing, and the memory must outlive the stream.
+    void SetBuffer(void* memory, size_t size);
+
+  protected:
+    bool DecryptToDest(const uint8_t* src, int len);
+    int GetUsedWrite() const { return static_cast<int>(m_writePos - m_buffer); }
+
+    WriteStream* m_dest;
+    StreamCrypto m_crypto;
+
+    int m_blockSize;
+
+    CryptoBuffer m_storage;
+    uint8_t* m_buffer;
+    uint8_t* m_writePos;
+  };
+}
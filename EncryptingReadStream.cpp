@@ -0,0 +1,209 @@
+#include "EncryptingReadStream.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+#include <climits>
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // EncryptingReadStream
+  //////////////////////////////////////////////////////////////////////////
+
+  EncryptingReadStream::EncryptingReadStream(ReadStream* source, size_t bufferSize)
+    : m_source(source)
+    , m_storage(bufferSize)
+    , m_buffer(m_storage.GetData())
+    , m_readPos(m_buffer)
+    , m_readEnd(m_buffer)
+  {
+
+  }
+
+  bool EncryptingReadStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, true, true);
+  }
+
+  void EncryptingReadStream::SetBuffer(void* memory, size_t size)
+  {
+    TWN_REQUIRE(GetAvailableRead() == 0);
+
+    m_storage.Attach(memory, size);
+    m_buffer = m_readPos = m_readEnd = m_storage.GetData();
+  }
+
+  bool EncryptingReadStream::NextRead(Buffer& buffer)
+  {
+    if(GetAvailableRead() == 0 && !Encrypt())
+    {
+      return false;
+    }
+
+    buffer.SetData(m_readPos, m_readEnd - m_readPos);
+    return true;
+  }
+
+  bool EncryptingReadStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(bytes <= GetAvailableRead());
+
+    if(bytes <= GetAvailableRead())
+    {
+      m_readPos += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool EncryptingReadStream::Encrypt()
+  {
+    m_readPos = m_readEnd = m_buffer;
+
+    // A cipher that holds back a partial block can produce nothing from a short source buffer, so keep going until there is some output
+    Buffer buffer;
+    while(m_readEnd == m_buffer && m_source->NextRead(buffer) && buffer.GetDataLen() > 0)
+    {
+      int len = twn::min<int>(m_storage.GetSize(), static_cast<int>(twn::min<size_t>(buffer.GetDataLen(), INT_MAX)));
+      size_t written = m_crypto.Cipher(buffer.GetData(), m_buffer, len);
+      m_source->AdvanceRead(len);
+      m_readEnd = m_buffer + written;
+    }
+
+    return m_readEnd > m_buffer;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // BlockEncryptingReadStream
+  //////////////////////////////////////////////////////////////////////////
+
+  BlockEncryptingReadStream::BlockEncryptingReadStream(ReadStream* source, size_t bufferSize)
+    : m_source(source)
+    , m_blockSize(0)
+    , m_storage(bufferSize)
+    , m_buffer(m_storage.GetData())
+    , m_readPos(m_buffer)
+    , m_readEnd(m_buffer)
+    , m_partialLen(0)
+    , m_padded(false)
+  {
+
+  }
+
+  bool BlockEncryptingReadStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    TWN_REQUIRE(keySize <= sizeof(m_partial));
+
+    // Same block size as BlockEncryptionStream, so BlockDecryptionStream strips the padding
+    m_blockSize = static_cast<int>(keySize);
+    m_partialLen = 0;
+    m_padded = false;
+
+    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, true, false);
+  }
+
+  void BlockEncryptingReadStream::SetBuffer(void* memory, size_t size)
+  {
+    TWN_REQUIRE(GetAvailableRead() == 0);
+
+    m_storage.Attach(memory, size);
+    m_buffer = m_readPos = m_readEnd = m_storage.GetData();
+  }
+
+  bool BlockEncryptingReadStream::NextRead(Buffer& buffer)
+  {
+    if(GetAvailableRead() == 0 && !Encrypt())
+    {
+      return false;
+    }
+
+    buffer.SetData(m_readPos, m_readEnd - m_readPos);
+    return true;
+  }
+
+  bool BlockEncryptingReadStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(bytes <= GetAvailableRead());
+
+    if(bytes <= GetAvailableRead())
+    {
+      m_readPos += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool BlockEncryptingReadStream::Encrypt()
+  {
+    TWN_REQUIRE(m_storage.GetSize() >= m_blockSize);
+
+    m_readPos = m_readEnd = m_buffer;
+
+    while(m_readEnd == m_buffer && !m_padded)
+    {
+      Buffer buffer;
+      if(!m_source->NextRead(buffer) || buffer.GetDataLen() == 0)
+      {
+        EncryptPadded();
+        break;
+      }
+
+      const uint8_t* src = static_cast<const uint8_t*>(buffer.GetData());
+      int srcLen = static_cast<int>(twn::min<size_t>(buffer.GetDataLen(), INT_MAX));
+      int used = 0;
+
+      // Finish the block started in the previous source buffer
+      if(m_partialLen > 0)
+      {
+        used = twn::min<int>(m_blockSize - m_partialLen, srcLen);
+        memcpy(m_partial + m_partialLen, src, used);
+        m_partialLen += used;
+
+        if(m_partialLen == m_blockSize)
+        {
+          m_readEnd += m_crypto.Cipher(m_partial, m_readEnd, m_blockSize);
+          m_partialLen = 0;
+        }
+      }
+
+      // Encrypt as many whole blocks as fit straight out of the source's buffer
+      int space = static_cast<int>(m_buffer + m_storage.GetSize() - m_readEnd);
+      int bulk = twn::min<int>(srcLen - used, space);
+      bulk -= bulk % m_blockSize;
+
+      if(bulk > 0)
+      {
+        m_readEnd += m_crypto.Cipher(src + used, m_readEnd, bulk);
+        used += bulk;
+      }
+
+      // Hold on to the start of a block that runs on into the next source buffer; anything more is left in the source until there is space
+      if(m_partialLen == 0 && srcLen - used < m_blockSize)
+      {
+        m_partialLen = srcLen - used;
+        memcpy(m_partial, src + used, m_partialLen);
+        used = srcLen;
+      }
+
+      m_source->AdvanceRead(used);
+    }
+
+    return m_readEnd > m_buffer;
+  }
+
+  void BlockEncryptingReadStream::EncryptPadded()
+  {
+    // Pad to block size by filling with 0s, except the last byte which is number of padded bytes; there is always at least one padded byte
+    int paddingLen = m_blockSize - m_partialLen;
+    memset(m_partial + m_partialLen, 0, paddingLen - 1);
+    m_partial[m_blockSize - 1] = static_cast<uint8_t>(paddingLen);
+
+    m_readEnd += m_crypto.Cipher(m_partial, m_readEnd, m_blockSize);
+    m_partialLen = 0;
+    m_padded = true;
+  }
+}
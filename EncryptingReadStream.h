@@ -0,0 +1,76 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+namespace TWN
+{
+  // Encrypts on read: a ReadStream over a plaintext source, for pipelines where the consumer pulls ciphertext (e.g. an upload reading from a
+  // read-only mapping or a socket). Encrypts out of place from the source's buffers into its own buffer, so the source can be read-only.
+  // The output is what an EncryptionStream would have written for the same data, and decrypts with a DecryptionStream.
+  class EncryptingReadStream : public ReadStream
+  {
+  public:
+    EncryptingReadStream(ReadStream* source, size_t bufferSize = CryptoBuffer::DefaultSize);
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    void SetSource(ReadStream* source) { m_source = source; }
+
+    // Use caller-owned memory for the encryption buffer; must be called before reading, and the memory must outlive the stream
+    void SetBuffer(void* memory, size_t size);
+
+  protected:
+    bool Encrypt();
+    int GetAvailableRead() const { return static_cast<int>(m_readEnd - m_readPos); }
+
+    ReadStream* m_source;
+    StreamCrypto m_crypto;
+
+    CryptoBuffer m_storage;
+    uint8_t* m_buffer;
+    uint8_t* m_readPos;
+    uint8_t* m_readEnd;
+  };
+
+  // Encrypts on read in block-sized chunks, and pads the end of the source so the output is a multiple of the block size; the pull-based
+  // counterpart of BlockEncryptionStream, whose output it matches, so it decrypts with a BlockDecryptionStream.
+  // Whole blocks are encrypted straight out of the source's buffers; only a block split across two source buffers is copied.
+  class BlockEncryptingReadStream : public ReadStream
+  {
+  public:
+    BlockEncryptingReadStream(ReadStream* source, size_t bufferSize = CryptoBuffer::DefaultSize);
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    void SetSource(ReadStream* source) { m_source = source; }
+
+    // Use caller-owned memory for the encryption buffer; must be called before reading, and the memory must outlive the stream.
+    // It needs room for at least one block.
+    void SetBuffer(void* memory, size_t size);
+
+  protected:
+    bool Encrypt();
+    void EncryptPadded();
+    int GetAvailableRead() const { return static_cast<int>(m_readEnd - m_readPos); }
+
+    ReadStream* m_source;
+    StreamCrypto m_crypto;
+
+    int m_blockSize;
+
+    CryptoBuffer m_storage;
+    uint8_t* m_buffer;
+    uint8_t* m_readPos;
+    uint8_t* m_readEnd;
+
+    uint8_t m_partial[TWN_ARRAY_SIZE(CipherSettings::key)]; // Start of a block whose remainder is in the next source buffer
+    int m_partialLen;
+    bool m_padded; // The source has ended and the final, padded block has been encrypted
+  };
+}
@@ -1,110 +1,404 @@
 #include "EncryptionStream.h"
+#include "AsyncStream.h"
 #include "Buffer.h"
+#include "CbcBatchEngine.h"
+#include "CryptoWorkerPool.h"
 
 #include "Common/Assert.h"
 #include "FixedStream.h"
 
+#include <atomic>
+#include <climits>
+#include <vector>
+
 namespace TWN
 {
+  bool ReadExact(ReadStream& stream, void* dst, size_t len)
+  {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+
+    Buffer buffer;
+    while(len > 0 && stream.NextRead(buffer) && buffer.GetDataLen() > 0)
+    {
+      size_t chunk = twn::min<size_t>(len, buffer.GetDataLen());
+      memcpy(out, buffer.GetData(), chunk);
+      stream.AdvanceRead(static_cast<int>(chunk));
+
+      out += chunk;
+      len -= chunk;
+    }
+
+    return len == 0;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CryptoBuffer
+  //////////////////////////////////////////////////////////////////////////
+
+  CryptoBuffer::CryptoBuffer(size_t size)
+    : m_data(nullptr)
+    , m_size(0)
+    , m_owned(false)
+  {
+    if(size > 0)
+    {
+      Allocate(size);
+    }
+  }
+
+  CryptoBuffer::~CryptoBuffer()
+  {
+    Release();
+  }
+
+  void CryptoBuffer::Allocate(size_t size)
+  {
+    TWN_REQUIRE(size > 0 && size <= INT_MAX);
+
+    Release();
+    m_data = new uint8_t[size];
+    m_size = static_cast<int>(size);
+    m_owned = true;
+  }
+
+  void CryptoBuffer::Attach(void* memory, size_t size)
+  {
+    TWN_REQUIRE(memory != nullptr && size > 0 && size <= INT_MAX);
+
+    Release();
+    m_data = static_cast<uint8_t*>(memory);
+    m_size = static_cast<int>(size);
+    m_owned = false;
+  }
+
+  void CryptoBuffer::Release()
+  {
+    if(m_owned)
+    {
+      delete[] m_data;
+    }
+
+    m_data = nullptr;
+    m_size = 0;
+    m_owned = false;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // CipherSettings
+  //////////////////////////////////////////////////////////////////////////
+
+  CipherSettings::CipherSettings()
+    : algorithm(0)
+    , keySize(0)
+    , ivSize(0)
+  {
+
+  }
+
+  CipherSettings::~CipherSettings()
+  {
+    // Don't leave key material behind in freed memory
+    volatile uint8_t* p = key;
+    for(size_t i = 0; i < sizeof(key); ++i)
+    {
+      p[i] = 0;
+    }
+  }
+
+  bool CipherSettings::Set(int algorithm_, const void* key_, size_t keySize_, const void* iv_, size_t ivSize_)
+  {
+    if(keySize_ > sizeof(key) || ivSize_ > sizeof(iv))
+    {
+      return false;
+    }
+
+    algorithm = algorithm_;
+    keySize = keySize_;
+    ivSize = ivSize_;
+    memcpy(key, key_, keySize_);
+    memcpy(iv, iv_, ivSize_);
+
+    return true;
+  }
+
+
   //////////////////////////////////////////////////////////////////////////
   // EncryptionStream
   //////////////////////////////////////////////////////////////////////////
 
   EncryptionStream::EncryptionStream(WriteStream* dest)
-    : m_dest(dest)
+    : Base(dest)
+    , m_seekableDest(nullptr)
+    , m_coalesce(false)
+    , m_coalesceLimit(0)
+    , m_coalesceDelay(std::chrono::microseconds::zero())
+    , m_coalesced(0)
+  {
+    m_streamId = this;
+  }
+
+  EncryptionStream::~EncryptionStream()
   {
 
   }
 
   bool EncryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
   {
-    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, true, true);
+    return m_settings.Set(algorithm, key, keySize, iv, ivSize) && Base::Init(algorithm, key, keySize, iv, ivSize);
   }
 
   bool EncryptionStream::NextWrite(Buffer& buffer)
   {
-    bool result = m_dest->NextWrite(m_lastBuffer);
-    buffer.SetData(m_lastBuffer.GetData(), m_lastBuffer.GetDataLen());
-    return result;
+    TWN_STREAM_TRACE_SPAN("EncryptionStream::NextWrite", 0);
+
+    if(m_coalesced > 0)
+    {
+      // Carry on filling the dest buffer being held; it always has space left, since a full one is encrypted straight away
+      buffer.SetData(m_lastBuffer.GetData() + m_coalesced, m_lastBuffer.GetDataLen() - m_coalesced);
+      return true;
+    }
+
+    return Base::NextWrite(buffer);
   }
 
   bool EncryptionStream::AdvanceWrite(int bytes)
   {
     PROF_EX(EncryptionStream, AdvanceWrite);
-    size_t written = m_crypto.Cipher(m_lastBuffer.GetData(), bytes);
-    return m_dest->AdvanceWrite(static_cast<int>(written));
-  }
+    TWN_STREAM_TRACE_SPAN("EncryptionStream::AdvanceWrite", bytes);
 
+    if(!m_coalesce)
+    {
+      return Base::AdvanceWrite(bytes);
+    }
 
-  //////////////////////////////////////////////////////////////////////////
-  // DecryptionStream
-  //////////////////////////////////////////////////////////////////////////
+    bool timed = m_coalesceDelay > std::chrono::microseconds::zero();
+    if(timed && m_coalesced == 0)
+    {
+      m_coalesceStart = std::chrono::steady_clock::now();
+    }
 
-  DecryptionStream::DecryptionStream(ReadStream* source)
-    : m_source(source)
-    , m_readPos(m_buffer)
-    , m_readEnd(m_buffer)
-  {
+    m_coalesced += bytes;
+
+    if(m_coalesced >= static_cast<int>(m_lastBuffer.GetDataLen())
+      || (m_coalesceLimit > 0 && m_coalesced >= m_coalesceLimit)
+      || (timed && std::chrono::steady_clock::now() - m_coalesceStart >= m_coalesceDelay))
+    {
+      return CipherCoalesced();
+    }
 
+    return true;
   }
 
-  bool DecryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  bool EncryptionStream::Write(const void* data, size_t len)
   {
-    return m_crypto.Init(algorithm, key, keySize, iv, ivSize, false, true);
+    TWN_STREAM_TRACE_SPAN("EncryptionStream::Write", len);
+    size_t smallWrite = (m_coalesceLimit > 0) ? m_coalesceLimit : CryptoBuffer::DefaultSize;
+
+    if(!m_coalesce || len >= smallWrite)
+    {
+      // Encrypt out of place as usual, after anything gathered in front of it
+      return CipherCoalesced() && Base::Write(data, len);
+    }
+
+    // Copy small writes into the dest buffer so they are encrypted together; a copy of a few bytes costs far less than a Cipher call
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    Buffer buffer;
+    while(len > 0 && EncryptionStream::NextWrite(buffer) && buffer.GetDataLen() > 0)
+    {
+      size_t chunk = twn::min<size_t>(len, buffer.GetDataLen());
+      memcpy(buffer.GetData(), src, chunk);
+      TWN_STREAM_COPIED(m_copies, EncryptionStreamCoalesce, chunk);
+      if(!EncryptionStream::AdvanceWrite(static_cast<int>(chunk)))
+      {
+        return false;
+      }
+
+      src += chunk;
+      len -= chunk;
+    }
+
+    return len == 0;
   }
 
-  bool DecryptionStream::NextRead(Buffer& buffer)
+  void EncryptionStream::SetCoalescing(bool enable, size_t maxBytes, std::chrono::microseconds maxDelay)
   {
-    bool ok = true;
+    TWN_REQUIRE(maxBytes <= INT_MAX);
 
-    if(GetAvailableRead() == 0)
+    if(!enable)
     {
-      ok = Decrypt();
+      CipherCoalesced();
     }
 
-    if(ok)
+    m_coalesce = enable;
+    m_coalesceLimit = static_cast<int>(maxBytes);
+    m_coalesceDelay = maxDelay;
+  }
+
+  bool EncryptionStream::CipherCoalesced()
+  {
+    if(m_coalesced == 0)
     {
-      buffer.SetData(m_readPos, m_readEnd - m_readPos);
       return true;
     }
-    else
+
+    int bytes = m_coalesced;
+    m_coalesced = 0;
+
+    return Base::AdvanceWrite(bytes);
+  }
+
+  void EncryptionStream::SetSeekableDest(SeekableWriteStream* dest)
+  {
+    TWN_REQUIRE(m_pipeline == nullptr && m_coalesced == 0);
+
+    m_dest = m_seekableDest = dest;
+  }
+
+  void EncryptionStream::EnablePipelining(int bufferCount, size_t bufferSize)
+  {
+    TWN_REQUIRE(m_pipeline == nullptr && m_seekableDest == nullptr && m_coalesced == 0);
+
+    m_pipeline.reset(new AsyncWriteStream(m_dest, bufferCount, bufferSize));
+    m_dest = m_pipeline.get();
+  }
+
+  bool EncryptionStream::Flush()
+  {
+    TWN_STREAM_PROBE(flush, Encryption, m_algorithm, m_coalesced);
+
+    bool ok = CipherCoalesced();
+
+    return (m_pipeline == nullptr || m_pipeline->Flush()) && ok;
+  }
+
+  bool EncryptionStream::Seek(uint64_t offset)
+  {
+    TWN_REQUIRE(m_seekableDest != nullptr);
+
+    // Whatever was gathered belongs at the old position
+    return CipherCoalesced() && m_seekableDest->Seek(offset) && InitCounterAt(m_crypto, m_settings, offset, true);
+  }
+
+  bool EncryptionStream::WriteAt(uint64_t offset, const void* data, size_t len)
+  {
+    TWN_REQUIRE(m_seekableDest != nullptr);
+
+    // Gathered bytes go out first, so the position to come back to is after them
+    if(!CipherCoalesced())
     {
       return false;
     }
+
+    uint64_t savedPosition = m_seekableDest->GetPosition();
+    bool ok = Seek(offset) && Write(data, len);
+
+    return Seek(savedPosition) && ok;
   }
 
-  bool DecryptionStream::AdvanceRead(int bytes)
+
+  //////////////////////////////////////////////////////////////////////////
+  // DecryptionStream
+  //////////////////////////////////////////////////////////////////////////
+
+  DecryptionStream::DecryptionStream(ReadStream* source, size_t bufferSize)
+    : Base(source, bufferSize)
+    , m_seekableSource(nullptr)
+    , m_failed(false)
   {
-    TWN_REQUIRE(bytes <= GetAvailableRead());
+    m_streamId = this;
+  }
 
-    if(bytes <= GetAvailableRead())
-    {
-      m_readPos += bytes;
-      return true;
-    }
+  DecryptionStream::~DecryptionStream()
+  {
 
-    return false;
   }
 
-  bool DecryptionStream::Decrypt()
+  bool DecryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    m_failed = false;
+    return m_settings.Set(algorithm, key, keySize, iv, ivSize) && Base::Init(algorithm, key, keySize, iv, ivSize);
+  }
+
+  bool DecryptionStream::Seek(uint64_t offset)
   {
+    TWN_REQUIRE(m_seekableSource != nullptr);
+
+    ReleaseSource();
     m_readPos = m_readEnd = m_buffer;
 
-    Buffer buffer;
-    if(m_source->NextRead(buffer))
+    m_failed = !m_seekableSource->Seek(offset) || !InitCounterAt(m_crypto, m_settings, offset, false);
+    return !m_failed;
+  }
+
+  uint64_t DecryptionStream::GetPosition() const
+  {
+    TWN_REQUIRE(m_seekableSource != nullptr);
+
+    // Counter mode ciphertext and plaintext offsets are the same; the source is ahead by whatever hasn't been read yet
+    return m_seekableSource->GetPosition() + m_sourcePending - GetAvailableRead();
+  }
+
+  size_t DecryptionStream::ReadAt(uint64_t offset, void* dst, size_t len)
+  {
+    uint64_t savedPosition = GetPosition();
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    size_t bytesRead = 0;
+
+    if(Seek(offset))
     {
-      int len = twn::min<int>(TWN_ARRAY_SIZE(m_buffer), static_cast<int>(buffer.GetDataLen()));
-      memcpy(m_buffer, buffer.GetData(), len);
-      m_source->AdvanceRead(len);
+      // Decrypt out of place from the source's buffers straight into the caller's memory
+      Buffer buffer;
+      while(bytesRead < len && Refill(buffer) && buffer.GetDataLen() > 0)
+      {
+        size_t chunk = twn::min<size_t>(len - bytesRead, buffer.GetDataLen());
+        size_t written = Cipher(buffer.GetData(), out + bytesRead, chunk);
+        TWN_STREAM_STAT(SourceCalls, 1);
+        m_source->AdvanceRead(static_cast<int>(chunk));
 
-      size_t written = m_crypto.Cipher(m_buffer, len);
-      m_readEnd = m_buffer + written;
+        bytesRead += written;
+      }
+    }
 
-      return true;
+    // Carrying on from the wrong place would decrypt garbage, so the stream fails instead
+    if(!Seek(savedPosition))
+    {
+      return 0;
     }
 
-    return false;
-  } 
+    m_copies.RecordPlaintext(bytesRead);
+    return bytesRead;
+  }
+
+  void DecryptionStream::SetBuffer(void* memory, size_t size)
+  {
+    Base::SetBuffer(memory, size);
+  }
+
+  void DecryptionStream::EnableReadAhead(int chunkCount, size_t chunkSize)
+  {
+    TWN_REQUIRE(m_readAhead == nullptr && m_seekableSource == nullptr && GetAvailableRead() == 0);
+
+    m_readAhead.reset(new AsyncReadStream(m_source, chunkCount, chunkSize));
+    m_source = m_readAhead.get();
+
+    // The read-ahead buffers are writable and never handed out twice
+    m_inPlace = true;
+  }
+
+  bool DecryptionStream::NextRead(Buffer& buffer)
+  {
+    TWN_STREAM_TRACE_SPAN("DecryptionStream::NextRead", 0);
+    return !m_failed && Base::NextRead(buffer);
+  }
+
+  bool DecryptionStream::AdvanceRead(int bytes)
+  {
+    TWN_STREAM_TRACE_SPAN("DecryptionStream::AdvanceRead", bytes);
+    return Base::AdvanceRead(bytes);
+  }
 
   /*static*/ void Crypto::InitializeLibrary()
   {
@@ -120,24 +414,87 @@ namespace TWN
   // BlockEncryptionStream
   //////////////////////////////////////////////////////////////////////////
 
-  BlockEncryptionStream::BlockEncryptionStream(WriteStream* dest)
+  BlockEncryptionStream::BlockEncryptionStream(WriteStream* dest, size_t bufferSize)
     : m_dest(dest)
     , m_blockSize(0)
-    , m_writePos(m_buffer)
+    , m_algorithm(0)
+    , m_storage(bufferSize * 2)
+    , m_batchEngine(nullptr)
+    , m_batchTail(0)
+    , m_batchPending(false)
+  {
+    SetBufferPointers();
+  }
+
+  BlockEncryptionStream::~BlockEncryptionStream()
+  {
+    // The engine mustn't be left holding pointers into the buffers
+    if(m_batchPending)
+    {
+      m_batchEngine->Wait(m_batchJob.get());
+    }
+  }
+
+  void BlockEncryptionStream::SetBuffer(void* memory, size_t size)
   {
+    TWN_REQUIRE(GetAvailableRead() == 0 && !m_batchPending);
 
+    m_storage.Attach(memory, size);
+    SetBufferPointers();
+  }
+
+  void BlockEncryptionStream::SetBufferPointers()
+  {
+    m_bufferSize = m_storage.GetSize() / 2;
+    m_buffer = m_storage.GetData();
+    m_encrypedBuffer = m_buffer + m_bufferSize;
+    m_writePos = m_buffer;
   }
 
   bool BlockEncryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
   {
+    TWN_REQUIRE(!m_batchPending);
+
     m_blockSize = static_cast<int>(keySize);
+    m_algorithm = algorithm;
+    TWN_STREAM_PROBE(init, BlockEncryption, algorithm, keySize);
 
     return m_crypto.Init(algorithm, key, keySize, iv, ivSize, true, false);
   }
 
+  bool BlockEncryptionStream::SetBatchEngine(CbcBatchEngine* engine)
+  {
+    if(!CompleteBatchJob())
+    {
+      return false;
+    }
+
+    CbcLane lane;
+    if(engine != nullptr && !m_crypto.GetCbcLane(lane))
+    {
+      engine = nullptr;
+    }
+
+    m_batchEngine = engine;
+
+    if(engine != nullptr && m_batchJob == nullptr)
+    {
+      m_batchJob.reset(new CbcBatchJob());
+    }
+
+    return engine != nullptr;
+  }
+
   bool BlockEncryptionStream::NextWrite(Buffer& buffer)
   {
-    size_t bufferRemaining = TWN_ARRAY_SIZE(m_buffer) - GetAvailableRead();
+    TWN_STREAM_TRACE_SPAN("BlockEncryptionStream::NextWrite", 0);
+
+    if(!CompleteBatchJob())
+    {
+      return false;
+    }
+
+    size_t bufferRemaining = m_bufferSize - GetAvailableRead();
     buffer.SetData(m_writePos, bufferRemaining);
     return true;
   }
@@ -145,6 +502,9 @@ namespace TWN
   bool BlockEncryptionStream::AdvanceWrite(int bytes)
   {
     PROF_EX(BlockEncryptionStream, AdvanceWrite);
+    TWN_STREAM_TRACE_SPAN("BlockEncryptionStream::AdvanceWrite", bytes);
+
+    m_copies.RecordPlaintext(bytes);
 
     int totalBytes = bytes + GetAvailableRead();
 
@@ -153,14 +513,37 @@ namespace TWN
       // Only encrypt bytes in block-sized chunks
       int bytesToWrite = totalBytes - (totalBytes % m_blockSize);
       int remainingBytes = totalBytes - bytesToWrite;
-      size_t written = m_crypto.Cipher(m_buffer, m_encrypedBuffer, bytesToWrite);
+
+      if(m_batchEngine != nullptr && m_crypto.GetCbcLane(m_batchJob->lane))
+      {
+        // The remaining bytes stay where they are until the engine is done with the blocks in front of them
+        m_batchJob->lane.src = m_buffer;
+        m_batchJob->lane.dst = m_encrypedBuffer;
+        m_batchJob->lane.blocks = bytesToWrite / 16;
+        m_batchTail = remainingBytes;
+        m_writePos = m_buffer + totalBytes;
+        m_batchPending = true;
+
+        TWN_STREAM_PROBE(cipher_start, BlockEncryption, m_algorithm, bytesToWrite);
+        m_batchEngine->Submit(m_batchJob.get());
+        return true;
+      }
+
+      size_t written = 0;
+      {
+        TWN_STREAM_TRACE_SPAN("BlockEncryptionStream::Cipher", bytesToWrite);
+        TWN_STREAM_PROBE(cipher_start, BlockEncryption, m_algorithm, bytesToWrite);
+        written = StatCipher(m_crypto, m_buffer, m_encrypedBuffer, bytesToWrite);
+        TWN_STREAM_PROBE(cipher_end, BlockEncryption, m_algorithm, written);
+      }
 
       // Copy remaining bytes to start of buffer so they can be encrypted later (possibly after padding)
       memcpy(m_buffer, m_buffer + bytesToWrite, remainingBytes);
+      TWN_STREAM_COPIED(m_copies, BlockEncryptionStreamCarry, remainingBytes);
 
       m_writePos = m_buffer + remainingBytes;
 
-      return Stream::Copy(m_encrypedBuffer, *m_dest, written);
+      return CopyToDest(written);
     }
     else
     {
@@ -172,11 +555,50 @@ namespace TWN
 
   void BlockEncryptionStream::Flush()
   {
-    int padBytes = Pad(m_buffer, TWN_ARRAY_SIZE(m_buffer), GetAvailableRead());
+    CompleteBatchJob();
+
+    TWN_STREAM_PROBE(flush, BlockEncryption, m_algorithm, GetAvailableRead());
+
+    int padBytes = Pad(m_buffer, m_bufferSize, GetAvailableRead());
+    TWN_STREAM_PROBE(padding, BlockEncryption, m_algorithm, padBytes);
 
     TWN_REQUIRE((GetAvailableRead() + padBytes) % m_blockSize == 0);
 
     AdvanceWrite(padBytes);
+    CompleteBatchJob();
+  }
+
+  bool BlockEncryptionStream::CompleteBatchJob()
+  {
+    if(!m_batchPending)
+    {
+      return true;
+    }
+
+    m_batchEngine->Wait(m_batchJob.get());
+    m_batchPending = false;
+
+    int encrypted = static_cast<int>(m_batchJob->lane.blocks * 16);
+    TWN_STREAM_PROBE(cipher_end, BlockEncryption, m_algorithm, encrypted);
+    memcpy(m_buffer, m_buffer + encrypted, m_batchTail);
+    TWN_STREAM_COPIED(m_copies, BlockEncryptionStreamCarry, m_batchTail);
+    m_writePos = m_buffer + m_batchTail;
+
+    TWN_STREAM_STAT(CipherCalls, 1);
+    TWN_STREAM_STAT(BytesCiphered, encrypted);
+
+    return CopyToDest(encrypted);
+  }
+
+  bool BlockEncryptionStream::CopyToDest(size_t len)
+  {
+    TWN_STREAM_PROBE(dest_advance, BlockEncryption, m_algorithm, len);
+    TWN_STREAM_TIMER(DestFlush);
+    TWN_STREAM_STAT(DestCalls, 1);
+    TWN_STREAM_STAT(DestFlushes, 1);
+    TWN_STREAM_COPIED(m_copies, BlockEncryptionStreamDest, len);
+
+    return Stream::Copy(m_encrypedBuffer, *m_dest, len);
   }
 
   int BlockEncryptionStream::Pad(uint8_t* buffer, int bufferLen, int dataLen)
@@ -211,30 +633,74 @@ namespace TWN
   // BlockDecryptionStream
   //////////////////////////////////////////////////////////////////////////
 
-  BlockDecryptionStream::BlockDecryptionStream(ReadStream* source)
+  BlockDecryptionStream::BlockDecryptionStream(ReadStream* source, size_t bufferSize)
     : m_source(source)
-    , m_readPos(m_buffer)
-    , m_readEnd(m_buffer)
-    , m_writePos(m_encrypedBuffer)
+    , m_seekableSource(nullptr)
     , m_blockSize(0)
+    , m_storage(bufferSize * 2)
+    , m_cipherHeld(0)
+    , m_workerPool(nullptr)
+    , m_minSliceSize(0)
+    , m_failed(false)
+    , m_skipBytes(0)
+    , m_decryptedSize(0)
+    , m_hasDecryptedSize(false)
   {
+    SetBufferPointers();
+  }
 
+  void BlockDecryptionStream::SetBuffer(void* memory, size_t size)
+  {
+    TWN_REQUIRE(GetAvailableRead() == 0 && GetUsedWrite() == 0);
+
+    m_storage.Attach(memory, size);
+    SetBufferPointers();
+  }
+
+  void BlockDecryptionStream::SetBufferPointers()
+  {
+    m_bufferSize = m_storage.GetSize() / 2;
+    m_buffer = m_storage.GetData();
+    m_encrypedBuffer = m_buffer + m_bufferSize;
+    m_readPos = m_readEnd = m_buffer;
+    m_writePos = m_encrypedBuffer;
   }
 
   bool BlockDecryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
   {
     m_blockSize = static_cast<int>(keySize);
 
+    if(!m_settings.Set(algorithm, key, keySize, iv, ivSize))
+    {
+      return false;
+    }
+
+    memcpy(m_chainIv, iv, ivSize);
+    m_cipherHeld = 0;
+    m_failed = false;
+    m_hasDecryptedSize = false;
+
+    TWN_STREAM_PROBE(init, BlockDecryption, algorithm, keySize);
+
     return m_crypto.Init(algorithm, key, keySize, iv, ivSize, false, false);
   }
 
+  void BlockDecryptionStream::SetWorkerPool(CryptoWorkerPool* pool, size_t minSliceSize)
+  {
+    m_workerPool = pool;
+    m_minSliceSize = static_cast<int>(minSliceSize);
+  }
+
   bool BlockDecryptionStream::NextRead(Buffer& buffer)
   {
-    bool ok = true;
+    TWN_STREAM_TRACE_SPAN("BlockDecryptionStream::NextRead", 0);
+
+    bool ok = !m_failed;
 
-    if(GetAvailableRead() == 0)
+    if(ok && GetAvailableRead() == 0)
     {
-      ok = Decrypt();
+      ok = Decrypt() && !m_failed;
+      SkipPending();
     }
 
     if(ok)
@@ -250,11 +716,13 @@ namespace TWN
 
   bool BlockDecryptionStream::AdvanceRead(int bytes)
   {
+    TWN_STREAM_TRACE_SPAN("BlockDecryptionStream::AdvanceRead", bytes);
     TWN_REQUIRE(bytes <= GetAvailableRead());
 
     if(bytes <= GetAvailableRead())
     {
       m_readPos += bytes;
+      m_copies.RecordPlaintext(bytes);
       return true;
     }
 
@@ -264,11 +732,12 @@ namespace TWN
   void BlockDecryptionStream::Flush()
   {
     int bytesToRead = GetUsedWrite();
+    TWN_STREAM_PROBE(flush, BlockDecryption, m_settings.algorithm, bytesToRead);
 
     TWN_REQUIRE(bytesToRead % m_blockSize == 0);
-    TWN_REQUIRE(bytesToRead <= static_cast<int>(TWN_ARRAY_SIZE(m_buffer)) - (m_buffer - m_readEnd));
+    TWN_REQUIRE(bytesToRead <= m_bufferSize - static_cast<int>(m_readEnd - m_buffer));
 
-    size_t written = m_crypto.Cipher(m_encrypedBuffer, m_readEnd, bytesToRead);
+    size_t written = CipherRun(m_encrypedBuffer, m_readEnd, bytesToRead);
 
     if(written > 0)
     {
@@ -278,6 +747,7 @@ namespace TWN
       if(numPaddedBytes <= m_blockSize)
       {
         m_readEnd -= numPaddedBytes;
+        TWN_STREAM_PROBE(padding, BlockDecryption, m_settings.algorithm, numPaddedBytes);
       }
       else
       {
@@ -286,6 +756,8 @@ namespace TWN
     }
 
     m_writePos = m_encrypedBuffer;
+
+    SkipPending();
   }
 
   bool BlockDecryptionStream::Decrypt()
@@ -295,34 +767,366 @@ namespace TWN
     int bytesRead = 0;
 
     Buffer buffer;
-    while(GetAvailableWrite() > 0 && GetAvailableRead() < m_blockSize && m_source->NextRead(buffer))
+    while(GetAvailableWrite() > 0 && GetAvailableRead() < m_blockSize && Refill(buffer))
     {
       int len = static_cast<int>(twn::min<size_t>(GetAvailableWrite(), buffer.GetDataLen()));
       
       memcpy(m_writePos, buffer.GetData(), len);
+      TWN_STREAM_COPIED(m_copies, BlockDecryptionStreamSource, len);
       m_writePos += len;
+      TWN_STREAM_STAT(SourceCalls, 1);
       m_source->AdvanceRead(len);
 
-      // All data is padded to be a multiple of the block size, which means the final bytes are always padded bytes.
-      // The padded bytes are decrypted in Flush(). So, don't decrypt the last bytes out of the buffer here just in case they are the final padded bytes.
+      bytesRead += len;
 
-      int availableBytes = GetUsedWrite();
-      int bytesToRead = availableBytes - (availableBytes % m_blockSize) - m_blockSize;
-      int remainingBytes = availableBytes - bytesToRead;
+      // In parallel mode, gather as much ciphertext as fits so there is enough of it to split between the workers
+      if(m_workerPool == nullptr || GetAvailableWrite() == 0)
+      {
+        DecryptAvailable();
+      }
+    }
 
-      if(bytesToRead > 0)
+    if(m_workerPool != nullptr)
+    {
+      DecryptAvailable();
+    }
+
+    return bytesRead > 0;
+  }
+
+  void BlockDecryptionStream::DecryptAvailable()
+  {
+    // All data is padded to be a multiple of the block size, which means the final bytes are always padded bytes.
+    // The padded bytes are decrypted in Flush(). So, don't decrypt the last bytes out of the buffer here just in case they are the final padded bytes.
+
+    int availableBytes = GetUsedWrite();
+    int bytesToRead = availableBytes - (availableBytes % m_blockSize) - m_blockSize;
+    int remainingBytes = availableBytes - bytesToRead;
+
+    if(bytesToRead > 0)
+    {
+      size_t written = CipherRun(m_encrypedBuffer, m_readEnd, bytesToRead);
+      m_readEnd += written;
+
+      // Copy remaining bytes to start of buffer so they can be decrypted later
+      memmove(m_encrypedBuffer, m_encrypedBuffer + bytesToRead, remainingBytes);
+      TWN_STREAM_COPIED(m_copies, BlockDecryptionStreamCarry, remainingBytes);
+      m_writePos = m_encrypedBuffer + remainingBytes;
+    }
+  }
+
+  size_t BlockDecryptionStream::CipherRun(const uint8_t* src, uint8_t* dst, int len)
+  {
+    TWN_STREAM_TRACE_SPAN("BlockDecryptionStream::Cipher", len);
+    TWN_STREAM_PROBE(cipher_start, BlockDecryption, m_settings.algorithm, len);
+    TWN_STREAM_TIMER(Cipher);
+    TWN_STREAM_STAT(CipherCalls, 1);
+    TWN_STREAM_STAT(BytesCiphered, len);
+
+    int ivSize = static_cast<int>(m_settings.ivSize);
+    size_t written = 0;
+
+    // The slices start after any partial cipher block held back from the last run, and are whole padding and cipher blocks
+    int head = (m_cipherHeld > 0) ? twn::min<int>(ivSize - m_cipherHeld, len) : 0;
+    int alignment = GetChainAlignment();
+    int body = (len - head) - ((len - head) % alignment);
+    int sliceCount = 0;
+
+    if(m_workerPool != nullptr && m_minSliceSize > 0)
+    {
+      sliceCount = twn::min<int>(body / twn::max<int>(m_minSliceSize, alignment), m_workerPool->GetNumThreads() + 1);
+    }
+
+    if(sliceCount >= 2)
+    {
+      // Completing the held back block puts the serial context, and m_chainIv, on a cipher block boundary
+      written += m_crypto.Cipher(src, dst, head);
+      AdvanceChainIv(src, head);
+
+      // Every CBC plaintext block only depends on its own ciphertext block and the one before it,
+      // so each slice can be decrypted independently by seeding it with the preceding ciphertext block as the IV
+      int sliceSize = (body / sliceCount) - ((body / sliceCount) % alignment);
+      const uint8_t* bodySrc = src + head;
+      uint8_t* bodyDst = dst + written;
+      const uint8_t* firstIv = m_chainIv;
+      const CipherSettings& settings = m_settings;
+
+      std::vector<size_t> sliceWritten(sliceCount, 0);
+      std::atomic<bool> sliceFailed(false);
+
+      m_workerPool->ParallelFor(sliceCount, [=, &settings, &sliceWritten, &sliceFailed](int slice)
       {
-        size_t written = m_crypto.Cipher(m_encrypedBuffer, m_buffer, bytesToRead); 
-        m_readEnd = m_buffer + written;
+        int offset = slice * sliceSize;
+        int sliceLen = (slice == sliceCount - 1) ? body - offset : sliceSize;
+        const uint8_t* iv = (slice == 0) ? firstIv : bodySrc + offset - ivSize;
+
+        StreamCrypto crypto;
+        if(crypto.Init(settings.algorithm, settings.key, settings.keySize, iv, settings.ivSize, false, false))
+        {
+          sliceWritten[slice] = crypto.Cipher(bodySrc + offset, bodyDst + offset, sliceLen);
+        }
+        else
+        {
+          sliceFailed.store(true, std::memory_order_relaxed);
+        }
+      });
+
+      for(size_t sliceLen : sliceWritten)
+      {
+        written += sliceLen;
+      }
 
-        // Copy remaining bytes to start of buffer so they can be decrypted later
-        memmove(m_encrypedBuffer, m_encrypedBuffer + bytesToRead, remainingBytes);
-        m_writePos = m_encrypedBuffer + remainingBytes;
+      // The serial context is behind by the whole body; re-seed it so the rest of the run, Flush() and smaller runs carry on from here
+      if(sliceFailed.load(std::memory_order_relaxed)
+        || !m_crypto.Init(m_settings.algorithm, m_settings.key, m_settings.keySize, bodySrc + body - ivSize, m_settings.ivSize, false, false))
+      {
+        TWN_BUG("BlockDecryptionStream: Parallel decryption failed");
+        m_failed = true;
+        return 0;
       }
 
-      bytesRead += len;
+      written += m_crypto.Cipher(bodySrc + body, dst + written, len - head - body);
+      AdvanceChainIv(bodySrc, len - head);
+    }
+    else
+    {
+      written = m_crypto.Cipher(src, dst, len);
+      AdvanceChainIv(src, len);
     }
 
-    return bytesRead > 0;
+    m_cipherHeld = (m_cipherHeld + len) % ivSize;
+
+    TWN_STREAM_PROBE(cipher_end, BlockDecryption, m_settings.algorithm, written);
+    return written;
+  }
+
+  void BlockDecryptionStream::AdvanceChainIv(const uint8_t* src, int len)
+  {
+    int ivSize = static_cast<int>(m_settings.ivSize);
+
+    // Runs can end part way through a cipher block, so keep the last ivSize bytes of ciphertext seen rather than the last whole block
+    if(len >= ivSize)
+    {
+      memcpy(m_chainIv, src + len - ivSize, ivSize);
+    }
+    else if(len > 0)
+    {
+      memmove(m_chainIv, m_chainIv + len, ivSize - len);
+      memcpy(m_chainIv + ivSize - len, src, len);
+    }
+  }
+
+  int BlockDecryptionStream::GetChainAlignment() const
+  {
+    // Smallest run that is both whole cipher blocks and whole padding blocks
+    int cipherBlockSize = static_cast<int>(m_settings.ivSize);
+    int alignment = cipherBlockSize;
+    while(alignment % m_blockSize != 0)
+    {
+      alignment += cipherBlockSize;
+    }
+
+    return alignment;
+  }
+
+  bool BlockDecryptionStream::Refill(Buffer& buffer)
+  {
+    TWN_STREAM_TIMER(SourceRefill);
+    TWN_STREAM_STAT(SourceCalls, 1);
+    TWN_STREAM_STAT(SourceRefills, 1);
+
+    bool result = m_source->NextRead(buffer);
+    TWN_STREAM_PROBE(source_refill, BlockDecryption, m_settings.algorithm, result ? buffer.GetDataLen() : 0);
+    return result;
+  }
+
+  void BlockDecryptionStream::SkipPending()
+  {
+    int skip = twn::min<int>(m_skipBytes, GetAvailableRead());
+    m_readPos += skip;
+    m_skipBytes -= skip;
+  }
+
+  bool BlockDecryptionStream::Seek(uint64_t offset)
+  {
+    TWN_REQUIRE(m_seekableSource != nullptr);
+
+    uint64_t decryptedSize = 0;
+    if(!GetDecryptedSize(decryptedSize) || offset > decryptedSize)
+    {
+      return false;
+    }
+
+    // Restart on a boundary that is both a cipher block and a padding block, so what follows is still a whole number of padding blocks
+    uint64_t cipherBlockSize = m_settings.ivSize;
+    uint64_t alignment = GetChainAlignment();
+
+    uint64_t blockStart = offset - (offset % alignment);
+    uint8_t iv[TWN_ARRAY_SIZE(m_chainIv)];
+    bool ok = true;
+
+    if(blockStart > 0)
+    {
+      ok = m_seekableSource->Seek(blockStart - cipherBlockSize) && ReadExact(*m_seekableSource, iv, m_settings.ivSize);
+    }
+    else
+    {
+      memcpy(iv, m_settings.iv, m_settings.ivSize);
+      ok = m_seekableSource->Seek(0);
+    }
+
+    if(!ok)
+    {
+      return false;
+    }
+
+    memcpy(m_chainIv, iv, m_settings.ivSize);
+    m_cipherHeld = 0;
+    m_failed = false;
+    m_readPos = m_readEnd = m_buffer;
+    m_writePos = m_encrypedBuffer;
+    m_skipBytes = static_cast<int>(offset - blockStart);
+
+    return m_crypto.Init(m_settings.algorithm, m_settings.key, m_settings.keySize, iv, m_settings.ivSize, false, false);
+  }
+
+  size_t BlockDecryptionStream::ReadAt(uint64_t offset, void* dst, size_t len)
+  {
+    TWN_REQUIRE(m_seekableSource != nullptr);
+
+    uint64_t decryptedSize = 0;
+    if(!GetDecryptedSize(decryptedSize) || offset >= decryptedSize)
+    {
+      return 0;
+    }
+
+    len = static_cast<size_t>(twn::min<uint64_t>(len, decryptedSize - offset));
+
+    uint64_t cipherBlockSize = m_settings.ivSize;
+    uint64_t blockStart = offset - (offset % cipherBlockSize);
+    uint64_t savedPosition = m_seekableSource->GetPosition();
+    uint8_t iv[TWN_ARRAY_SIZE(m_chainIv)];
+    bool ok = true;
+
+    // Only the ciphertext block in front of the range is needed to decrypt it: it is the range's IV
+    if(blockStart > 0)
+    {
+      ok = m_seekableSource->Seek(blockStart - cipherBlockSize) && ReadExact(*m_seekableSource, iv, m_settings.ivSize);
+    }
+    else
+    {
+      memcpy(iv, m_settings.iv, m_settings.ivSize);
+      ok = m_seekableSource->Seek(0);
+    }
+
+    StreamCrypto crypto;
+    ok = ok && crypto.Init(m_settings.algorithm, m_settings.key, m_settings.keySize, iv, m_settings.ivSize, false, false);
+
+    uint8_t scratch[4096];
+    uint64_t position = blockStart;
+    uint64_t end = offset + len;
+    size_t bytesRead = 0;
+
+    while(ok && position < end)
+    {
+      uint64_t remaining = end - position + cipherBlockSize - 1;
+      int chunk = static_cast<int>(twn::min<uint64_t>(TWN_ARRAY_SIZE(scratch), remaining - (remaining % cipherBlockSize)));
+
+      ok = ReadExact(*m_seekableSource, scratch, chunk);
+
+      if(ok)
+      {
+        {
+          TWN_STREAM_TRACE_SPAN("BlockDecryptionStream::Cipher", chunk);
+          TWN_STREAM_PROBE(cipher_start, BlockDecryption, m_settings.algorithm, chunk);
+          StatCipher(crypto, scratch, scratch, chunk);
+          TWN_STREAM_PROBE(cipher_end, BlockDecryption, m_settings.algorithm, chunk);
+        }
+
+        uint64_t copyStart = twn::max<uint64_t>(position, offset);
+        uint64_t copyEnd = twn::min<uint64_t>(position + chunk, end);
+        memcpy(static_cast<uint8_t*>(dst) + bytesRead, scratch + (copyStart - position), static_cast<size_t>(copyEnd - copyStart));
+        TWN_STREAM_COPIED(m_copies, BlockDecryptionStreamReadAt, copyEnd - copyStart);
+
+        bytesRead += static_cast<size_t>(copyEnd - copyStart);
+        position += chunk;
+      }
+    }
+
+    // Sequential reading would carry on from the wrong place with the wrong chain, so the stream fails instead
+    if(!m_seekableSource->Seek(savedPosition))
+    {
+      m_failed = true;
+      return 0;
+    }
+
+    m_copies.RecordPlaintext(bytesRead);
+    return bytesRead;
+  }
+
+  bool BlockDecryptionStream::GetDecryptedSize(uint64_t& size)
+  {
+    TWN_REQUIRE(m_seekableSource != nullptr);
+
+    // Nothing to size the blocks by before Init; Seek and ReadAt fail through here too
+    if(m_blockSize == 0)
+    {
+      return false;
+    }
+
+    if(!m_hasDecryptedSize)
+    {
+      // The padding length is the last plaintext byte, so only the final cipher block needs decrypting, with the one before it as the IV
+      uint64_t encryptedSize = m_seekableSource->GetSize();
+      uint64_t cipherBlockSize = m_settings.ivSize;
+
+      if(encryptedSize < cipherBlockSize || encryptedSize % m_blockSize != 0)
+      {
+        return false;
+      }
+
+      uint64_t savedPosition = m_seekableSource->GetPosition();
+      uint8_t blocks[TWN_ARRAY_SIZE(m_chainIv) * 2];
+      uint8_t* iv = blocks;
+      uint8_t* lastBlock = blocks + cipherBlockSize;
+      bool ok = false;
+
+      if(encryptedSize >= 2 * cipherBlockSize)
+      {
+        ok = m_seekableSource->Seek(encryptedSize - 2 * cipherBlockSize) && ReadExact(*m_seekableSource, blocks, 2 * m_settings.ivSize);
+      }
+      else
+      {
+        memcpy(iv, m_settings.iv, m_settings.ivSize);
+        ok = m_seekableSource->Seek(0) && ReadExact(*m_seekableSource, lastBlock, m_settings.ivSize);
+      }
+
+      if(!m_seekableSource->Seek(savedPosition))
+      {
+        m_failed = true;
+        return false;
+      }
+
+      StreamCrypto crypto;
+      if(!ok || !crypto.Init(m_settings.algorithm, m_settings.key, m_settings.keySize, iv, m_settings.ivSize, false, false))
+      {
+        return false;
+      }
+
+      crypto.Cipher(lastBlock, m_settings.ivSize);
+      uint8_t numPaddedBytes = lastBlock[cipherBlockSize - 1];
+
+      if(numPaddedBytes == 0 || numPaddedBytes > m_blockSize || numPaddedBytes > encryptedSize)
+      {
+        TWN_BUG("BlockDecryptionStream: Invalid number of padded bytes {0}; maximum is {1}", numPaddedBytes, m_blockSize);
+        return false;
+      }
+
+      m_decryptedSize = encryptedSize - numPaddedBytes;
+      m_hasDecryptedSize = true;
+    }
+
+    size = m_decryptedSize;
+    return true;
   }
 }
@@ -1,72 +1,617 @@
 #pragma once
 
+#include "CipherKernels.h"
+#include "Common/Assert.h"
+#include "CopyAccounting.h"
 #include "Stream.h"
 #include "Stream/Buffer.h"
+#include "StreamProbes.h"
+#include "StreamStats.h"
+#include "StreamTrace.h"
 
-#if defined(_XBOX_ONE)
-#define USE_BCRYPT
-#endif
-
-#if defined(USE_BCRYPT)
-#include "XBCrypto.h"
-#else
-#include "SSLCrypto.h"
-#include <openssl/evp.h>
-#endif
+#include <chrono>
+#include <memory>
 
 
 namespace TWN
 {
+  class AsyncReadStream;
+  class AsyncWriteStream;
+  class CbcBatchEngine;
+  struct CbcBatchJob;
+  class CryptoWorkerPool;
+
   class Crypto
   {
   public:
     static void InitializeLibrary();
   };
 
-  class EncryptionStream : public WriteStream
+  // Intermediate buffer memory for the crypto streams, either allocated on the heap or supplied by the caller
+  class CryptoBuffer
+  {
+  public:
+    static const size_t DefaultSize = 4096;
+
+    // size == 0 leaves the buffer empty until Allocate or Attach is called
+    CryptoBuffer(size_t size);
+    ~CryptoBuffer();
+
+    void Allocate(size_t size);
+    void Attach(void* memory, size_t size);
+
+    uint8_t* GetData() const { return m_data; }
+    int GetSize() const { return m_size; }
+
+  private:
+    CryptoBuffer(const CryptoBuffer&) = delete;
+    CryptoBuffer& operator=(const CryptoBuffer&) = delete;
+
+    void Release();
+
+    uint8_t* m_data;
+    int m_size;
+    bool m_owned;
+  };
+
+  // A ReadStream that can be repositioned, which the decryption streams need for random access reads
+  class SeekableReadStream : public ReadStream
+  {
+  public:
+    virtual bool Seek(uint64_t offset) = 0;
+    virtual uint64_t GetPosition() const = 0;
+    virtual uint64_t GetSize() const = 0;
+  };
+
+  // A WriteStream that can be repositioned, which EncryptionStream needs for positional writes
+  class SeekableWriteStream : public WriteStream
+  {
+  public:
+    virtual bool Seek(uint64_t offset) = 0;
+    virtual uint64_t GetPosition() const = 0;
+  };
+
+  // Read exactly len bytes from the stream, failing if it runs out first
+  bool ReadExact(ReadStream& stream, void* dst, size_t len);
+
+  // Copy of the parameters a crypto stream was initialised with, for streams that need to set up extra crypto contexts later
+  struct CipherSettings
+  {
+    CipherSettings();
+    ~CipherSettings();
+
+    bool Set(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    int algorithm;
+    size_t keySize;
+    size_t ivSize;
+    uint8_t key[64];
+    uint8_t iv[32];
+  };
+
+  // Size of the blocks a counter mode algorithm's keystream is made in: the counter block for the IV-sized ciphers, 64 bytes for ChaCha20
+  inline size_t GetCounterBlockSize(int algorithm, size_t ivSize)
+  {
+    return StreamCrypto::IsChaChaAlgorithm(algorithm) ? ChaChaCipher::BlockSize : ivSize;
+  }
+
+  // Set up a counter mode context to carry on from a byte offset into the stream: the IV is the initial counter block,
+  // advanced by the number of whole blocks before the offset, and the keystream for the part of the block before the offset is skipped.
+  // Platform algorithm ids can't be told apart by mode here, so the caller must only pass counter mode ones; returns false for the
+  // native CBC ids and for algorithms without an IV.
+  template<typename TCrypto>
+  bool InitCounterAt(TCrypto& crypto, const CipherSettings& settings, uint64_t offset, bool encrypt)
+  {
+    if(StreamCrypto::IsChaChaAlgorithm(settings.algorithm))
+    {
+      return crypto.Init(settings.algorithm, settings.key, settings.keySize, settings.iv, settings.ivSize, encrypt, true) && crypto.SeekKeystream(offset);
+    }
+
+    if(settings.ivSize == 0 || settings.algorithm == NativeAes128Cbc || settings.algorithm == NativeAes256Cbc)
+    {
+      return false;
+    }
+
+    uint8_t counter[TWN_ARRAY_SIZE(CipherSettings::iv)];
+    memcpy(counter, settings.iv, settings.ivSize);
+
+    // The counter block is one big-endian integer
+    uint64_t carry = offset / settings.ivSize;
+    for(size_t i = settings.ivSize; i-- > 0 && carry != 0;)
+    {
+      carry += counter[i];
+      counter[i] = static_cast<uint8_t>(carry);
+      carry >>= 8;
+    }
+
+    if(!crypto.Init(settings.algorithm, settings.key, settings.keySize, counter, settings.ivSize, encrypt, true))
+    {
+      return false;
+    }
+
+    uint8_t skip[TWN_ARRAY_SIZE(CipherSettings::iv)] = {};
+    crypto.Cipher(skip, static_cast<size_t>(offset % settings.ivSize));
+
+    return true;
+  }
+
+  // Compile-time counterparts of EncryptionStream and DecryptionStream: Backend is the crypto context (StreamCrypto, PlatformCrypto, or anything
+  // else with the same Init and Cipher members) and Dest/Source the stream the data goes to or comes from. Nothing is virtual, so with a
+  // concrete sink like BufferSink, or a final stream class, the whole per-chunk path can be inlined, which is what matters for small records.
+  // EncryptionStream and DecryptionStream are thin virtual adapters over these, instantiated on StreamCrypto and the abstract stream types.
+  template<typename Backend, typename Dest>
+  class EncryptionStreamT
+  {
+  public:
+    explicit EncryptionStreamT(Dest* dest) : m_dest(dest), m_algorithm(0), m_streamId(this) {}
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+    {
+      m_algorithm = algorithm;
+      TWN_STREAM_PROBE_FOR(m_streamId, init, Encryption, algorithm, keySize);
+
+      return m_crypto.Init(algorithm, key, keySize, iv, ivSize, true, true);
+    }
+
+    bool NextWrite(Buffer& buffer)
+    {
+      TWN_STREAM_STAT(DestCalls, 1);
+
+      bool result = m_dest->NextWrite(m_lastBuffer);
+      buffer.SetData(m_lastBuffer.GetData(), m_lastBuffer.GetDataLen());
+      return result;
+    }
+
+    bool AdvanceWrite(int bytes)
+    {
+      m_copies.RecordPlaintext(bytes);
+      size_t written = Cipher(m_lastBuffer.GetData(), m_lastBuffer.GetData(), bytes);
+
+      TWN_STREAM_PROBE_FOR(m_streamId, dest_advance, Encryption, m_algorithm, written);
+      TWN_STREAM_TIMER(DestFlush);
+      TWN_STREAM_STAT(DestCalls, 1);
+      TWN_STREAM_STAT(DestFlushes, 1);
+      return m_dest->AdvanceWrite(static_cast<int>(written));
+    }
+
+    // Encrypt len bytes from data out of place, straight into the destination's buffers, leaving data untouched
+    bool Write(const void* data, size_t len);
+
+    Dest* GetDest() const { return m_dest; }
+    void SetDest(Dest* dest) { m_dest = dest; }
+
+    Backend& GetCrypto() { return m_crypto; }
+
+    const CopyLedger& GetCopyLedger() const { return m_copies; }
+
+  protected:
+    size_t Cipher(const void* src, void* dst, size_t len)
+    {
+      TWN_STREAM_TRACE_SPAN_FOR("EncryptionStream::Cipher", m_streamId, len);
+      TWN_STREAM_PROBE_FOR(m_streamId, cipher_start, Encryption, m_algorithm, len);
+      size_t written = StatCipher(m_crypto, src, dst, len);
+      TWN_STREAM_PROBE_FOR(m_streamId, cipher_end, Encryption, m_algorithm, written);
+      return written;
+    }
+
+    Buffer m_lastBuffer;
+    Dest* m_dest;
+    Backend m_crypto;
+    int m_algorithm;
+    const void* m_streamId; // What traces and probes tag this stream with; an adapter deriving from this sets it to itself, so all its spans match
+    CopyLedger m_copies;
+  };
+
+  template<typename Backend, typename Source>
+  class DecryptionStreamT
+  {
+  public:
+    explicit DecryptionStreamT(Source* source, size_t bufferSize = CryptoBuffer::DefaultSize)
+      : m_source(source)
+      , m_storage(bufferSize)
+      , m_buffer(m_storage.GetData())
+      , m_readPos(m_buffer)
+      , m_readEnd(m_buffer)
+      , m_blockSize(1)
+      , m_algorithm(0)
+      , m_streamId(this)
+      , m_inPlace(false)
+      , m_sourcePending(0)
+    {
+
+    }
+
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+    {
+      m_blockSize = twn::max<size_t>(GetCounterBlockSize(algorithm, ivSize), 1);
+      m_algorithm = algorithm;
+      TWN_STREAM_PROBE_FOR(m_streamId, init, Decryption, algorithm, keySize);
+
+      return m_crypto.Init(algorithm, key, keySize, iv, ivSize, false, true);
+    }
+
+    bool NextRead(Buffer& buffer)
+    {
+      if(GetAvailableRead() == 0 && !Decrypt())
+      {
+        return false;
+      }
+
+      buffer.SetData(m_readPos, m_readEnd - m_readPos);
+      return true;
+    }
+
+    bool AdvanceRead(int bytes)
+    {
+      TWN_REQUIRE(bytes <= GetAvailableRead());
+
+      if(bytes <= GetAvailableRead())
+      {
+        m_readPos += bytes;
+        m_copies.RecordPlaintext(bytes);
+        return true;
+      }
+
+      return false;
+    }
+
+    // See DecryptionStream::ReadInto
+    size_t ReadInto(void* dst, size_t len);
+
+    // See DecryptionStream::SetInPlace
+    void SetInPlace(bool inPlace) { m_inPlace = inPlace; }
+
+    // Use caller-owned memory for the decryption buffer; must be called before reading, and the memory must outlive the stream
+    void SetBuffer(void* memory, size_t size)
+    {
+      TWN_REQUIRE(GetAvailableRead() == 0);
+
+      m_storage.Attach(memory, size);
+      m_buffer = m_readPos = m_readEnd = m_storage.GetData();
+    }
+
+    Source* GetSource() const { return m_source; }
+    void SetSource(Source* source) { m_source = source; }
+
+    Backend& GetCrypto() { return m_crypto; }
+
+    const CopyLedger& GetCopyLedger() const { return m_copies; }
+
+  protected:
+    bool Decrypt();
+
+    // Give back the source buffer being read in place, and drop anything decrypted that hasn't been read
+    void ReleaseSource()
+    {
+      if(m_sourcePending > 0)
+      {
+        TWN_STREAM_STAT(SourceCalls, 1);
+        m_source->AdvanceRead(m_sourcePending);
+        m_sourcePending = 0;
+      }
+    }
+
+    // Fetch the next ciphertext buffer from the source
+    bool Refill(Buffer& buffer)
+    {
+      TWN_STREAM_TIMER(SourceRefill);
+      TWN_STREAM_STAT(SourceCalls, 1);
+      TWN_STREAM_STAT(SourceRefills, 1);
+
+      bool result = m_source->NextRead(buffer);
+      TWN_STREAM_PROBE_FOR(m_streamId, source_refill, Decryption, m_algorithm, result ? buffer.GetDataLen() : 0);
+      return result;
+    }
+
+    size_t Cipher(const void* src, void* dst, size_t len)
+    {
+      TWN_STREAM_TRACE_SPAN_FOR("DecryptionStream::Cipher", m_streamId, len);
+      TWN_STREAM_PROBE_FOR(m_streamId, cipher_start, Decryption, m_algorithm, len);
+      size_t written = StatCipher(m_crypto, src, dst, len);
+      TWN_STREAM_PROBE_FOR(m_streamId, cipher_end, Decryption, m_algorithm, written);
+      return written;
+    }
+
+    int GetAvailableRead() const { return static_cast<int>(m_readEnd - m_readPos); }
+
+    Source* m_source;
+    Backend m_crypto;
+
+    CryptoBuffer m_storage;
+    uint8_t* m_buffer;
+    uint8_t* m_readPos;
+    uint8_t* m_readEnd;
+
+    size_t m_blockSize; // Whole blocks of ciphertext never decrypt to more plaintext than they take up, so ReadInto can decrypt them into the caller's memory
+    int m_algorithm;
+    const void* m_streamId; // As for EncryptionStreamT
+    bool m_inPlace;
+    int m_sourcePending; // Bytes of the current source buffer that are being read in place and haven't been advanced yet
+
+    CopyLedger m_copies;
+  };
+
+  template<typename Backend, typename Dest>
+  bool EncryptionStreamT<Backend, Dest>::Write(const void* data, size_t len)
+  {
+    const uint8_t* src = static_cast<const uint8_t*>(data);
+
+    Buffer buffer;
+    while(len > 0 && m_dest->NextWrite(buffer) && buffer.GetDataLen() > 0)
+    {
+      size_t chunk = twn::min<size_t>(len, buffer.GetDataLen());
+      m_copies.RecordPlaintext(chunk);
+      size_t written = Cipher(src, buffer.GetData(), chunk);
+
+      TWN_STREAM_PROBE_FOR(m_streamId, dest_advance, Encryption, m_algorithm, written);
+      TWN_STREAM_TIMER(DestFlush);
+      TWN_STREAM_STAT(DestCalls, 2);
+      TWN_STREAM_STAT(DestFlushes, 1);
+      if(!m_dest->AdvanceWrite(static_cast<int>(written)))
+      {
+        return false;
+      }
+
+      src += chunk;
+      len -= chunk;
+    }
+
+    return len == 0;
+  }
+
+  template<typename Backend, typename Source>
+  size_t DecryptionStreamT<Backend, Source>::ReadInto(void* dst, size_t len)
+  {
+    uint8_t* out = static_cast<uint8_t*>(dst);
+    size_t bytesRead = 0;
+
+    while(bytesRead < len)
+    {
+      // The unaligned head and tail go through m_buffer
+      if(GetAvailableRead() > 0)
+      {
+        size_t chunk = twn::min<size_t>(len - bytesRead, GetAvailableRead());
+        memcpy(out + bytesRead, m_readPos, chunk);
+        TWN_STREAM_COPIED(m_copies, DecryptionStreamReadInto, chunk);
+        m_readPos += chunk;
+        bytesRead += chunk;
+        continue;
+      }
+
+      ReleaseSource();
+
+      Buffer buffer;
+      if(!Refill(buffer) || buffer.GetDataLen() == 0)
+      {
+        break;
+      }
+
+      // Decrypt whole blocks straight from the source's buffer into the caller's memory
+      size_t bulk = twn::min<size_t>(len - bytesRead, buffer.GetDataLen());
+      bulk -= bulk % m_blockSize;
+
+      if(bulk > 0)
+      {
+        size_t written = Cipher(buffer.GetData(), out + bytesRead, bulk);
+        TWN_STREAM_STAT(SourceCalls, 1);
+        m_source->AdvanceRead(static_cast<int>(bulk));
+        bytesRead += written;
+      }
+      else if(!Decrypt())
+      {
+        break;
+      }
+    }
+
+    m_copies.RecordPlaintext(bytesRead);
+    return bytesRead;
+  }
+
+  template<typename Backend, typename Source>
+  bool DecryptionStreamT<Backend, Source>::Decrypt()
+  {
+    ReleaseSource();
+
+    m_readPos = m_readEnd = m_buffer;
+
+    Buffer buffer;
+    if(Refill(buffer))
+    {
+      uint8_t* data = static_cast<uint8_t*>(buffer.GetData());
+
+      if(m_inPlace)
+      {
+        // Decrypt the whole source buffer where it is and hand it out directly; the source is advanced once it has been read
+        int len = static_cast<int>(buffer.GetDataLen());
+        size_t written = Cipher(data, data, len);
+        m_readPos = data;
+        m_readEnd = data + written;
+        m_sourcePending = len;
+      }
+      else
+      {
+        // Decrypt straight out of the source buffer rather than copying it to m_buffer first
+        int len = twn::min<int>(m_storage.GetSize(), static_cast<int>(buffer.GetDataLen()));
+        size_t written = Cipher(data, m_buffer, len);
+        TWN_STREAM_STAT(SourceCalls, 1);
+        m_source->AdvanceRead(len);
+        m_readEnd = m_buffer + written;
+      }
+
+      return true;
+    }
+
+    return false;
+  }
+
+  // Non-virtual sink over caller memory for EncryptionStreamT, e.g. to encrypt a small record into a packet buffer
+  class BufferSink
+  {
+  public:
+    BufferSink(void* memory, size_t size) : m_data(static_cast<uint8_t*>(memory)), m_size(size), m_written(0) {}
+
+    bool NextWrite(Buffer& buffer)
+    {
+      buffer.SetData(m_data + m_written, m_size - m_written);
+      return m_written < m_size;
+    }
+
+    bool AdvanceWrite(int bytes)
+    {
+      TWN_REQUIRE(static_cast<size_t>(bytes) <= m_size - m_written);
+
+      m_written += bytes;
+      return true;
+    }
+
+    size_t GetWritten() const { return m_written; }
+    void Reset() { m_written = 0; }
+
+  private:
+    uint8_t* m_data;
+    size_t m_size;
+    size_t m_written;
+  };
+
+  // Non-virtual source over caller memory for DecryptionStreamT. The memory is handed out writable, so the stream can decrypt it in place.
+  class BufferSource
+  {
+  public:
+    BufferSource(void* memory, size_t size) : m_data(static_cast<uint8_t*>(memory)), m_size(size), m_read(0) {}
+
+    bool NextRead(Buffer& buffer)
+    {
+      buffer.SetData(m_data + m_read, m_size - m_read);
+      return m_read < m_size;
+    }
+
+    bool AdvanceRead(int bytes)
+    {
+      TWN_REQUIRE(static_cast<size_t>(bytes) <= m_size - m_read);
+
+      m_read += bytes;
+      return true;
+    }
+
+    size_t GetRead() const { return m_read; }
+
+  private:
+    uint8_t* m_data;
+    size_t m_size;
+    size_t m_read;
+  };
+
+  class EncryptionStream : public WriteStream, protected EncryptionStreamT<StreamCrypto, WriteStream>
   {
   public:
     EncryptionStream(WriteStream* dest);
+    ~EncryptionStream();
 
     bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
 
     bool NextWrite(Buffer& buffer) override;
     bool AdvanceWrite(int bytes) override;
+
+    // Encrypt len bytes from data out of place, straight into the destination's buffers, leaving data untouched.
+    // With a mapped source and destination this encrypts from one mapping to the other without any copies.
+    bool Write(const void* data, size_t len);
+
+    void SetSeekableDest(SeekableWriteStream* dest);
+
+    // Bytes this stream has copied rather than encrypted in place, per call site; see CopyAccounting.h
+    const CopyLedger& GetCopyLedger() const { return Base::GetCopyLedger(); }
+
+    // Encrypt into a ring of bufferCount buffers that a background thread writes to dest, so writing buffer N overlaps with filling and
+    // encrypting buffer N + 1. Call Flush() to wait for everything to reach dest. Can't be combined with positional writes.
+    void EnablePipelining(int bufferCount, size_t bufferSize);
+
+    // Gather small writes into the current dest buffer and encrypt them in one Cipher call, instead of one per AdvanceWrite or Write.
+    // The gathered bytes are encrypted and passed on once the dest buffer is full, once maxBytes are waiting (0 for no byte limit), on a write
+    // that finds the oldest gathered byte more than maxDelay old (zero for no time limit; nothing happens between writes), or on Flush().
+    // Call Flush() before dropping the stream, or the gathered bytes never reach dest. Pass enable = false to stop coalescing.
+    void SetCoalescing(bool enable, size_t maxBytes = 0, std::chrono::microseconds maxDelay = std::chrono::microseconds::zero());
+
+    // Encrypt and pass on any coalesced writes, then wait until all pipelined data has been written to dest; returns false if any write failed
+    bool Flush();
+
+    // Positional writes for counter mode algorithms only; these need a seekable destination and must not be called between NextWrite and AdvanceWrite.
+    // The counter is recomputed from the offset, so nothing before it has to be encrypted again. Native CBC is refused, but a platform
+    // algorithm id is taken to be counter mode; with any other mode the data written is garbage.
+    // WriteAt works like pwrite, leaving the sequential position where it was.
+    bool Seek(uint64_t offset);
+    bool WriteAt(uint64_t offset, const void* data, size_t len);
   protected:
-    Buffer m_lastBuffer;
-    WriteStream* m_dest;
-#if defined(USE_BCRYPT)
-    XBCrypto m_crypto;
-#else
-    SSLCrypto m_crypto;
-#endif
+    typedef EncryptionStreamT<StreamCrypto, WriteStream> Base;
+
+    bool CipherCoalesced();
+
+    SeekableWriteStream* m_seekableDest;
+    std::unique_ptr<AsyncWriteStream> m_pipeline;
+    CipherSettings m_settings;
+
+    bool m_coalesce;
+    int m_coalesceLimit;
+    std::chrono::microseconds m_coalesceDelay;
+    int m_coalesced; // Plaintext bytes gathered at the start of m_lastBuffer, which is held from dest until they are encrypted
+    std::chrono::steady_clock::time_point m_coalesceStart;
   };
 
-  class DecryptionStream : public ReadStream
+  class DecryptionStream : public ReadStream, protected DecryptionStreamT<StreamCrypto, ReadStream>
   {
   public:
-    DecryptionStream(ReadStream* source);
+    DecryptionStream(ReadStream* source, size_t bufferSize = CryptoBuffer::DefaultSize);
+    ~DecryptionStream();
 
     bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
 
     bool NextRead(Buffer& buffer) override;
     bool AdvanceRead(int bytes) override;
 
-    void SetSource(ReadStream* source) { m_source = source; }
+    void SetSource(ReadStream* source) { m_source = source; m_seekableSource = nullptr; }
+    void SetSeekableSource(SeekableReadStream* source) { m_source = m_seekableSource = source; }
+
+    // Bytes this stream has copied rather than decrypted in place, per call site; see CopyAccounting.h
+    const CopyLedger& GetCopyLedger() const { return Base::GetCopyLedger(); }
+
+    // Random access for counter mode algorithms only; these need a seekable source.
+    // The counter is recomputed from the offset, so nothing before it has to be decrypted. Native CBC is refused, but a platform
+    // algorithm id is taken to be counter mode; with any other mode the data read is garbage.
+    // ReadAt works like pread, leaving the sequential position where it was, and returns the number of bytes read. If the sequential
+    // position can't be restored afterwards, ReadAt returns 0 and sequential reading fails until a Seek succeeds.
+    bool Seek(uint64_t offset);
+    size_t ReadAt(uint64_t offset, void* dst, size_t len);
+    uint64_t GetPosition() const;
+
+    bool HasFailed() const { return m_failed; }
+
+    // Read len bytes into dst, decrypting the block-aligned bulk of them straight from the source's buffers; only a partial block at the
+    // start or end goes through m_buffer. Can be mixed with NextRead/AdvanceRead. Returns the number of bytes read, which is less than len
+    // at the end of the source.
+    size_t ReadInto(void* dst, size_t len)
+    {
+      TWN_STREAM_TRACE_SPAN("DecryptionStream::ReadInto", len);
+      return m_failed ? 0 : Base::ReadInto(dst, len);
+    }
+
+    // Decrypt directly in the source's buffers instead of into m_buffer.
+    // Only valid if the source hands out writable buffers that stay valid until AdvanceRead is called on it.
+    // When seeking, the source must also refill its buffers from storage rather than hand back the ones already decrypted.
+    void SetInPlace(bool inPlace) { m_inPlace = inPlace; }
+
+    // Use caller-owned memory for the decryption buffer; must be called before reading, and the memory must outlive the stream
+    void SetBuffer(void* memory, size_t size);
+
+    // Read ahead up to chunkCount chunks of chunkSize bytes from the source on a background thread, so fetching the next chunks overlaps
+    // with decrypting the current one. The chunks are decrypted in place. Must be called before reading, and can't be combined with seeking.
+    void EnableReadAhead(int chunkCount, size_t chunkSize);
   protected:
-    bool Decrypt();
-    int GetAvailableRead() const { return m_readEnd - m_readPos; }
+    typedef DecryptionStreamT<StreamCrypto, ReadStream> Base;
 
-    ReadStream* m_source;
-#if defined(USE_BCRYPT)
-    XBCrypto m_crypto;
-#else
-    SSLCrypto m_crypto;
-#endif
+    SeekableReadStream* m_seekableSource;
+    CipherSettings m_settings;
+    bool m_failed; // The source and counter don't match the sequential position
 
-    uint8_t m_buffer[4096];
-    uint8_t* m_readPos;
-    uint8_t* m_readEnd;
+    std::unique_ptr<AsyncReadStream> m_readAhead;
   };
 
   // Encrypts data in block-sized chunks, and pads data so its size is a multiple of the block size
@@ -74,7 +619,8 @@ namespace TWN
   class BlockEncryptionStream : public WriteStream
   {
   public:
-    BlockEncryptionStream(WriteStream* dest);
+    BlockEncryptionStream(WriteStream* dest, size_t bufferSize = CryptoBuffer::DefaultSize);
+    ~BlockEncryptionStream();
 
     bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
 
@@ -83,23 +629,44 @@ namespace TWN
 
     void Flush();
 
+    // Use caller-owned memory for the plain and encrypted buffers, which get half of it each.
+    // Must be called before writing, and the memory must outlive the stream.
+    void SetBuffer(void* memory, size_t size);
+
+    // Encrypt on an engine shared with other streams, which interleaves their CBC chains. Each run of whole blocks is queued on the engine
+    // and written to dest once it's done, at the latest on the next NextWrite or Flush. Call after Init; only works for the native CBC
+    // algorithms on a CPU with AES-NI, and returns false otherwise, leaving the stream to encrypt by itself. Pass nullptr to stop batching.
+    bool SetBatchEngine(CbcBatchEngine* engine);
+
+    // Bytes this stream has copied rather than encrypted, per call site; see CopyAccounting.h
+    const CopyLedger& GetCopyLedger() const { return m_copies; }
+
   protected:
+    bool CompleteBatchJob();
+    bool CopyToDest(size_t len);
+    void SetBufferPointers();
     int Pad(uint8_t* buffer, int bufferLen, int dataLen);
     int GetAvailableRead() const { return m_writePos - m_buffer; }
 
     Buffer m_lastBuffer;
     WriteStream* m_dest;
-#if defined(USE_BCRYPT)
-    XBCrypto m_crypto;
-#else
-    SSLCrypto m_crypto;
-#endif
+    StreamCrypto m_crypto;
 
     int m_blockSize;
+    int m_algorithm;
 
-    uint8_t m_buffer[4096];
-    uint8_t m_encrypedBuffer[4096];
+    CryptoBuffer m_storage;
+    int m_bufferSize;
+    uint8_t* m_buffer;
+    uint8_t* m_encrypedBuffer;
     uint8_t* m_writePos;
+
+    CbcBatchEngine* m_batchEngine;
+    std::unique_ptr<CbcBatchJob> m_batchJob;
+    int m_batchTail; // Bytes written after the queued run, which move to the front of the buffer once it's done
+    bool m_batchPending;
+
+    CopyLedger m_copies;
   };
 
   // Decrypts data that was encrypted by a BlockEncryptionStream
@@ -107,7 +674,7 @@ namespace TWN
   class BlockDecryptionStream : public ReadStream
   {
   public:
-    BlockDecryptionStream(ReadStream* source);
+    BlockDecryptionStream(ReadStream* source, size_t bufferSize = CryptoBuffer::DefaultSize);
 
     bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
 
@@ -116,26 +683,71 @@ namespace TWN
 
     void Flush();
 
-    void SetSource(ReadStream* source) { m_source = source; }
+    void SetSource(ReadStream* source) { m_source = source; m_seekableSource = nullptr; }
+    void SetSeekableSource(SeekableReadStream* source) { m_source = m_seekableSource = source; }
+
+    // Random access; these need a seekable source. The source must hold the complete ciphertext, since the padding is read from its end.
+    // Seek repositions sequential reading at a plaintext offset, by fetching only the ciphertext block in front of it to use as the IV.
+    // ReadAt decrypts just the blocks covering [offset, offset + len) and leaves the sequential position alone. It returns the number of
+    // bytes read, which is less than len at the end of the data. If ReadAt or GetDecryptedSize can't put the source back where it was,
+    // they fail and so does the stream, until a Seek succeeds.
+    bool Seek(uint64_t offset);
+    size_t ReadAt(uint64_t offset, void* dst, size_t len);
+    bool GetDecryptedSize(uint64_t& size);
+
+    // Use caller-owned memory for the plain and encrypted buffers, which get half of it each.
+    // Must be called before reading, and the memory must outlive the stream.
+    void SetBuffer(void* memory, size_t size);
+
+    // Decrypt large runs of ciphertext in parallel slices on the pool; each slice is seeded with the ciphertext block before it as its IV.
+    // The stream gathers a full buffer before decrypting in this mode, so give it a large buffer (at least a few times minSliceSize).
+    // Pass nullptr to go back to serial decryption.
+    void SetWorkerPool(CryptoWorkerPool* pool, size_t minSliceSize = 64 * 1024);
+
+    // True if decryption broke down (a parallel slice couldn't be set up, or the source couldn't be put back after a random access read);
+    // NextRead returns false from then on
+    bool HasFailed() const { return m_failed; }
+
+    // Bytes this stream has copied rather than decrypted, per call site; see CopyAccounting.h
+    const CopyLedger& GetCopyLedger() const { return m_copies; }
   protected:
+    void SetBufferPointers();
     bool Decrypt();
+    void DecryptAvailable();
+    size_t CipherRun(const uint8_t* src, uint8_t* dst, int len);
+    void AdvanceChainIv(const uint8_t* src, int len);
+    int GetChainAlignment() const;
+    bool Refill(Buffer& buffer);
+    void SkipPending();
     int GetAvailableRead() const { return m_readEnd - m_readPos; }
     int GetUsedWrite() const { return m_writePos - m_encrypedBuffer; }
-    int GetAvailableWrite() const { return TWN_ARRAY_SIZE(m_encrypedBuffer) - GetUsedWrite(); }
+    int GetAvailableWrite() const { return m_bufferSize - GetUsedWrite(); }
 
     ReadStream* m_source;
-#if defined(USE_BCRYPT)
-    XBCrypto m_crypto;
-#else
-    SSLCrypto m_crypto;
-#endif
+    SeekableReadStream* m_seekableSource;
+    StreamCrypto m_crypto;
 
     int m_blockSize;
 
-    uint8_t m_buffer[4096];
-    uint8_t m_encrypedBuffer[4096];
+    CryptoBuffer m_storage;
+    int m_bufferSize;
+    uint8_t* m_buffer;
+    uint8_t* m_encrypedBuffer;
     uint8_t* m_readPos;
     uint8_t* m_readEnd;
     uint8_t* m_writePos;
+
+    CipherSettings m_settings;
+    uint8_t m_chainIv[32]; // Last ivSize bytes of ciphertext decrypted so far, which are the IV for the next block when none is held back
+    int m_cipherHeld; // Bytes of a partial cipher block that m_crypto is holding back; runs are whole padding blocks, which needn't be whole cipher blocks
+    CryptoWorkerPool* m_workerPool;
+    int m_minSliceSize;
+    bool m_failed;
+
+    int m_skipBytes; // Plaintext to drop after a Seek to a position inside a block
+    uint64_t m_decryptedSize; // Cached by GetDecryptedSize()
+    bool m_hasDecryptedSize;
+
+    CopyLedger m_copies;
   };
 }
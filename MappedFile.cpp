@@ -0,0 +1,461 @@
+#include "MappedFile.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+#include <climits>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace TWN
+{
+  // Largest chunk handed out at once, since AdvanceRead/AdvanceWrite take an int
+  static const uint64_t MaxMappedChunk = 1 << 30;
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // MappedFile
+  //////////////////////////////////////////////////////////////////////////
+
+  MappedFile::MappedFile()
+    : m_data(nullptr)
+    , m_size(0)
+    , m_open(false)
+#if defined(_WIN32)
+    , m_file(INVALID_HANDLE_VALUE)
+    , m_mapping(nullptr)
+#else
+    , m_fd(-1)
+#endif
+  {
+
+  }
+
+  MappedFile::~MappedFile()
+  {
+    Close();
+  }
+
+#if defined(_WIN32)
+  bool MappedFile::Open(const char* path, Mode mode)
+  {
+    Close();
+
+    DWORD access = mode == ReadWrite ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+    m_file = CreateFileA(path, access, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if(m_file == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(m_file, &size))
+    {
+      Close();
+      return false;
+    }
+
+    m_size = static_cast<uint64_t>(size.QuadPart);
+    return Map(mode);
+  }
+
+  bool MappedFile::Create(const char* path, uint64_t size)
+  {
+    Close();
+
+    m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if(m_file == INVALID_HANDLE_VALUE)
+    {
+      return false;
+    }
+
+    LARGE_INTEGER end;
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if(!SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+    {
+      Close();
+      return false;
+    }
+
+    m_size = size;
+    return Map(ReadWrite);
+  }
+
+  bool MappedFile::Map(Mode mode)
+  {
+    // Windows can't map an empty file, but there is nothing to map anyway
+    if(m_size > 0)
+    {
+      DWORD protect = mode == ReadOnly ? PAGE_READONLY : mode == ReadWrite ? PAGE_READWRITE : PAGE_WRITECOPY;
+      DWORD access = mode == ReadOnly ? FILE_MAP_READ : mode == ReadWrite ? FILE_MAP_WRITE : FILE_MAP_COPY;
+
+      m_mapping = CreateFileMappingA(m_file, nullptr, protect, 0, 0, nullptr);
+      m_data = m_mapping != nullptr ? static_cast<uint8_t*>(MapViewOfFile(m_mapping, access, 0, 0, 0)) : nullptr;
+
+      if(m_data == nullptr)
+      {
+        Close();
+        return false;
+      }
+    }
+
+    m_open = true;
+    return true;
+  }
+
+  void MappedFile::Close()
+  {
+    if(m_data != nullptr)
+    {
+      UnmapViewOfFile(m_data);
+      m_data = nullptr;
+    }
+
+    if(m_mapping != nullptr)
+    {
+      CloseHandle(m_mapping);
+      m_mapping = nullptr;
+    }
+
+    if(m_file != INVALID_HANDLE_VALUE)
+    {
+      CloseHandle(m_file);
+      m_file = INVALID_HANDLE_VALUE;
+    }
+
+    m_size = 0;
+    m_open = false;
+  }
+
+  bool MappedFile::Flush()
+  {
+    return m_data == nullptr || (FlushViewOfFile(m_data, 0) && FlushFileBuffers(m_file));
+  }
+
+  void MappedFile::AdviseSequential()
+  {
+    // Set up front with FILE_FLAG_SEQUENTIAL_SCAN
+  }
+
+  void MappedFile::AdviseWillNeed(uint64_t offset, size_t len)
+  {
+    if(offset < m_size)
+    {
+      WIN32_MEMORY_RANGE_ENTRY range;
+      range.VirtualAddress = m_data + offset;
+      range.NumberOfBytes = static_cast<SIZE_T>(twn::min<uint64_t>(len, m_size - offset));
+      PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+  }
+
+  void MappedFile::AdviseDontNeed(uint64_t offset, size_t len)
+  {
+    if(offset < m_size)
+    {
+      // Only whole pages inside the range can be dropped
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      uint64_t pageSize = info.dwPageSize;
+      uint64_t start = (offset + pageSize - 1) / pageSize * pageSize;
+      uint64_t end = twn::min<uint64_t>(offset + len, m_size) / pageSize * pageSize;
+
+      // DiscardVirtualMemory and OfferVirtualMemory only take private memory, not a file view. VirtualUnlock on pages that aren't locked
+      // takes them out of the working set instead; it reports ERROR_NOT_LOCKED for doing so, and dirty pages are still written back.
+      if(start < end)
+      {
+        VirtualUnlock(m_data + start, static_cast<SIZE_T>(end - start));
+      }
+    }
+  }
+#else
+  bool MappedFile::Open(const char* path, Mode mode)
+  {
+    Close();
+
+    m_fd = open(path, mode == ReadWrite ? O_RDWR | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+    if(m_fd < 0)
+    {
+      return false;
+    }
+
+    struct stat info;
+    if(fstat(m_fd, &info) != 0)
+    {
+      Close();
+      return false;
+    }
+
+    m_size = static_cast<uint64_t>(info.st_size);
+    return Map(mode);
+  }
+
+  bool MappedFile::Create(const char* path, uint64_t size)
+  {
+    Close();
+
+    m_fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd < 0 || ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+    {
+      Close();
+      return false;
+    }
+
+    m_size = size;
+    return Map(ReadWrite);
+  }
+
+  bool MappedFile::Map(Mode mode)
+  {
+    // mmap rejects empty mappings, but there is nothing to map anyway
+    if(m_size > 0)
+    {
+      int protect = mode == ReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+      int flags = mode == CopyOnWrite ? MAP_PRIVATE : MAP_SHARED;
+
+      void* data = mmap(nullptr, static_cast<size_t>(m_size), protect, flags, m_fd, 0);
+      if(data == MAP_FAILED)
+      {
+        Close();
+        return false;
+      }
+
+      m_data = static_cast<uint8_t*>(data);
+    }
+
+    m_open = true;
+    return true;
+  }
+
+  void MappedFile::Close()
+  {
+    if(m_data != nullptr)
+    {
+      munmap(m_data, static_cast<size_t>(m_size));
+      m_data = nullptr;
+    }
+
+    if(m_fd >= 0)
+    {
+      close(m_fd);
+      m_fd = -1;
+    }
+
+    m_size = 0;
+    m_open = false;
+  }
+
+  bool MappedFile::Flush()
+  {
+    return m_data == nullptr || msync(m_data, static_cast<size_t>(m_size), MS_SYNC) == 0;
+  }
+
+  void MappedFile::AdviseSequential()
+  {
+    if(m_data != nullptr)
+    {
+      madvise(m_data, static_cast<size_t>(m_size), MADV_SEQUENTIAL);
+    }
+  }
+
+  void MappedFile::AdviseWillNeed(uint64_t offset, size_t len)
+  {
+    if(offset < m_size)
+    {
+      // madvise wants a page aligned start
+      uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      uint64_t start = offset - offset % pageSize;
+      uint64_t end = twn::min<uint64_t>(offset + len, m_size);
+      madvise(m_data + start, static_cast<size_t>(end - start), MADV_WILLNEED);
+    }
+  }
+
+  void MappedFile::AdviseDontNeed(uint64_t offset, size_t len)
+  {
+    if(offset < m_size)
+    {
+      // Only whole pages inside the range can be dropped
+      uint64_t pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+      uint64_t start = (offset + pageSize - 1) / pageSize * pageSize;
+      uint64_t end = twn::min<uint64_t>(offset + len, m_size) / pageSize * pageSize;
+
+      if(start < end)
+      {
+        madvise(m_data + start, static_cast<size_t>(end - start), MADV_DONTNEED);
+      }
+    }
+  }
+#endif
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // MappedWriteStream
+  //////////////////////////////////////////////////////////////////////////
+
+  MappedWriteStream::MappedWriteStream(MappedFile* file)
+    : m_file(file)
+    , m_position(0)
+  {
+    m_file->AdviseSequential();
+  }
+
+  bool MappedWriteStream::NextWrite(Buffer& buffer)
+  {
+    if(m_position >= m_file->GetSize())
+    {
+      return false;
+    }
+
+    buffer.SetData(m_file->GetData() + m_position, static_cast<size_t>(twn::min<uint64_t>(m_file->GetSize() - m_position, MaxMappedChunk)));
+    return true;
+  }
+
+  bool MappedWriteStream::AdvanceWrite(int bytes)
+  {
+    TWN_REQUIRE(bytes >= 0 && static_cast<uint64_t>(bytes) <= m_file->GetSize() - m_position);
+
+    m_position += bytes;
+    return true;
+  }
+
+  bool MappedWriteStream::Seek(uint64_t offset)
+  {
+    if(offset > m_file->GetSize())
+    {
+      return false;
+    }
+
+    m_position = offset;
+    return true;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // MappedReadStream
+  //////////////////////////////////////////////////////////////////////////
+
+  MappedReadStream::MappedReadStream(MappedFile* file)
+    : m_file(file)
+    , m_position(0)
+  {
+    m_file->AdviseSequential();
+  }
+
+  bool MappedReadStream::NextRead(Buffer& buffer)
+  {
+    if(m_position >= m_file->GetSize())
+    {
+      return false;
+    }
+
+    buffer.SetData(m_file->GetData() + m_position, static_cast<size_t>(twn::min<uint64_t>(m_file->GetSize() - m_position, MaxMappedChunk)));
+    return true;
+  }
+
+  bool MappedReadStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(bytes >= 0 && static_cast<uint64_t>(bytes) <= m_file->GetSize() - m_position);
+
+    m_position += bytes;
+    return true;
+  }
+
+  bool MappedReadStream::Seek(uint64_t offset)
+  {
+    if(offset > m_file->GetSize())
+    {
+      return false;
+    }
+
+    m_position = offset;
+    return true;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // MappedDecryptionView
+  //////////////////////////////////////////////////////////////////////////
+
+  MappedDecryptionView::MappedDecryptionView(size_t windowSize)
+    : m_cryptoOffset(UINT64_MAX)
+    , m_windowSize(windowSize)
+  {
+    TWN_REQUIRE(windowSize > 0 && windowSize <= INT_MAX);
+  }
+
+  bool MappedDecryptionView::Open(const char* path, int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    Close();
+
+    if(!m_settings.Set(algorithm, key, keySize, iv, ivSize) || !m_file.Open(path, MappedFile::CopyOnWrite))
+    {
+      return false;
+    }
+
+    m_file.AdviseSequential();
+    m_decrypted.assign(static_cast<size_t>((m_file.GetSize() + m_windowSize - 1) / m_windowSize), false);
+
+    return true;
+  }
+
+  void MappedDecryptionView::Close()
+  {
+    m_file.Close();
+    m_decrypted.clear();
+    m_cryptoOffset = UINT64_MAX;
+  }
+
+  const uint8_t* MappedDecryptionView::Get(uint64_t offset, size_t len)
+  {
+    if(offset > m_file.GetSize() || len > m_file.GetSize() - offset)
+    {
+      return nullptr;
+    }
+
+    if(len > 0)
+    {
+      size_t first = static_cast<size_t>(offset / m_windowSize);
+      size_t last = static_cast<size_t>((offset + len - 1) / m_windowSize);
+
+      for(size_t window = first; window <= last; ++window)
+      {
+        if(!m_decrypted[window] && !DecryptWindow(window))
+        {
+          return nullptr;
+        }
+      }
+    }
+
+    return m_file.GetData() + offset;
+  }
+
+  bool MappedDecryptionView::DecryptWindow(size_t window)
+  {
+    PROF_EX(MappedDecryptionView, DecryptWindow);
+
+    uint64_t start = static_cast<uint64_t>(window) * m_windowSize;
+    size_t len = static_cast<size_t>(twn::min<uint64_t>(m_windowSize, m_file.GetSize() - start));
+
+    if(start != m_cryptoOffset && !InitCounterAt(m_crypto, m_settings, start, false))
+    {
+      m_cryptoOffset = UINT64_MAX;
+      return false;
+    }
+
+    // Decrypting in place writes to the private copy of each page, so the only copy is the one the kernel makes on the first write
+    m_file.AdviseWillNeed(start, len);
+    m_crypto.Cipher(m_file.GetData() + start, len);
+
+    m_cryptoOffset = start + len;
+    m_decrypted[window] = true;
+
+    return true;
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+#include <vector>
+
+namespace TWN
+{
+  // A whole file mapped into memory
+  class MappedFile
+  {
+  public:
+    enum Mode
+    {
+      ReadOnly,
+      ReadWrite,
+      CopyOnWrite, // Writable, but changes stay private to this mapping and never reach the file
+    };
+
+    MappedFile();
+    ~MappedFile();
+
+    bool Open(const char* path, Mode mode);
+
+    // Create (or truncate) the file at the given size and map it read-write
+    bool Create(const char* path, uint64_t size);
+
+    void Close();
+
+    // Write dirty pages of a ReadWrite mapping back to the file
+    bool Flush();
+
+    // Paging hints; these do nothing where the platform has no equivalent
+    void AdviseSequential();
+    void AdviseWillNeed(uint64_t offset, size_t len);
+    void AdviseDontNeed(uint64_t offset, size_t len);
+
+    uint8_t* GetData() const { return m_data; }
+    uint64_t GetSize() const { return m_size; }
+    bool IsOpen() const { return m_open; }
+
+  private:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Map(Mode mode);
+
+    uint8_t* m_data;
+    uint64_t m_size;
+    bool m_open;
+#if defined(_WIN32)
+    void* m_file;
+    void* m_mapping;
+#else
+    int m_fd;
+#endif
+  };
+
+  // Writes into a mapped file, handing out the mapping itself from NextWrite, so an EncryptionStream ciphers straight into the file's pages.
+  // Use EncryptionStream::Write with a mapped source to encrypt from one mapping to the other without any copies.
+  class MappedWriteStream : public SeekableWriteStream
+  {
+  public:
+    MappedWriteStream(MappedFile* file);
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    bool Seek(uint64_t offset) override;
+    uint64_t GetPosition() const override { return m_position; }
+
+  private:
+    MappedFile* m_file;
+    uint64_t m_position;
+  };
+
+  // Reads from a mapped file, handing out the mapping itself from NextRead.
+  // With a CopyOnWrite mapping a DecryptionStream can decrypt in place; the decrypted pages replace the mapped ciphertext, so read it only once.
+  class MappedReadStream : public SeekableReadStream
+  {
+  public:
+    MappedReadStream(MappedFile* file);
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    bool Seek(uint64_t offset) override;
+    uint64_t GetPosition() const override { return m_position; }
+    uint64_t GetSize() const override { return m_file->GetSize(); }
+
+  private:
+    MappedFile* m_file;
+    uint64_t m_position;
+  };
+
+  // A counter mode ciphertext file mapped copy-on-write and decrypted lazily, in place, one window at a time as ranges of it are asked for.
+  // Nothing is decrypted until it is used, and a window is only decrypted once. Not thread safe.
+  class MappedDecryptionView
+  {
+  public:
+    static const size_t DefaultWindowSize = 64 * 1024;
+
+    MappedDecryptionView(size_t windowSize = DefaultWindowSize);
+
+    bool Open(const char* path, int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+    void Close();
+
+    // Plaintext for [offset, offset + len), or nullptr if the range is past the end of the file.
+    // The pointer stays valid until the view is closed.
+    const uint8_t* Get(uint64_t offset, size_t len);
+
+    uint64_t GetSize() const { return m_file.GetSize(); }
+
+  private:
+    bool DecryptWindow(size_t window);
+
+    MappedFile m_file;
+    CipherSettings m_settings;
+    StreamCrypto m_crypto;
+    uint64_t m_cryptoOffset; // Where m_crypto's counter is, so consecutive windows don't need it set up again
+    size_t m_windowSize;
+    std::vector<bool> m_decrypted;
+  };
+}
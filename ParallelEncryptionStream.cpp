@@ -0,0 +1,446 @@
+#include "ParallelEncryptionStream.h"
+#include "Buffer.h"
+#include "CryptoWorkerPool.h"
+
+#include "Common/Assert.h"
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // ParallelEncryptionStream
+  //////////////////////////////////////////////////////////////////////////
+
+  ParallelEncryptionStream::ParallelEncryptionStream(WriteStream* dest, CryptoWorkerPool* pool, size_t segmentSize, int maxSegmentsInFlight)
+    : m_dest(dest)
+    , m_pool(pool)
+    , m_aead(false)
+    , m_segmentSize(static_cast<int>(segmentSize))
+    , m_head(0)
+    , m_inFlight(0)
+    , m_nextIndex(0)
+    , m_nextOffset(0)
+    , m_finished(false)
+    , m_failed(false)
+  {
+    TWN_REQUIRE(segmentSize > 0 && segmentSize <= AeadSegmentCipher::MaxSegmentSize);
+
+    if(maxSegmentsInFlight <= 0)
+    {
+      maxSegmentsInFlight = 2 * pool->GetNumThreads();
+    }
+
+    // One more than the number in flight, for the segment being filled
+    for(int i = 0; i <= maxSegmentsInFlight; ++i)
+    {
+      m_segments.emplace_back(new Segment(segmentSize + AeadSegmentCipher::TagSize));
+    }
+  }
+
+  ParallelEncryptionStream::~ParallelEncryptionStream()
+  {
+    // Workers may still be using the segments if Flush() wasn't called; what they produce, and the segment being filled, is dropped
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(size_t i = 0; i < m_inFlight; ++i)
+    {
+      Segment& segment = *m_segments[(m_head + i) % m_segments.size()];
+      m_segmentDone.wait(lock, [&segment]() { return segment.done; });
+    }
+  }
+
+  bool ParallelEncryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    Reset();
+    m_aead = false;
+
+    return ivSize > 0 && m_segmentSize % GetCounterBlockSize(algorithm, ivSize) == 0 && m_settings.Set(algorithm, key, keySize, iv, ivSize);
+  }
+
+  bool ParallelEncryptionStream::Init(AeadAlgorithm algorithm, const void* key, size_t keySize)
+  {
+    Reset();
+    m_aead = true;
+
+    uint8_t header[AeadSegmentCipher::HeaderSize];
+    if(!AeadSegmentCipher::CreateHeader(algorithm, static_cast<uint32_t>(m_segmentSize), header))
+    {
+      return false;
+    }
+
+    for(std::unique_ptr<Segment>& segment : m_segments)
+    {
+      if(!segment->aead.Init(key, keySize, header))
+      {
+        return false;
+      }
+    }
+
+    return Stream::Copy(header, *m_dest, sizeof(header));
+  }
+
+  void ParallelEncryptionStream::Reset()
+  {
+    TWN_REQUIRE(m_inFlight == 0);
+
+    m_head = 0;
+    m_nextIndex = 0;
+    m_nextOffset = 0;
+    m_finished = false;
+    m_failed = false;
+    GetCurrent().used = 0;
+  }
+
+  bool ParallelEncryptionStream::NextWrite(Buffer& buffer)
+  {
+    TWN_REQUIRE(!m_finished);
+
+    Segment& current = GetCurrent();
+
+    // More data is coming, so a full segment can't be the last one
+    if(current.used == m_segmentSize && !Submit(false))
+    {
+      return false;
+    }
+
+    Segment& next = GetCurrent();
+    buffer.SetData(next.buffer.GetData() + next.used, m_segmentSize - next.used);
+    return !m_failed;
+  }
+
+  bool ParallelEncryptionStream::AdvanceWrite(int bytes)
+  {
+    TWN_REQUIRE(!m_finished);
+
+    Segment& current = GetCurrent();
+    TWN_REQUIRE(bytes <= m_segmentSize - current.used);
+
+    current.used += bytes;
+    return !m_failed;
+  }
+
+  bool ParallelEncryptionStream::Flush()
+  {
+    if(m_finished)
+    {
+      return !m_failed;
+    }
+
+    // The last AEAD segment is sealed even if it's empty, because its last flag is what shows the stream wasn't cut short.
+    // A second one would follow it with the next index, so that only happens once.
+    if(m_aead)
+    {
+      m_finished = true;
+      Submit(true);
+    }
+    else if(GetCurrent().used > 0)
+    {
+      Submit(true);
+    }
+
+    while(m_inFlight > 0)
+    {
+      Retire(true);
+    }
+
+    return !m_failed;
+  }
+
+  bool ParallelEncryptionStream::Submit(bool lastSegment)
+  {
+    PROF_EX(ParallelEncryptionStream, Submit);
+
+    Segment& segment = GetCurrent();
+    segment.index = m_nextIndex++;
+    segment.offset = m_nextOffset;
+    segment.last = lastSegment;
+    m_nextOffset += segment.used;
+    segment.done = false;
+
+    ++m_inFlight;
+    m_pool->Submit([this, &segment]() { CipherSegment(segment); });
+
+    // Write out whatever has finished in order, and make sure there is a free segment to fill next
+    while(m_inFlight > 0 && Retire(m_inFlight == m_segments.size()))
+    {
+    }
+
+    GetCurrent().used = 0;
+    return !m_failed;
+  }
+
+  bool ParallelEncryptionStream::Retire(bool wait)
+  {
+    Segment& segment = *m_segments[m_head];
+
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+
+      if(!segment.done && !wait)
+      {
+        return false;
+      }
+
+      m_segmentDone.wait(lock, [&segment]() { return segment.done; });
+    }
+
+    int len = segment.used + (m_aead ? AeadSegmentCipher::TagSize : 0);
+
+    if(!segment.ok || !Stream::Copy(segment.buffer.GetData(), *m_dest, len))
+    {
+      m_failed = true;
+    }
+
+    m_head = (m_head + 1) % m_segments.size();
+    --m_inFlight;
+
+    return true;
+  }
+
+  void ParallelEncryptionStream::CipherSegment(Segment& segment)
+  {
+    bool ok = false;
+
+    if(m_aead)
+    {
+      ok = segment.index <= UINT32_MAX && segment.aead.Seal(static_cast<uint32_t>(segment.index), segment.last, segment.buffer.GetData(), segment.used);
+    }
+    else if(InitCounterAt(segment.crypto, m_settings, segment.offset, true))
+    {
+      segment.crypto.Cipher(segment.buffer.GetData(), segment.used);
+      ok = true;
+    }
+
+    // Notify while holding the lock, as the stream may be destroyed as soon as the writer sees the segment is done
+    std::lock_guard<std::mutex> lock(m_mutex);
+    segment.ok = ok;
+    segment.done = true;
+    m_segmentDone.notify_all();
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // ParallelDecryptionStream
+  //////////////////////////////////////////////////////////////////////////
+
+  ParallelDecryptionStream::ParallelDecryptionStream(ReadStream* source, CryptoWorkerPool* pool, size_t segmentSize, int maxSegmentsInFlight)
+    : m_source(source)
+    , m_pool(pool)
+    , m_aead(false)
+    , m_segmentSize(static_cast<int>(segmentSize))
+    , m_head(0)
+    , m_count(0)
+    , m_nextIndex(0)
+    , m_nextOffset(0)
+    , m_headOpen(false)
+    , m_sourceDone(false)
+    , m_finished(false)
+    , m_failed(false)
+    , m_readPos(nullptr)
+    , m_readEnd(nullptr)
+  {
+    TWN_REQUIRE(segmentSize > 0 && segmentSize <= AeadSegmentCipher::MaxSegmentSize);
+
+    if(maxSegmentsInFlight <= 0)
+    {
+      maxSegmentsInFlight = 2 * pool->GetNumThreads();
+    }
+
+    for(int i = 0; i < twn::max<int>(maxSegmentsInFlight, 1); ++i)
+    {
+      m_segments.emplace_back(new Segment(segmentSize + AeadSegmentCipher::TagSize));
+    }
+  }
+
+  ParallelDecryptionStream::~ParallelDecryptionStream()
+  {
+    WaitForAll();
+  }
+
+  bool ParallelDecryptionStream::Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize)
+  {
+    Reset();
+    m_aead = false;
+
+    return ivSize > 0 && m_segmentSize % GetCounterBlockSize(algorithm, ivSize) == 0 && m_settings.Set(algorithm, key, keySize, iv, ivSize);
+  }
+
+  bool ParallelDecryptionStream::Init(AeadAlgorithm algorithm, const void* key, size_t keySize)
+  {
+    Reset();
+    m_aead = true;
+    m_failed = true;
+
+    uint8_t header[AeadSegmentCipher::HeaderSize];
+    AeadAlgorithm headerAlgorithm;
+    uint32_t segmentSize = 0;
+
+    if(!ReadExact(*m_source, header, sizeof(header))
+      || !AeadSegmentCipher::ParseHeader(header, headerAlgorithm, segmentSize)
+      || headerAlgorithm != algorithm)
+    {
+      return false;
+    }
+
+    m_segmentSize = static_cast<int>(segmentSize);
+
+    for(std::unique_ptr<Segment>& segment : m_segments)
+    {
+      if(segment->buffer.GetSize() < m_segmentSize + AeadSegmentCipher::TagSize)
+      {
+        segment->buffer.Allocate(m_segmentSize + AeadSegmentCipher::TagSize);
+      }
+
+      if(!segment->aead.Init(key, keySize, header))
+      {
+        return false;
+      }
+    }
+
+    m_failed = false;
+    return true;
+  }
+
+  void ParallelDecryptionStream::Reset()
+  {
+    WaitForAll();
+
+    m_head = 0;
+    m_count = 0;
+    m_nextIndex = 0;
+    m_nextOffset = 0;
+    m_headOpen = false;
+    m_sourceDone = false;
+    m_finished = false;
+    m_failed = false;
+    m_readPos = m_readEnd = nullptr;
+  }
+
+  void ParallelDecryptionStream::WaitForAll()
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(size_t i = 0; i < m_count; ++i)
+    {
+      Segment& segment = *m_segments[(m_head + i) % m_segments.size()];
+      m_segmentDone.wait(lock, [&segment]() { return segment.done; });
+    }
+  }
+
+  bool ParallelDecryptionStream::NextRead(Buffer& buffer)
+  {
+    while(GetAvailableRead() == 0)
+    {
+      // Hand the finished segment back to the pipeline, and keep it topped up before waiting on the next one
+      if(m_headOpen)
+      {
+        m_head = (m_head + 1) % m_segments.size();
+        --m_count;
+        m_headOpen = false;
+      }
+
+      FillPipeline();
+
+      if(m_count == 0 || m_failed)
+      {
+        return false;
+      }
+
+      Segment& head = *m_segments[m_head];
+
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_segmentDone.wait(lock, [&head]() { return head.done; });
+      }
+
+      if(!head.ok)
+      {
+        // Truncated, reordered or tampered with
+        m_failed = true;
+        return false;
+      }
+
+      m_finished = head.last;
+      m_headOpen = true;
+      m_readPos = head.buffer.GetData();
+      m_readEnd = m_readPos + head.used - (m_aead ? AeadSegmentCipher::TagSize : 0);
+    }
+
+    buffer.SetData(m_readPos, m_readEnd - m_readPos);
+    return true;
+  }
+
+  bool ParallelDecryptionStream::AdvanceRead(int bytes)
+  {
+    TWN_REQUIRE(bytes <= GetAvailableRead());
+
+    if(bytes <= GetAvailableRead())
+    {
+      m_readPos += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  void ParallelDecryptionStream::FillPipeline()
+  {
+    PROF_EX(ParallelDecryptionStream, FillPipeline);
+
+    int encryptedSize = m_segmentSize + (m_aead ? AeadSegmentCipher::TagSize : 0);
+
+    while(!m_sourceDone && m_count < m_segments.size())
+    {
+      Segment& segment = *m_segments[(m_head + m_count) % m_segments.size()];
+      uint8_t* data = segment.buffer.GetData();
+      int len = 0;
+
+      Buffer buffer;
+      while(len < encryptedSize && m_source->NextRead(buffer) && buffer.GetDataLen() > 0)
+      {
+        int chunk = twn::min<int>(encryptedSize - len, static_cast<int>(buffer.GetDataLen()));
+        memcpy(data + len, buffer.GetData(), chunk);
+        m_source->AdvanceRead(chunk);
+        len += chunk;
+      }
+
+      // A short segment is the last one; a full one is the last if the source has nothing after it
+      segment.last = len < encryptedSize || !m_source->NextRead(buffer) || buffer.GetDataLen() == 0;
+      m_sourceDone = segment.last;
+
+      if(len == 0 && !m_aead)
+      {
+        break;
+      }
+
+      // An empty AEAD segment is still submitted, and fails to open unless it really is the last one
+      segment.used = len;
+      segment.index = m_nextIndex++;
+      segment.offset = m_nextOffset;
+      segment.done = false;
+      m_nextOffset += len;
+      ++m_count;
+
+      m_pool->Submit([this, &segment]() { DecryptSegment(segment); });
+    }
+  }
+
+  void ParallelDecryptionStream::DecryptSegment(Segment& segment)
+  {
+    bool ok = false;
+
+    if(m_aead)
+    {
+      ok = segment.used >= AeadSegmentCipher::TagSize && segment.index <= UINT32_MAX
+        && segment.aead.Open(static_cast<uint32_t>(segment.index), segment.last, segment.buffer.GetData(), segment.used - AeadSegmentCipher::TagSize);
+    }
+    else if(InitCounterAt(segment.crypto, m_settings, segment.offset, false))
+    {
+      segment.crypto.Cipher(segment.buffer.GetData(), segment.used);
+      ok = true;
+    }
+
+    // Notify while holding the lock, as the stream may be destroyed as soon as the reader sees the segment is done
+    std::lock_guard<std::mutex> lock(m_mutex);
+    segment.ok = ok;
+    segment.done = true;
+    m_segmentDone.notify_all();
+  }
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "AeadStream.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace TWN
+{
+  class CryptoWorkerPool;
+
+  // A segment buffer of the parallel crypto streams, with its own crypto contexts so workers never share one
+  struct ParallelSegment
+  {
+    ParallelSegment(size_t size) : buffer(size), used(0), index(0), offset(0), last(false), done(false), ok(false) {}
+
+    CryptoBuffer buffer;
+    int used;
+    uint64_t index;
+    uint64_t offset; // Stream position of the first byte, where counter mode starts the keystream
+    bool last;
+    bool done; // Guarded by the stream's mutex while the segment is in flight
+    bool ok;
+
+    StreamCrypto crypto;
+    AeadSegmentCipher aead;
+  };
+
+  // Encrypts segments of the stream on a CryptoWorkerPool and writes them to dest in order.
+  // Only for modes where segments can be encrypted independently: counter mode algorithms, whose output is the same as EncryptionStream's,
+  // and segmented AEAD, whose output is the same as AeadEncryptionStream's.
+  // At most maxSegmentsInFlight segments are buffered at once; when they are all in use, the writer waits for the oldest to be written out.
+  // Flush() must be called at the end, and dest is only written to from the calling thread. A stream destroyed without it waits for the segments
+  // in flight but drops them, along with the partly filled segment.
+  class ParallelEncryptionStream : public WriteStream
+  {
+  public:
+    static const size_t DefaultSegmentSize = 256 * 1024;
+
+    // maxSegmentsInFlight == 0 uses twice the number of pool threads
+    ParallelEncryptionStream(WriteStream* dest, CryptoWorkerPool* pool, size_t segmentSize = DefaultSegmentSize, int maxSegmentsInFlight = 0);
+    ~ParallelEncryptionStream();
+
+    // Counter mode; segmentSize must be a multiple of the counter block (ivSize, or 64 bytes for ChaCha20)
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    // Segmented AEAD; writes the stream header to dest
+    bool Init(AeadAlgorithm algorithm, const void* key, size_t keySize);
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    // Encrypt whatever is left (as the last segment, for AEAD), wait for all segments and write them to dest.
+    // With AEAD this ends the stream: calling it again does nothing, and nothing more can be written. In counter mode writing can carry on,
+    // and the output is still the same as EncryptionStream's even though the flushed segment was short.
+    bool Flush();
+
+  protected:
+    typedef ParallelSegment Segment;
+
+    Segment& GetCurrent() { return *m_segments[(m_head + m_inFlight) % m_segments.size()]; }
+    void Reset();
+    bool Submit(bool lastSegment);
+    bool Retire(bool wait);
+    void CipherSegment(Segment& segment);
+
+    WriteStream* m_dest;
+    CryptoWorkerPool* m_pool;
+    bool m_aead;
+    CipherSettings m_settings;
+
+    std::vector<std::unique_ptr<Segment>> m_segments;
+    int m_segmentSize;
+    size_t m_head; // Oldest segment in flight
+    size_t m_inFlight;
+    uint64_t m_nextIndex;
+    uint64_t m_nextOffset;
+    bool m_finished; // The last AEAD segment has been submitted
+    bool m_failed;
+
+    std::mutex m_mutex;
+    std::condition_variable m_segmentDone;
+  };
+
+  // Reads segments ahead from source and decrypts several of them at once on a CryptoWorkerPool, handing out the plaintext in order.
+  // Reads counter mode data from EncryptionStream/ParallelEncryptionStream, or segmented AEAD data from AeadEncryptionStream/ParallelEncryptionStream,
+  // in which case a segment is only handed out once verified, and NextRead returns false on failure as well as at the end (see IsComplete()).
+  // Up to maxSegmentsInFlight segments are buffered, including the one being read. source is only read from the calling thread.
+  class ParallelDecryptionStream : public ReadStream
+  {
+  public:
+    static const size_t DefaultSegmentSize = ParallelEncryptionStream::DefaultSegmentSize;
+
+    // maxSegmentsInFlight == 0 uses twice the number of pool threads
+    ParallelDecryptionStream(ReadStream* source, CryptoWorkerPool* pool, size_t segmentSize = DefaultSegmentSize, int maxSegmentsInFlight = 0);
+    ~ParallelDecryptionStream();
+
+    // Counter mode; segmentSize must be a multiple of the counter block (ivSize, or 64 bytes for ChaCha20)
+    bool Init(int algorithm, const void* key, size_t keySize, const void* iv, size_t ivSize);
+
+    // Segmented AEAD; reads the stream header from source, which sets the segment size
+    bool Init(AeadAlgorithm algorithm, const void* key, size_t keySize);
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    // For AEAD: true once the last segment has been verified, so the whole stream was authentic and nothing was cut off
+    bool IsComplete() const { return m_finished && !m_failed; }
+    bool HasFailed() const { return m_failed; }
+
+  protected:
+    typedef ParallelSegment Segment;
+
+    void Reset();
+    void WaitForAll();
+    void FillPipeline();
+    void DecryptSegment(Segment& segment);
+    int GetAvailableRead() const { return m_readEnd - m_readPos; }
+
+    ReadStream* m_source;
+    CryptoWorkerPool* m_pool;
+    bool m_aead;
+    CipherSettings m_settings;
+
+    std::vector<std::unique_ptr<Segment>> m_segments;
+    int m_segmentSize;
+    size_t m_head; // Segment being read
+    size_t m_count; // Segments read from source and not yet released, including the head
+    uint64_t m_nextIndex;
+    uint64_t m_nextOffset;
+    bool m_headOpen;
+    bool m_sourceDone;
+    bool m_finished;
+    bool m_failed;
+
+    uint8_t* m_readPos;
+    uint8_t* m_readEnd;
+
+    std::mutex m_mutex;
+    std::condition_variable m_segmentDone;
+  };
+}
@@ -0,0 +1,465 @@
+// Throughput benchmark for EncryptionStream, DecryptionStream, BlockEncryptionStream and BlockDecryptionStream.
+// Runs each stream against in-memory stand-ins, so only the stream layer and the cipher are measured, over a matrix of algorithms,
+// caller write/read sizes and source/dest chunk sizes, and prints the results as JSON.
+// With --trace, and a build with TWN_STREAM_TRACE, the last spans of the run are also written as a Chrome trace-event file.
+//
+//   StreamBenchmark [--bytes N] [--repeat N] [--stream NAME] [--algorithm NAME] [--output FILE] [--trace FILE]
+
+#include "EncryptionStream.h"
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace TWN
+{
+  namespace
+  {
+    // Hands out a block of memory in fixed-size chunks, like a socket or file source would
+    class ChunkedReadStream : public ReadStream
+    {
+    public:
+      ChunkedReadStream(const uint8_t* data, size_t size, size_t chunkSize) : m_data(data), m_size(size), m_chunkSize(chunkSize), m_position(0) {}
+
+      bool NextRead(Buffer& buffer) override
+      {
+        if(m_position >= m_size)
+        {
+          return false;
+        }
+
+        buffer.SetData(const_cast<uint8_t*>(m_data) + m_position, twn::min<size_t>(m_chunkSize, m_size - m_position));
+        return true;
+      }
+
+      bool AdvanceRead(int bytes) override
+      {
+        TWN_REQUIRE(bytes >= 0 && static_cast<size_t>(bytes) <= m_size - m_position);
+
+        m_position += bytes;
+        return true;
+      }
+
+    private:
+      const uint8_t* m_data;
+      size_t m_size;
+      size_t m_chunkSize;
+      size_t m_position;
+    };
+
+    // Writes into a block of memory in fixed-size chunks, for preparing the ciphertext the decryption runs read
+    class MemoryWriteStream : public WriteStream
+    {
+    public:
+      MemoryWriteStream(std::vector<uint8_t>& data, size_t chunkSize) : m_data(data), m_chunkSize(chunkSize), m_used(0) {}
+
+      bool NextWrite(Buffer& buffer) override
+      {
+        m_data.resize(m_used + m_chunkSize);
+        buffer.SetData(m_data.data() + m_used, m_chunkSize);
+        return true;
+      }
+
+      bool AdvanceWrite(int bytes) override
+      {
+        m_used += bytes;
+        m_data.resize(m_used);
+        return true;
+      }
+
+    private:
+      std::vector<uint8_t>& m_data;
+      size_t m_chunkSize;
+      size_t m_used;
+    };
+
+    // Discards everything written to it, handing out the same chunk-sized buffer every time
+    class NullWriteStream : public WriteStream
+    {
+    public:
+      NullWriteStream(size_t chunkSize) : m_buffer(chunkSize), m_written(0) {}
+
+      bool NextWrite(Buffer& buffer) override
+      {
+        buffer.SetData(m_buffer.GetData(), m_buffer.GetSize());
+        return true;
+      }
+
+      bool AdvanceWrite(int bytes) override
+      {
+        m_written += bytes;
+        return true;
+      }
+
+      uint64_t GetWritten() const { return m_written; }
+
+    private:
+      CryptoBuffer m_buffer;
+      uint64_t m_written;
+    };
+
+    struct AlgorithmInfo
+    {
+      const char* name;
+      int algorithm;
+      size_t keySize;
+      size_t ivSize;
+      bool block; // CBC: benchmarked with the block streams, which pad; everything else with the plain streams
+    };
+
+    const AlgorithmInfo Algorithms[] =
+    {
+      { "aes-128-ctr", NativeAes128Ctr, 16, 16, false },
+      { "aes-256-ctr", NativeAes256Ctr, 32, 16, false },
+      { "aes-128-cbc", NativeAes128Cbc, 16, 16, true },
+      { "aes-256-cbc", NativeAes256Cbc, 32, 16, true },
+      { "chacha20", NativeChaCha20, 32, 12, false },
+      { "xchacha20", NativeXChaCha20, 32, 24, false },
+    };
+
+    enum StreamKind
+    {
+      Encryption,
+      Decryption,
+      BlockEncryption,
+      BlockDecryption,
+    };
+
+    const char* const StreamNames[] = { "EncryptionStream", "DecryptionStream", "BlockEncryptionStream", "BlockDecryptionStream" };
+
+    // Caller write/read sizes, 16 B to 16 MiB
+    const size_t IoSizes[] = { 16, 64, 256, 1024, 4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024, 16 * 1024 * 1024 };
+
+    // Chunk sizes handed out by the source (decryption) or dest (encryption)
+    const size_t ChunkSizes[] = { 1024, 4096, 64 * 1024, 1024 * 1024 };
+
+    const uint8_t Key[32] = { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+                              0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+    const uint8_t Iv[24] = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+
+    struct Options
+    {
+      Options() : bytes(16 * 1024 * 1024), repeat(3), stream(nullptr), algorithm(nullptr), output(nullptr), trace(nullptr) {}
+
+      size_t bytes;
+      int repeat;
+      const char* stream;
+      const char* algorithm;
+      const char* output;
+      const char* trace;
+    };
+
+    uint64_t ReadCycleCounter()
+    {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return 0;
+#endif
+    }
+
+    struct Measurement
+    {
+      Measurement() : seconds(0), cycles(0), ok(true) {}
+
+      double seconds;
+      uint64_t cycles;
+      bool ok;
+    };
+
+    // Best of opts.repeat runs, since anything slower than the fastest run is noise from elsewhere on the machine
+    template<typename TRun>
+    Measurement Measure(const Options& opts, TRun run)
+    {
+      Measurement best;
+
+      for(int i = 0; i < opts.repeat; ++i)
+      {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t startCycles = ReadCycleCounter();
+
+        bool ok = run();
+
+        uint64_t cycles = ReadCycleCounter() - startCycles;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if(i == 0 || seconds < best.seconds)
+        {
+          best.seconds = seconds;
+          best.cycles = cycles;
+        }
+
+        best.ok = best.ok && ok;
+      }
+
+      return best;
+    }
+
+    bool RunEncryption(const AlgorithmInfo& info, const uint8_t* plain, size_t len, size_t ioSize, size_t chunkSize)
+    {
+      NullWriteStream sink(chunkSize);
+      EncryptionStream stream(&sink);
+      if(!stream.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize))
+      {
+        return false;
+      }
+
+      for(size_t offset = 0; offset < len; offset += ioSize)
+      {
+        if(!Stream::Copy(plain + offset, stream, twn::min<size_t>(ioSize, len - offset)))
+        {
+          return false;
+        }
+      }
+
+      return sink.GetWritten() == len;
+    }
+
+    bool RunBlockEncryption(const AlgorithmInfo& info, const uint8_t* plain, size_t len, size_t ioSize, size_t chunkSize)
+    {
+      NullWriteStream sink(chunkSize);
+      BlockEncryptionStream stream(&sink);
+      if(!stream.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize))
+      {
+        return false;
+      }
+
+      for(size_t offset = 0; offset < len; offset += ioSize)
+      {
+        if(!Stream::Copy(plain + offset, stream, twn::min<size_t>(ioSize, len - offset)))
+        {
+          return false;
+        }
+      }
+
+      stream.Flush();
+
+      return sink.GetWritten() > len;
+    }
+
+    // BlockDecryptionStream holds back the padded final block until it is flushed
+    void FinishRead(DecryptionStream&) {}
+    void FinishRead(BlockDecryptionStream& stream) { stream.Flush(); }
+
+    template<typename TStream>
+    bool RunDecryption(const AlgorithmInfo& info, const std::vector<uint8_t>& cipher, size_t len, size_t ioSize, size_t chunkSize, uint8_t* out)
+    {
+      ChunkedReadStream source(cipher.data(), cipher.size(), chunkSize);
+      TStream stream(&source);
+      if(!stream.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize))
+      {
+        return false;
+      }
+
+      // The caller reads into the same ioSize buffer over and over, as a parser consuming records would
+      size_t bytesRead = 0;
+
+      for(int pass = 0; pass < 2; ++pass)
+      {
+        Buffer buffer;
+        while(bytesRead < len && stream.NextRead(buffer) && buffer.GetDataLen() > 0)
+        {
+          size_t chunk = twn::min<size_t>(twn::min<size_t>(buffer.GetDataLen(), ioSize), len - bytesRead);
+          memcpy(out, buffer.GetData(), chunk);
+          stream.AdvanceRead(static_cast<int>(chunk));
+
+          bytesRead += chunk;
+        }
+
+        if(pass == 0)
+        {
+          FinishRead(stream);
+        }
+      }
+
+      return bytesRead == len;
+    }
+
+    bool Encrypt(const AlgorithmInfo& info, const std::vector<uint8_t>& plain, std::vector<uint8_t>& cipher)
+    {
+      MemoryWriteStream dest(cipher, 64 * 1024);
+
+      if(info.block)
+      {
+        BlockEncryptionStream stream(&dest);
+        bool ok = stream.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize) && Stream::Copy(plain.data(), stream, plain.size());
+        stream.Flush();
+        return ok;
+      }
+
+      EncryptionStream stream(&dest);
+      return stream.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize) && stream.Write(plain.data(), plain.size());
+    }
+
+    void PrintResult(FILE* out, bool& first, StreamKind kind, const AlgorithmInfo& info, const char* kernel, size_t ioSize, size_t chunkSize,
+                     size_t bytes, const Measurement& m)
+    {
+      double gbPerSecond = (m.seconds > 0) ? bytes / m.seconds / 1e9 : 0;
+      double cyclesPerByte = (bytes > 0) ? static_cast<double>(m.cycles) / bytes : 0;
+
+      fprintf(out, "%s\n    { \"stream\": \"%s\", \"algorithm\": \"%s\", \"key_bits\": %u, \"kernel\": \"%s\", \"io_size\": %zu, \"chunk_size\": %zu, "
+                   "\"bytes\": %zu, \"seconds\": %.6f, \"gb_per_s\": %.4f, \"cycles_per_byte\": %.3f, \"ok\": %s }",
+              first ? "" : ",", StreamNames[kind], info.name, static_cast<unsigned>(info.keySize * 8), kernel, ioSize, chunkSize,
+              bytes, m.seconds, gbPerSecond, cyclesPerByte, m.ok ? "true" : "false");
+
+      first = false;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& opts)
+    {
+      for(int i = 1; i < argc; ++i)
+      {
+        bool hasValue = i + 1 < argc;
+
+        if(strcmp(argv[i], "--bytes") == 0 && hasValue)
+        {
+          opts.bytes = static_cast<size_t>(strtoull(argv[++i], nullptr, 0));
+        }
+        else if(strcmp(argv[i], "--repeat") == 0 && hasValue)
+        {
+          opts.repeat = twn::max<int>(atoi(argv[++i]), 1);
+        }
+        else if(strcmp(argv[i], "--stream") == 0 && hasValue)
+        {
+          opts.stream = argv[++i];
+        }
+        else if(strcmp(argv[i], "--algorithm") == 0 && hasValue)
+        {
+          opts.algorithm = argv[++i];
+        }
+        else if(strcmp(argv[i], "--output") == 0 && hasValue)
+        {
+          opts.output = argv[++i];
+        }
+        else if(strcmp(argv[i], "--trace") == 0 && hasValue)
+        {
+          opts.trace = argv[++i];
+        }
+        else
+        {
+          fprintf(stderr, "usage: %s [--bytes N] [--repeat N] [--stream NAME] [--algorithm NAME] [--output FILE] [--trace FILE]\n", argv[0]);
+          return false;
+        }
+      }
+
+      return opts.bytes > 0;
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  using namespace TWN;
+
+  Options opts;
+  if(!ParseOptions(argc, argv, opts))
+  {
+    return 1;
+  }
+
+  FILE* out = (opts.output != nullptr) ? fopen(opts.output, "w") : stdout;
+  if(out == nullptr)
+  {
+    fprintf(stderr, "Can't open %s\n", opts.output);
+    return 1;
+  }
+
+  Crypto::InitializeLibrary();
+  StreamTrace::SetEnabled(opts.trace != nullptr);
+
+  std::vector<uint8_t> plain(opts.bytes);
+  for(size_t i = 0; i < plain.size(); ++i)
+  {
+    plain[i] = static_cast<uint8_t>(i * 131 + (i >> 8));
+  }
+
+  std::vector<uint8_t> readBuffer(IoSizes[TWN_ARRAY_SIZE(IoSizes) - 1]);
+  bool first = true;
+
+  fprintf(out, "{\n  \"bytes_per_run\": %zu,\n  \"repeat\": %d,\n  \"results\": [", opts.bytes, opts.repeat);
+
+  for(const AlgorithmInfo& info : Algorithms)
+  {
+    if(opts.algorithm != nullptr && strcmp(opts.algorithm, info.name) != 0)
+    {
+      continue;
+    }
+
+    StreamCrypto crypto;
+    if(!crypto.Init(info.algorithm, Key, info.keySize, Iv, info.ivSize, true, !info.block))
+    {
+      fprintf(stderr, "Skipping %s: not supported here\n", info.name);
+      continue;
+    }
+
+    const char* kernel = crypto.GetKernelName();
+
+    std::vector<uint8_t> cipher;
+    if(!Encrypt(info, plain, cipher))
+    {
+      fprintf(stderr, "Skipping %s: encryption failed\n", info.name);
+      continue;
+    }
+
+    StreamKind kinds[2] = { info.block ? BlockEncryption : Encryption, info.block ? BlockDecryption : Decryption };
+
+    for(StreamKind kind : kinds)
+    {
+      if(opts.stream != nullptr && strcmp(opts.stream, StreamNames[kind]) != 0)
+      {
+        continue;
+      }
+
+      for(size_t ioSize : IoSizes)
+      {
+        for(size_t chunkSize : ChunkSizes)
+        {
+          Measurement m = Measure(opts, [&]()
+          {
+            switch(kind)
+            {
+            case Encryption:
+              return RunEncryption(info, plain.data(), plain.size(), ioSize, chunkSize);
+            case BlockEncryption:
+              return RunBlockEncryption(info, plain.data(), plain.size(), ioSize, chunkSize);
+            case Decryption:
+              return RunDecryption<DecryptionStream>(info, cipher, plain.size(), ioSize, chunkSize, readBuffer.data());
+            case BlockDecryption:
+              return RunDecryption<BlockDecryptionStream>(info, cipher, plain.size(), ioSize, chunkSize, readBuffer.data());
+            }
+
+            return false;
+          });
+
+          PrintResult(out, first, kind, info, kernel, ioSize, chunkSize, plain.size(), m);
+          fflush(out);
+        }
+      }
+    }
+  }
+
+  fprintf(out, "\n  ]\n}\n");
+
+  if(opts.trace != nullptr && !StreamTrace::Dump(opts.trace))
+  {
+    fprintf(stderr, "Can't write %s\n", opts.trace);
+  }
+
+  if(out != stdout)
+  {
+    fclose(out);
+  }
+
+  return 0;
+}
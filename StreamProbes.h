@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+
+// USDT (SystemTap-style) static tracepoints in the crypto streams' hot paths, for tracing production hosts with bpftrace or perf without
+// a profiling build or a restart. Each probe is a single nop until a tracer attaches to it.
+//
+// Provider twn_stream; every probe takes the same four arguments:
+//   arg0  stream id (the stream's address)
+//   arg1  StreamProbeKind
+//   arg2  algorithm id, as passed to Init
+//   arg3  byte count: key size for init, input for cipher_start, output for cipher_end, bytes fetched for source_refill,
+//         bytes passed on for dest_advance, padded bytes for padding, and bytes still buffered for flush
+//
+// e.g. bpftrace -e 'usdt:./app:twn_stream:cipher_end { @bytes[arg1] = sum(arg3); }'
+//
+// Compiled in on Linux when <sys/sdt.h> (systemtap-sdt-dev) is available; define TWN_STREAM_PROBES to 0 to leave them out regardless.
+#if !defined(TWN_STREAM_PROBES) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define TWN_STREAM_PROBES 1
+#endif
+#endif
+
+#if !defined(TWN_STREAM_PROBES)
+#define TWN_STREAM_PROBES 0
+#endif
+
+namespace TWN
+{
+  enum class StreamProbeKind
+  {
+    Encryption = 1,
+    Decryption = 2,
+    BlockEncryption = 3,
+    BlockDecryption = 4,
+  };
+}
+
+#if TWN_STREAM_PROBES
+#include <sys/sdt.h>
+
+// The stream id is stream; code in a base class of a stream passes the id the stream set, since its this is the base subobject
+#define TWN_STREAM_PROBE_FOR(stream, name, kind, algorithm, bytes) \
+  DTRACE_PROBE4(twn_stream, name, reinterpret_cast<uintptr_t>(stream), static_cast<int>(::TWN::StreamProbeKind::kind), \
+                static_cast<int>(algorithm), static_cast<uint64_t>(bytes))
+#else
+#define TWN_STREAM_PROBE_FOR(stream, name, kind, algorithm, bytes) ((void)0)
+#endif
+
+// For use in stream member functions; the stream id is this
+#define TWN_STREAM_PROBE(name, kind, algorithm, bytes) TWN_STREAM_PROBE_FOR(this, name, kind, algorithm, bytes)
@@ -0,0 +1,326 @@
+#include "StreamStats.h"
+
+#include "Common/Assert.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // LatencyHistogram
+  //////////////////////////////////////////////////////////////////////////
+
+  LatencyHistogram::LatencyHistogram()
+  {
+    Reset();
+  }
+
+  /*static*/ int LatencyHistogram::GetBucket(uint64_t value)
+  {
+    if(value < SubBucketCount)
+    {
+      return static_cast<int>(value);
+    }
+
+    int exponent = 63;
+    while((value >> exponent) == 0)
+    {
+      --exponent;
+    }
+
+    if(exponent > MaxExponent)
+    {
+      return BucketCount - 1;
+    }
+
+    // The top SubBucketBits + 1 bits of the value pick the bucket: the leading one gives the power of two, the rest the linear sub-bucket
+    int subBucket = static_cast<int>(value >> (exponent - SubBucketBits)) - SubBucketCount;
+    return SubBucketCount + (exponent - SubBucketBits) * SubBucketCount + subBucket;
+  }
+
+  /*static*/ uint64_t LatencyHistogram::GetBucketUpperBound(int bucket)
+  {
+    if(bucket < SubBucketCount)
+    {
+      return bucket;
+    }
+
+    int shift = (bucket - SubBucketCount) / SubBucketCount;
+    uint64_t subBucket = (bucket - SubBucketCount) % SubBucketCount;
+
+    return ((SubBucketCount + subBucket + 1) << shift) - 1;
+  }
+
+  void LatencyHistogram::Record(uint64_t nanoseconds)
+  {
+    std::atomic<uint64_t>& bucket = m_buckets[GetBucket(nanoseconds)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    m_total.store(m_total.load(std::memory_order_relaxed) + nanoseconds, std::memory_order_relaxed);
+
+    if(nanoseconds > m_max.load(std::memory_order_relaxed))
+    {
+      m_max.store(nanoseconds, std::memory_order_relaxed);
+    }
+  }
+
+  void LatencyHistogram::Merge(const LatencyHistogram& other)
+  {
+    for(int i = 0; i < BucketCount; ++i)
+    {
+      m_buckets[i].store(m_buckets[i].load(std::memory_order_relaxed) + other.m_buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    m_total.store(GetTotal() + other.GetTotal(), std::memory_order_relaxed);
+
+    if(other.GetMax() > GetMax())
+    {
+      m_max.store(other.GetMax(), std::memory_order_relaxed);
+    }
+  }
+
+  void LatencyHistogram::Reset()
+  {
+    for(int i = 0; i < BucketCount; ++i)
+    {
+      m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    m_total.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t LatencyHistogram::GetCount() const
+  {
+    uint64_t count = 0;
+    for(int i = 0; i < BucketCount; ++i)
+    {
+      count += m_buckets[i].load(std::memory_order_relaxed);
+    }
+
+    return count;
+  }
+
+  uint64_t LatencyHistogram::GetPercentile(double percentile) const
+  {
+    uint64_t count = GetCount();
+    if(count == 0)
+    {
+      return 0;
+    }
+
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count + 0.5);
+    rank = twn::max<uint64_t>(twn::min<uint64_t>(rank, count), 1);
+
+    uint64_t seen = 0;
+    for(int i = 0; i < BucketCount; ++i)
+    {
+      seen += m_buckets[i].load(std::memory_order_relaxed);
+      if(seen >= rank)
+      {
+        // The bucket bound can overshoot the largest value actually recorded
+        return twn::min<uint64_t>(GetBucketUpperBound(i), GetMax());
+      }
+    }
+
+    return GetMax();
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // StreamStats
+  //////////////////////////////////////////////////////////////////////////
+
+  namespace
+  {
+    const int CounterCount = static_cast<int>(StreamCounter::Count);
+    const int LatencyCount = static_cast<int>(StreamLatency::Count);
+
+    struct ThreadStats
+    {
+      ThreadStats()
+      {
+        Reset();
+      }
+
+      void Reset()
+      {
+        for(int i = 0; i < CounterCount; ++i)
+        {
+          counters[i].store(0, std::memory_order_relaxed);
+        }
+
+        for(int i = 0; i < LatencyCount; ++i)
+        {
+          latency[i].Reset();
+        }
+      }
+
+      void MergeInto(ThreadStats& total) const
+      {
+        for(int i = 0; i < CounterCount; ++i)
+        {
+          total.counters[i].store(total.counters[i].load(std::memory_order_relaxed) + counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        for(int i = 0; i < LatencyCount; ++i)
+        {
+          total.latency[i].Merge(latency[i]);
+        }
+      }
+
+      std::atomic<uint64_t> counters[CounterCount];
+      LatencyHistogram latency[LatencyCount];
+    };
+
+    // Stats of every live thread that has recorded something, plus the totals of those that have exited
+    struct Registry
+    {
+      std::mutex mutex;
+      std::vector<ThreadStats*> threads;
+      ThreadStats retired;
+    };
+
+    Registry& GetRegistry()
+    {
+      // Never destroyed, since threads can still exit (and retire their stats) during static destruction
+      static Registry* registry = new Registry();
+      return *registry;
+    }
+
+    struct ThreadStatsHolder
+    {
+      ThreadStatsHolder()
+      {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        registry.threads.push_back(&stats);
+      }
+
+      ~ThreadStatsHolder()
+      {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        stats.MergeInto(registry.retired);
+
+        for(size_t i = 0; i < registry.threads.size(); ++i)
+        {
+          if(registry.threads[i] == &stats)
+          {
+            registry.threads[i] = registry.threads.back();
+            registry.threads.pop_back();
+            break;
+          }
+        }
+      }
+
+      ThreadStats stats;
+    };
+
+    ThreadStats& GetThreadStats()
+    {
+      static thread_local ThreadStatsHolder holder;
+      return holder.stats;
+    }
+
+    StreamStatsSnapshot Summarise(const ThreadStats& stats)
+    {
+      StreamStatsSnapshot snapshot;
+
+      for(int i = 0; i < CounterCount; ++i)
+      {
+        snapshot.counters[i] = stats.counters[i].load(std::memory_order_relaxed);
+      }
+
+      for(int i = 0; i < LatencyCount; ++i)
+      {
+        const LatencyHistogram& histogram = stats.latency[i];
+        StreamLatencySummary& summary = snapshot.latency[i];
+
+        summary.count = histogram.GetCount();
+        summary.totalNs = histogram.GetTotal();
+        summary.p50Ns = histogram.GetPercentile(50.0);
+        summary.p90Ns = histogram.GetPercentile(90.0);
+        summary.p99Ns = histogram.GetPercentile(99.0);
+        summary.p999Ns = histogram.GetPercentile(99.9);
+        summary.maxNs = histogram.GetMax();
+      }
+
+      return snapshot;
+    }
+  }
+
+  /*static*/ void StreamStats::Add(StreamCounter counter, uint64_t value)
+  {
+    std::atomic<uint64_t>& total = GetThreadStats().counters[static_cast<int>(counter)];
+    total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  /*static*/ void StreamStats::Record(StreamLatency latency, uint64_t nanoseconds)
+  {
+    GetThreadStats().latency[static_cast<int>(latency)].Record(nanoseconds);
+  }
+
+  /*static*/ StreamStatsSnapshot StreamStats::Snapshot()
+  {
+    // The merged copy is big, so keep it off the stack
+    std::unique_ptr<ThreadStats> total(new ThreadStats());
+
+    Registry& registry = GetRegistry();
+    {
+      std::lock_guard<std::mutex> lock(registry.mutex);
+
+      registry.retired.MergeInto(*total);
+      for(ThreadStats* stats : registry.threads)
+      {
+        stats->MergeInto(*total);
+      }
+    }
+
+    return Summarise(*total);
+  }
+
+  /*static*/ StreamStatsSnapshot StreamStats::SnapshotThread()
+  {
+    return Summarise(GetThreadStats());
+  }
+
+  /*static*/ void StreamStats::Reset()
+  {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    registry.retired.Reset();
+    for(ThreadStats* stats : registry.threads)
+    {
+      stats->Reset();
+    }
+  }
+
+  /*static*/ const char* StreamStats::GetName(StreamCounter counter)
+  {
+    switch(counter)
+    {
+    case StreamCounter::BytesCiphered: return "BytesCiphered";
+    case StreamCounter::BytesCopied: return "BytesCopied";
+    case StreamCounter::CipherCalls: return "CipherCalls";
+    case StreamCounter::SourceCalls: return "SourceCalls";
+    case StreamCounter::DestCalls: return "DestCalls";
+    case StreamCounter::SourceRefills: return "SourceRefills";
+    case StreamCounter::DestFlushes: return "DestFlushes";
+    default: return "Unknown";
+    }
+  }
+
+  /*static*/ const char* StreamStats::GetName(StreamLatency latency)
+  {
+    switch(latency)
+    {
+    case StreamLatency::Cipher: return "Cipher";
+    case StreamLatency::SourceRefill: return "SourceRefill";
+    case StreamLatency::DestFlush: return "DestFlush";
+    default: return "Unknown";
+    }
+  }
+}
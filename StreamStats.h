@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Counters and latency histograms for the crypto streams, to tell whether a slow pipeline is cipher-bound, copy-bound or I/O-bound.
+// Compiled in when TWN_STREAM_STATS is defined to 1 (e.g. in the same builds that enable PROF_EX); otherwise the TWN_STREAM_STAT and
+// TWN_STREAM_TIMER macros expand to nothing and cost nothing.
+#if !defined(TWN_STREAM_STATS)
+#define TWN_STREAM_STATS 0
+#endif
+
+namespace TWN
+{
+  enum class StreamCounter
+  {
+    BytesCiphered,
+    BytesCopied, // memcpy/memmove done by the stream layer itself, i.e. not cipher work
+    CipherCalls,
+    SourceCalls, // NextRead/AdvanceRead on a stream's source
+    DestCalls, // NextWrite/AdvanceWrite on a stream's dest (or Stream::Copy to it)
+    SourceRefills, // Times a decryption stream fetched more ciphertext from its source
+    DestFlushes, // Times an encryption stream passed ciphertext on to its dest
+    Count
+  };
+
+  enum class StreamLatency
+  {
+    Cipher,
+    SourceRefill,
+    DestFlush,
+    Count
+  };
+
+  // Log-linear latency histogram in nanoseconds, in the style of HdrHistogram: 16 linear sub-buckets per power of two, so any recorded
+  // value is reported to within 1/16th of itself. Values past about 18 minutes land in the last bucket.
+  class LatencyHistogram
+  {
+  public:
+    static const int SubBucketBits = 4;
+    static const int SubBucketCount = 1 << SubBucketBits;
+    static const int MaxExponent = 40;
+    static const int BucketCount = SubBucketCount + (MaxExponent - SubBucketBits + 1) * SubBucketCount;
+
+    LatencyHistogram();
+
+    // Only the owning thread records, so the buckets are updated with plain relaxed loads and stores rather than locked adds
+    void Record(uint64_t nanoseconds);
+
+    void Merge(const LatencyHistogram& other);
+    void Reset();
+
+    uint64_t GetCount() const;
+    uint64_t GetTotal() const { return m_total.load(std::memory_order_relaxed); }
+    uint64_t GetMax() const { return m_max.load(std::memory_order_relaxed); }
+
+    // Upper bound of the bucket holding the given percentile (0-100) of the recorded values
+    uint64_t GetPercentile(double percentile) const;
+
+    static int GetBucket(uint64_t value);
+    static uint64_t GetBucketUpperBound(int bucket);
+
+  private:
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    std::atomic<uint64_t> m_buckets[BucketCount];
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_max;
+  };
+
+  struct StreamLatencySummary
+  {
+    uint64_t count;
+    uint64_t totalNs;
+    uint64_t p50Ns;
+    uint64_t p90Ns;
+    uint64_t p99Ns;
+    uint64_t p999Ns;
+    uint64_t maxNs;
+  };
+
+  struct StreamStatsSnapshot
+  {
+    uint64_t counters[static_cast<int>(StreamCounter::Count)];
+    StreamLatencySummary latency[static_cast<int>(StreamLatency::Count)];
+
+    uint64_t Get(StreamCounter counter) const { return counters[static_cast<int>(counter)]; }
+    const StreamLatencySummary& Get(StreamLatency latency_) const { return latency[static_cast<int>(latency_)]; }
+  };
+
+  // Every thread gets its own counters and histograms the first time it records anything, so recording never contends with other threads.
+  // A snapshot sums them, including those of threads that have since exited.
+  class StreamStats
+  {
+  public:
+    static void Add(StreamCounter counter, uint64_t value);
+    static void Record(StreamLatency latency, uint64_t nanoseconds);
+
+    // Totals over all threads
+    static StreamStatsSnapshot Snapshot();
+
+    // Totals for the calling thread only
+    static StreamStatsSnapshot SnapshotThread();
+
+    // Zero everything; counts recorded concurrently with the reset may survive it
+    static void Reset();
+
+    static const char* GetName(StreamCounter counter);
+    static const char* GetName(StreamLatency latency);
+  };
+
+  // Records the time from construction to destruction
+  class StreamStatTimer
+  {
+  public:
+    explicit StreamStatTimer(StreamLatency latency) : m_latency(latency), m_start(std::chrono::steady_clock::now()) {}
+
+    ~StreamStatTimer()
+    {
+      std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - m_start;
+      StreamStats::Record(m_latency, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()));
+    }
+
+  private:
+    StreamLatency m_latency;
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  // Cipher through any crypto context, counting the call and timing it when stats are compiled in
+  template<typename TCrypto>
+  inline size_t StatCipher(TCrypto& crypto, const void* src, void* dst, size_t len)
+  {
+#if TWN_STREAM_STATS
+    StreamStatTimer timer(StreamLatency::Cipher);
+    StreamStats::Add(StreamCounter::CipherCalls, 1);
+    StreamStats::Add(StreamCounter::BytesCiphered, len);
+#endif
+    return crypto.Cipher(src, dst, len);
+  }
+}
+
+#if TWN_STREAM_STATS
+#define TWN_STREAM_STAT_CONCAT2(a, b) a##b
+#define TWN_STREAM_STAT_CONCAT(a, b) TWN_STREAM_STAT_CONCAT2(a, b)
+#define TWN_STREAM_STAT(counter, value) ::TWN::StreamStats::Add(::TWN::StreamCounter::counter, static_cast<uint64_t>(value))
+#define TWN_STREAM_TIMER(latency) ::TWN::StreamStatTimer TWN_STREAM_STAT_CONCAT(streamStatTimer, __LINE__)(::TWN::StreamLatency::latency)
+#else
+#define TWN_STREAM_STAT(counter, value) ((void)0)
+#define TWN_STREAM_TIMER(latency)
+#endif
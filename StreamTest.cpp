@@ -0,0 +1,702 @@
+// Regression checks for the crypto streams, run against in-memory stand-ins for the source and destination.
+// Prints each failed check and exits with a non-zero status if there were any.
+//
+//   StreamTest
+
+#include "EncryptionStream.h"
+#include "Buffer.h"
+#include "CryptoWorkerPool.h"
+#include "ParallelEncryptionStream.h"
+#include "UringFileStream.h"
+
+#include "Common/Assert.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+namespace TWN
+{
+  namespace
+  {
+    int g_failures = 0;
+
+    void Check(bool condition, const char* expression, const char* file, int line)
+    {
+      if(!condition)
+      {
+        fprintf(stderr, "%s(%d): check failed: %s\n", file, line, expression);
+        ++g_failures;
+      }
+    }
+
+#define TWN_TEST_CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+    // Hands out a block of memory in fixed-size chunks, like a socket or file source would
+    class ChunkedReadStream : public ReadStream
+    {
+    public:
+      ChunkedReadStream(const uint8_t* data, size_t size, size_t chunkSize) : m_data(data), m_size(size), m_chunkSize(chunkSize), m_position(0) {}
+
+      bool NextRead(Buffer& buffer) override
+      {
+        if(m_position >= m_size)
+        {
+          return false;
+        }
+
+        buffer.SetData(const_cast<uint8_t*>(m_data) + m_position, twn::min<size_t>(m_chunkSize, m_size - m_position));
+        return true;
+      }
+
+      bool AdvanceRead(int bytes) override
+      {
+        TWN_REQUIRE(bytes >= 0 && static_cast<size_t>(bytes) <= m_size - m_position);
+
+        m_position += bytes;
+        return true;
+      }
+
+    private:
+      const uint8_t* m_data;
+      size_t m_size;
+      size_t m_chunkSize;
+      size_t m_position;
+    };
+
+    // Seekable dest over a vector, handing out fixed-size chunks at the current position and growing the vector as needed
+    class VectorWriteStream : public SeekableWriteStream
+    {
+    public:
+      VectorWriteStream(std::vector<uint8_t>& data, size_t chunkSize) : m_data(data), m_chunkSize(chunkSize), m_position(0), m_size(0) {}
+
+      bool NextWrite(Buffer& buffer) override
+      {
+        if(m_data.size() < m_position + m_chunkSize)
+        {
+          m_data.resize(m_position + m_chunkSize);
+        }
+
+        buffer.SetData(m_data.data() + m_position, m_chunkSize);
+        return true;
+      }
+
+      bool AdvanceWrite(int bytes) override
+      {
+        TWN_REQUIRE(bytes >= 0 && static_cast<size_t>(bytes) <= m_chunkSize);
+
+        m_position += bytes;
+        m_size = twn::max<size_t>(m_size, m_position);
+        return true;
+      }
+
+      bool Seek(uint64_t offset) override
+      {
+        m_position = static_cast<size_t>(offset);
+        return true;
+      }
+
+      uint64_t GetPosition() const override { return m_position; }
+
+      // Bytes actually written, ignoring the slack of the last chunk handed out
+      size_t GetSize() const { return m_size; }
+
+    private:
+      std::vector<uint8_t>& m_data;
+      size_t m_chunkSize;
+      size_t m_position;
+      size_t m_size;
+    };
+
+    const uint8_t Key[32] = { 0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+                              0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+    const uint8_t Iv[16] = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+
+    bool IsFilled(const std::vector<uint8_t>& data, size_t offset, size_t len, uint8_t value)
+    {
+      if(data.size() < offset + len)
+      {
+        return false;
+      }
+
+      for(size_t i = 0; i < len; ++i)
+      {
+        if(data[offset + i] != value)
+        {
+          return false;
+        }
+      }
+
+      return true;
+    }
+
+    // WriteAt between coalesced sequential writes must neither drop the gathered bytes nor let later writes overwrite them
+    void TestWriteAtWithCoalescing()
+    {
+      std::vector<uint8_t> file;
+      VectorWriteStream dest(file, 4096);
+
+      EncryptionStream stream(&dest);
+      TWN_TEST_CHECK(stream.Init(NativeAes128Ctr, Key, 16, Iv, 16));
+      stream.SetSeekableDest(&dest);
+      stream.SetCoalescing(true);
+
+      std::vector<uint8_t> a(100, 'A');
+      std::vector<uint8_t> b(10, 'B');
+      std::vector<uint8_t> c(50, 'C');
+
+      TWN_TEST_CHECK(stream.Write(a.data(), a.size()));
+      TWN_TEST_CHECK(stream.WriteAt(1000, b.data(), b.size()));
+      TWN_TEST_CHECK(stream.Write(c.data(), c.size()));
+      TWN_TEST_CHECK(stream.Flush());
+
+      TWN_TEST_CHECK(dest.GetSize() == 1010);
+      TWN_TEST_CHECK(dest.GetPosition() == 150);
+
+      // Counter mode, so decrypting the whole file from the start gives back every range that was written
+      file.resize(dest.GetSize());
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(crypto.Init(NativeAes128Ctr, Key, 16, Iv, 16, false, true));
+      crypto.Cipher(file.data(), file.size());
+
+      TWN_TEST_CHECK(IsFilled(file, 0, 100, 'A'));
+      TWN_TEST_CHECK(IsFilled(file, 100, 50, 'C'));
+      TWN_TEST_CHECK(IsFilled(file, 1000, 10, 'B'));
+    }
+
+    // Seeking only works where the counter can be recomputed from the offset; the rest is refused rather than dividing by a zero block size
+    void TestSeekNeedsCounterMode()
+    {
+      std::vector<uint8_t> file;
+      VectorWriteStream dest(file, 4096);
+
+      EncryptionStream stream(&dest);
+      TWN_TEST_CHECK(stream.Init(NativeAes128Cbc, Key, 16, Iv, 16));
+      stream.SetSeekableDest(&dest);
+      TWN_TEST_CHECK(!stream.Seek(100));
+
+      CipherSettings settings;
+      TWN_TEST_CHECK(settings.Set(NativeAes128Ctr, Key, 16, Iv, 0));
+
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(!InitCounterAt(crypto, settings, 100, true));
+    }
+
+    // Stand-in for a seekable file over a fixed block of memory
+    class MemoryReadStream : public SeekableReadStream
+    {
+    public:
+      MemoryReadStream(const std::vector<uint8_t>& data) : m_data(data), m_position(0), m_seeksLeft(-1) {}
+
+      // Let that many more seeks succeed and fail the rest, or with -1, never fail them
+      void FailSeeksAfter(int seeks) { m_seeksLeft = seeks; }
+
+      bool NextRead(Buffer& buffer) override
+      {
+        if(m_position >= m_data.size())
+        {
+          return false;
+        }
+
+        buffer.SetData(const_cast<uint8_t*>(m_data.data()) + m_position, m_data.size() - m_position);
+        return true;
+      }
+
+      bool AdvanceRead(int bytes) override
+      {
+        TWN_REQUIRE(bytes >= 0 && static_cast<size_t>(bytes) <= m_data.size() - m_position);
+
+        m_position += bytes;
+        return true;
+      }
+
+      bool Seek(uint64_t offset) override
+      {
+        if(m_seeksLeft == 0)
+        {
+          return false;
+        }
+
+        if(m_seeksLeft > 0)
+        {
+          --m_seeksLeft;
+        }
+
+        m_position = static_cast<size_t>(offset);
+        return offset <= m_data.size();
+      }
+
+      uint64_t GetPosition() const override { return m_position; }
+      uint64_t GetSize() const override { return m_data.size(); }
+
+    private:
+      const std::vector<uint8_t>& m_data;
+      size_t m_position;
+      int m_seeksLeft;
+    };
+
+    // ReadAt that can't put the source back where sequential reading was must fail, rather than leave NextRead decrypting from the
+    // wrong offset
+    void TestReadAtRestoreFailure()
+    {
+      std::vector<uint8_t> plain(10000);
+      for(size_t i = 0; i < plain.size(); ++i)
+      {
+        plain[i] = static_cast<uint8_t>(i * 13);
+      }
+
+      std::vector<uint8_t> cipher = plain;
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(crypto.Init(NativeAes128Ctr, Key, 16, Iv, 16, true, true));
+      crypto.Cipher(cipher.data(), cipher.size());
+
+      MemoryReadStream source(cipher);
+      DecryptionStream stream(nullptr);
+      stream.SetSeekableSource(&source);
+      TWN_TEST_CHECK(stream.Init(NativeAes128Ctr, Key, 16, Iv, 16));
+
+      uint8_t data[100];
+      TWN_TEST_CHECK(stream.ReadInto(data, sizeof(data)) == sizeof(data));
+      TWN_TEST_CHECK(memcmp(data, plain.data(), sizeof(data)) == 0);
+
+      // Seeking to the offset works, seeking back doesn't
+      source.FailSeeksAfter(1);
+      TWN_TEST_CHECK(stream.ReadAt(5000, data, sizeof(data)) == 0);
+      TWN_TEST_CHECK(stream.HasFailed());
+
+      Buffer buffer;
+      TWN_TEST_CHECK(!stream.NextRead(buffer));
+      TWN_TEST_CHECK(stream.ReadInto(data, sizeof(data)) == 0);
+
+      // A successful Seek puts it right
+      source.FailSeeksAfter(-1);
+      TWN_TEST_CHECK(stream.Seek(200));
+      TWN_TEST_CHECK(!stream.HasFailed());
+      TWN_TEST_CHECK(stream.ReadInto(data, sizeof(data)) == sizeof(data));
+      TWN_TEST_CHECK(memcmp(data, plain.data() + 200, sizeof(data)) == 0);
+    }
+
+    // Sizing or seeking a BlockDecryptionStream before Init fails rather than dividing by the unset padding block size
+    void TestBlockDecryptionBeforeInit()
+    {
+      std::vector<uint8_t> cipher(64, 0);
+      MemoryReadStream source(cipher);
+
+      BlockDecryptionStream stream(nullptr);
+      stream.SetSeekableSource(&source);
+
+      uint64_t size = 0;
+      TWN_TEST_CHECK(!stream.GetDecryptedSize(size));
+      TWN_TEST_CHECK(!stream.Seek(16));
+
+      uint8_t data[16];
+      TWN_TEST_CHECK(stream.ReadAt(0, data, sizeof(data)) == 0);
+    }
+
+    // In counter mode Flush only pushes out a short segment, and the writes after it must carry on the keystream from where it ended
+    void TestParallelCtrWriteAfterFlush()
+    {
+      CryptoWorkerPool pool(2);
+
+      std::vector<uint8_t> plain(7000);
+      for(size_t i = 0; i < plain.size(); ++i)
+      {
+        plain[i] = static_cast<uint8_t>(i * 7);
+      }
+
+      std::vector<uint8_t> sealed;
+      VectorWriteStream dest(sealed, 4096);
+
+      ParallelEncryptionStream stream(&dest, &pool, 4096);
+      TWN_TEST_CHECK(stream.Init(NativeAes128Ctr, Key, 16, Iv, 16));
+      TWN_TEST_CHECK(Stream::Copy(plain.data(), stream, 1000));
+      TWN_TEST_CHECK(stream.Flush());
+      TWN_TEST_CHECK(Stream::Copy(plain.data() + 1000, stream, 2000));
+      TWN_TEST_CHECK(stream.Flush());
+      TWN_TEST_CHECK(Stream::Copy(plain.data() + 3000, stream, plain.size() - 3000));
+      TWN_TEST_CHECK(stream.Flush());
+
+      sealed.resize(dest.GetSize());
+
+      std::vector<uint8_t> expected = plain;
+      StreamCrypto crypto;
+      TWN_TEST_CHECK(crypto.Init(NativeAes128Ctr, Key, 16, Iv, 16, true, true));
+      crypto.Cipher(expected.data(), expected.size());
+      TWN_TEST_CHECK(sealed == expected);
+
+      ChunkedReadStream source(sealed.data(), sealed.size(), 1500);
+      ParallelDecryptionStream decrypt(&source, &pool, 4096);
+      TWN_TEST_CHECK(decrypt.Init(NativeAes128Ctr, Key, 16, Iv, 16));
+
+      std::vector<uint8_t> opened;
+      Buffer buffer;
+      while(decrypt.NextRead(buffer) && buffer.GetDataLen() > 0)
+      {
+        const uint8_t* data = static_cast<const uint8_t*>(buffer.GetData());
+        opened.insert(opened.end(), data, data + buffer.GetDataLen());
+        decrypt.AdvanceRead(static_cast<int>(buffer.GetDataLen()));
+      }
+
+      TWN_TEST_CHECK(opened == plain);
+    }
+
+#if defined(__linux__)
+    // Rewriting a range after seeking back must not be undone by the first write of it completing late
+    void TestUringSeekRewrite()
+    {
+      char path[] = "/tmp/StreamTestXXXXXX";
+      int fd = mkstemp(path);
+      TWN_TEST_CHECK(fd >= 0);
+      close(fd);
+
+      const size_t BufferSize = 4096;
+      std::vector<uint8_t> first(BufferSize * 6, 'A');
+      std::vector<uint8_t> second(BufferSize * 3 + 100, 'B');
+
+      for(int i = 0; i < 50; ++i)
+      {
+        UringFileWriteStream dest(8, BufferSize);
+        if(!dest.Open(path))
+        {
+          printf("Skipping io_uring checks: io_uring is not available\n");
+          break;
+        }
+
+        TWN_TEST_CHECK(Stream::Copy(first.data(), dest, first.size()));
+        TWN_TEST_CHECK(dest.Seek(1000));
+        TWN_TEST_CHECK(Stream::Copy(second.data(), dest, second.size()));
+        TWN_TEST_CHECK(dest.GetPosition() == 1000 + second.size());
+        TWN_TEST_CHECK(dest.Close());
+
+        std::vector<uint8_t> file(first.size() + 1);
+        FILE* in = fopen(path, "rb");
+        TWN_TEST_CHECK(in != nullptr);
+        file.resize(in != nullptr ? fread(file.data(), 1, file.size(), in) : 0);
+        if(in != nullptr)
+        {
+          fclose(in);
+        }
+
+        TWN_TEST_CHECK(file.size() == first.size());
+        TWN_TEST_CHECK(IsFilled(file, 0, 1000, 'A'));
+        TWN_TEST_CHECK(IsFilled(file, 1000, second.size(), 'B'));
+        TWN_TEST_CHECK(IsFilled(file, 1000 + second.size(), first.size() - 1000 - second.size(), 'A'));
+      }
+
+      unlink(path);
+    }
+#endif
+
+    // Encrypt plain with a BlockEncryptionStream writing in chunkSize pieces
+    bool EncryptBlock(int algorithm, size_t keySize, const std::vector<uint8_t>& plain, size_t chunkSize, std::vector<uint8_t>& cipher)
+    {
+      VectorWriteStream dest(cipher, chunkSize);
+      BlockEncryptionStream stream(&dest);
+      if(!stream.Init(algorithm, Key, keySize, Iv, 16) || !Stream::Copy(plain.data(), stream, plain.size()))
+      {
+        return false;
+      }
+
+      stream.Flush();
+      cipher.resize(dest.GetSize());
+      return true;
+    }
+
+    // Decrypt all of cipher with a BlockDecryptionStream, optionally splitting runs between the workers of pool
+    bool DecryptBlock(int algorithm, size_t keySize, const std::vector<uint8_t>& cipher, size_t chunkSize, CryptoWorkerPool* pool, std::vector<uint8_t>& plain)
+    {
+      ChunkedReadStream source(cipher.data(), cipher.size(), chunkSize);
+      BlockDecryptionStream stream(&source, 64 * 1024);
+      if(!stream.Init(algorithm, Key, keySize, Iv, 16))
+      {
+        return false;
+      }
+
+      stream.SetWorkerPool(pool, 1024);
+
+      // The padded final block only comes out after Flush
+      for(int pass = 0; pass < 2; ++pass)
+      {
+        Buffer buffer;
+        while(stream.NextRead(buffer) && buffer.GetDataLen() > 0)
+        {
+          const uint8_t* data = static_cast<const uint8_t*>(buffer.GetData());
+          plain.insert(plain.end(), data, data + buffer.GetDataLen());
+          stream.AdvanceRead(static_cast<int>(buffer.GetDataLen()));
+        }
+
+        if(pass == 0)
+        {
+          stream.Flush();
+        }
+      }
+
+      return !stream.HasFailed();
+    }
+
+    // Parallel CBC decryption must match serial decryption, including when the padding block (the key size) isn't a multiple of the
+    // 16-byte cipher block, as with AES-192
+    void TestBlockDecryptionWorkerPool()
+    {
+      struct Case
+      {
+        int algorithm;
+        size_t keySize;
+      };
+
+      const Case Cases[] =
+      {
+        { NativeAes128Cbc, 16 },
+        { NativeAes256Cbc, 32 },
+#if !defined(USE_BCRYPT)
+        { NID_aes_192_cbc, 24 },
+#endif
+      };
+
+      CryptoWorkerPool pool(3);
+      std::mt19937 random(1234);
+
+      for(const Case& test : Cases)
+      {
+        for(int i = 0; i < 20; ++i)
+        {
+          // The padded size must also be a whole number of cipher blocks, so end 1 to keySize bytes short of a multiple of both
+          size_t alignment = (test.keySize % 16 == 0) ? test.keySize : test.keySize * 2;
+          size_t len = (random() % (200 * 1024)) / alignment * alignment + alignment - 1 - random() % test.keySize;
+
+          std::vector<uint8_t> plain(len);
+          for(uint8_t& byte : plain)
+          {
+            byte = static_cast<uint8_t>(random());
+          }
+
+          std::vector<uint8_t> cipher;
+          TWN_TEST_CHECK(EncryptBlock(test.algorithm, test.keySize, plain, 4096, cipher));
+          TWN_TEST_CHECK(cipher.size() % 16 == 0 && cipher.size() > len);
+
+          size_t chunkSize = 1000 + random() % 20000;
+
+          std::vector<uint8_t> serial;
+          TWN_TEST_CHECK(DecryptBlock(test.algorithm, test.keySize, cipher, chunkSize, nullptr, serial));
+          TWN_TEST_CHECK(serial == plain);
+
+          std::vector<uint8_t> parallel;
+          TWN_TEST_CHECK(DecryptBlock(test.algorithm, test.keySize, cipher, chunkSize, &pool, parallel));
+          TWN_TEST_CHECK(parallel == plain);
+        }
+      }
+    }
+
+    // As TestReadAtRestoreFailure, for BlockDecryptionStream, whose chain IV would no longer match the source
+    void TestBlockReadAtRestoreFailure()
+    {
+      std::vector<uint8_t> plain(10000);
+      for(size_t i = 0; i < plain.size(); ++i)
+      {
+        plain[i] = static_cast<uint8_t>(i * 13);
+      }
+
+      std::vector<uint8_t> cipher;
+      TWN_TEST_CHECK(EncryptBlock(NativeAes128Cbc, 16, plain, 4096, cipher));
+
+      MemoryReadStream source(cipher);
+      BlockDecryptionStream stream(nullptr);
+      stream.SetSeekableSource(&source);
+      TWN_TEST_CHECK(stream.Init(NativeAes128Cbc, Key, 16, Iv, 16));
+
+      uint64_t size = 0;
+      TWN_TEST_CHECK(stream.GetDecryptedSize(size));
+      TWN_TEST_CHECK(size == plain.size());
+
+      Buffer buffer;
+      TWN_TEST_CHECK(stream.NextRead(buffer) && buffer.GetDataLen() > 0);
+      stream.AdvanceRead(static_cast<int>(buffer.GetDataLen()));
+
+      // Seeking to the block before the offset works, seeking back doesn't
+      source.FailSeeksAfter(1);
+      uint8_t data[100];
+      TWN_TEST_CHECK(stream.ReadAt(5000, data, sizeof(data)) == 0);
+      TWN_TEST_CHECK(stream.HasFailed());
+      TWN_TEST_CHECK(!stream.NextRead(buffer));
+
+      source.FailSeeksAfter(-1);
+      TWN_TEST_CHECK(stream.Seek(200));
+      TWN_TEST_CHECK(!stream.HasFailed());
+      TWN_TEST_CHECK(stream.NextRead(buffer) && buffer.GetDataLen() > 0);
+      TWN_TEST_CHECK(memcmp(buffer.GetData(), plain.data() + 200, twn::min<size_t>(buffer.GetDataLen(), 100)) == 0);
+    }
+
+    // Read everything an AeadDecryptionStream hands out; false unless the stream verified to the end
+    bool ReadAead(const std::vector<uint8_t>& sealed, std::vector<uint8_t>& plain)
+    {
+      ChunkedReadStream source(sealed.data(), sealed.size(), 4096);
+      AeadDecryptionStream stream(&source);
+      if(!stream.Init(AeadAlgorithm::Aes256Gcm, Key, 32))
+      {
+        return false;
+      }
+
+      Buffer buffer;
+      while(stream.NextRead(buffer) && buffer.GetDataLen() > 0)
+      {
+        const uint8_t* data = static_cast<const uint8_t*>(buffer.GetData());
+        plain.insert(plain.end(), data, data + buffer.GetDataLen());
+        stream.AdvanceRead(static_cast<int>(buffer.GetDataLen()));
+      }
+
+      return stream.IsComplete();
+    }
+
+    // The same through a ParallelDecryptionStream
+    bool ReadAeadParallel(CryptoWorkerPool& pool, const std::vector<uint8_t>& sealed, std::vector<uint8_t>& plain)
+    {
+      ChunkedReadStream source(sealed.data(), sealed.size(), 4096);
+      ParallelDecryptionStream stream(&source, &pool);
+      if(!stream.Init(AeadAlgorithm::Aes256Gcm, Key, 32))
+      {
+        return false;
+      }
+
+      Buffer buffer;
+      while(stream.NextRead(buffer) && buffer.GetDataLen() > 0)
+      {
+        const uint8_t* data = static_cast<const uint8_t*>(buffer.GetData());
+        plain.insert(plain.end(), data, data + buffer.GetDataLen());
+        stream.AdvanceRead(static_cast<int>(buffer.GetDataLen()));
+      }
+
+      return stream.IsComplete();
+    }
+
+    // Nothing is handed out that doesn't come from plain, in order
+    bool IsPrefix(const std::vector<uint8_t>& opened, const std::vector<uint8_t>& plain)
+    {
+      return opened.size() <= plain.size() && std::equal(opened.begin(), opened.end(), plain.begin());
+    }
+
+    // A modified, truncated or reordered AEAD stream must fail to verify, without handing out anything that wasn't written
+    void TestAeadRejectsTampering()
+    {
+      CryptoWorkerPool pool(2);
+
+      const size_t SegmentSize = 4096;
+      const size_t SealedSegmentSize = SegmentSize + AeadSegmentCipher::TagSize;
+
+      // Two full segments and a partial last one
+      std::vector<uint8_t> plain(SegmentSize * 2 + 1808);
+      for(size_t i = 0; i < plain.size(); ++i)
+      {
+        plain[i] = static_cast<uint8_t>(i * 31);
+      }
+
+      std::vector<uint8_t> sealed;
+      VectorWriteStream dest(sealed, 4096);
+      AeadEncryptionStream stream(&dest, SegmentSize);
+      TWN_TEST_CHECK(stream.Init(AeadAlgorithm::Aes256Gcm, Key, 32));
+      TWN_TEST_CHECK(Stream::Copy(plain.data(), stream, plain.size()));
+      TWN_TEST_CHECK(stream.Flush());
+      sealed.resize(dest.GetSize());
+
+      const size_t FirstSegment = AeadSegmentCipher::HeaderSize;
+      TWN_TEST_CHECK(sealed.size() == FirstSegment + 3 * AeadSegmentCipher::TagSize + plain.size());
+
+      std::vector<std::vector<uint8_t>> tampered;
+
+      // A ciphertext byte in the middle segment, and a tag byte of the first
+      tampered.push_back(sealed);
+      tampered.back()[FirstSegment + SealedSegmentSize + 100] ^= 0x01;
+
+      tampered.push_back(sealed);
+      tampered.back()[FirstSegment + SegmentSize + 3] ^= 0x80;
+
+      // The last segment dropped, so the stream ends on a segment that wasn't sealed as the last one
+      tampered.push_back(sealed);
+      tampered.back().resize(FirstSegment + 2 * SealedSegmentSize);
+
+      // The first two segments swapped
+      tampered.push_back(sealed);
+      std::swap_ranges(tampered.back().begin() + FirstSegment, tampered.back().begin() + FirstSegment + SealedSegmentSize,
+        tampered.back().begin() + FirstSegment + SealedSegmentSize);
+
+      std::vector<uint8_t> opened;
+      TWN_TEST_CHECK(ReadAead(sealed, opened));
+      TWN_TEST_CHECK(opened == plain);
+
+      for(const std::vector<uint8_t>& data : tampered)
+      {
+        opened.clear();
+        TWN_TEST_CHECK(!ReadAead(data, opened));
+        TWN_TEST_CHECK(IsPrefix(opened, plain));
+
+        opened.clear();
+        TWN_TEST_CHECK(!ReadAeadParallel(pool, data, opened));
+        TWN_TEST_CHECK(IsPrefix(opened, plain));
+      }
+    }
+
+    // Flushing a parallel AEAD stream twice must not append a second last segment
+    void TestParallelAeadFlushTwice()
+    {
+      CryptoWorkerPool pool(2);
+
+      // Empty, one partial segment, exactly one segment, and several with a partial last one
+      const size_t Lengths[] = { 0, 1000, 4096, 10000 };
+
+      for(size_t len : Lengths)
+      {
+        std::vector<uint8_t> sealed;
+        VectorWriteStream dest(sealed, 4096);
+
+        ParallelEncryptionStream stream(&dest, &pool, 4096);
+        TWN_TEST_CHECK(stream.Init(AeadAlgorithm::Aes256Gcm, Key, 32));
+
+        std::vector<uint8_t> plain(len, 'P');
+        TWN_TEST_CHECK(Stream::Copy(plain.data(), stream, plain.size()));
+        TWN_TEST_CHECK(stream.Flush());
+        TWN_TEST_CHECK(stream.Flush());
+
+        sealed.resize(dest.GetSize());
+
+        std::vector<uint8_t> opened;
+        TWN_TEST_CHECK(ReadAead(sealed, opened));
+        TWN_TEST_CHECK(opened == plain);
+      }
+    }
+  }
+}
+
+int main()
+{
+  using namespace TWN;
+
+  Crypto::InitializeLibrary();
+
+  TestWriteAtWithCoalescing();
+  TestSeekNeedsCounterMode();
+  TestBlockDecryptionBeforeInit();
+  TestReadAtRestoreFailure();
+  TestBlockReadAtRestoreFailure();
+  TestParallelAeadFlushTwice();
+  TestAeadRejectsTampering();
+  TestParallelCtrWriteAfterFlush();
+#if defined(__linux__)
+  TestUringSeekRewrite();
+#endif
+  TestBlockDecryptionWorkerPool();
+
+  if(g_failures > 0)
+  {
+    fprintf(stderr, "%d checks failed\n", g_failures);
+    return 1;
+  }
+
+  printf("All checks passed\n");
+  return 0;
+}
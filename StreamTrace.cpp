@@ -0,0 +1,215 @@
+#include "StreamTrace.h"
+
+#include "Common/Assert.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace TWN
+{
+#if TWN_STREAM_TRACE
+  std::atomic<bool> StreamTrace::s_enabled(false);
+#endif
+
+  namespace
+  {
+    // Single producer ring: only the owning thread writes events and head, so recording needs no locks or read-modify-writes
+    struct ThreadTrace
+    {
+      explicit ThreadTrace(int id_) : id(id_), head(0), floor(0), exited(false) {}
+
+      int id;
+      std::atomic<uint64_t> head; // Spans ever recorded; span i lives in events[i % ThreadCapacity] until it is overwritten
+      std::atomic<uint64_t> floor; // Spans before this were dropped by Reset
+      std::atomic<bool> exited;
+      StreamTraceEvent events[StreamTrace::ThreadCapacity];
+    };
+
+    struct Registry
+    {
+      Registry() : nextId(1) {}
+
+      std::mutex mutex;
+      std::vector<std::unique_ptr<ThreadTrace>> threads;
+      int nextId;
+    };
+
+    Registry& GetRegistry()
+    {
+      // Never destroyed, since threads can still exit during static destruction
+      static Registry* registry = new Registry();
+      return *registry;
+    }
+
+    // The buffer stays in the registry after its thread exits, so its spans can still be dumped
+    struct ThreadTraceHolder
+    {
+      ThreadTraceHolder()
+      {
+        Registry& registry = GetRegistry();
+        std::lock_guard<std::mutex> lock(registry.mutex);
+
+        trace = new ThreadTrace(registry.nextId++);
+        registry.threads.push_back(std::unique_ptr<ThreadTrace>(trace));
+      }
+
+      ~ThreadTraceHolder()
+      {
+        trace->exited.store(true, std::memory_order_release);
+      }
+
+      ThreadTrace* trace;
+    };
+
+    ThreadTrace& GetThreadTrace()
+    {
+      static thread_local ThreadTraceHolder holder;
+      return *holder.trace;
+    }
+
+    struct DumpedSpan
+    {
+      int threadId;
+      StreamTraceEvent event;
+    };
+
+    void CollectSpans(const ThreadTrace& trace, std::vector<DumpedSpan>& spans)
+    {
+      uint64_t end = trace.head.load(std::memory_order_acquire);
+      uint64_t begin = twn::max<uint64_t>(trace.floor.load(std::memory_order_relaxed), (end > StreamTrace::ThreadCapacity) ? end - StreamTrace::ThreadCapacity : 0);
+
+      // As with a seqlock reader, the copy races with the owner overwriting the oldest slots; any slot it may have torn is found and
+      // dropped below, so the race is benign
+      size_t first = spans.size();
+      for(uint64_t i = begin; i < end; ++i)
+      {
+        DumpedSpan span;
+        span.threadId = trace.id;
+        span.event = trace.events[i % StreamTrace::ThreadCapacity];
+        spans.push_back(span);
+      }
+
+      // Orders the copy before the second read of head, so a slot overwritten during the copy shows up as head having moved past it
+      std::atomic_thread_fence(std::memory_order_acquire);
+      uint64_t after = trace.head.load(std::memory_order_relaxed);
+      if(after >= begin + StreamTrace::ThreadCapacity)
+      {
+        size_t torn = static_cast<size_t>(twn::min<uint64_t>(after - begin - StreamTrace::ThreadCapacity + 1, end - begin));
+        spans.erase(spans.begin() + first, spans.begin() + first + torn);
+      }
+    }
+  }
+
+  /*static*/ uint64_t StreamTrace::Now()
+  {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+  }
+
+  /*static*/ void StreamTrace::Record(const char* name, const void* stream, uint64_t startNs, uint64_t endNs, uint64_t bytes)
+  {
+    ThreadTrace& trace = GetThreadTrace();
+
+    uint64_t index = trace.head.load(std::memory_order_relaxed);
+    StreamTraceEvent& event = trace.events[index % ThreadCapacity];
+    event.name = name;
+    event.stream = stream;
+    event.startNs = startNs;
+    event.durationNs = (endNs > startNs) ? endNs - startNs : 0;
+    event.bytes = bytes;
+
+    trace.head.store(index + 1, std::memory_order_release);
+  }
+
+  /*static*/ void StreamTrace::Dump(FILE* out)
+  {
+    std::vector<DumpedSpan> spans;
+    std::vector<int> threadIds;
+
+    Registry& registry = GetRegistry();
+    {
+      std::lock_guard<std::mutex> lock(registry.mutex);
+
+      for(size_t i = 0; i < registry.threads.size();)
+      {
+        ThreadTrace& trace = *registry.threads[i];
+        bool exited = trace.exited.load(std::memory_order_acquire);
+
+        threadIds.push_back(trace.id);
+        CollectSpans(trace, spans);
+
+        // Nothing more will be recorded in an exited thread's buffer, so once its spans are out it is freed rather than kept until Reset
+        if(exited)
+        {
+          registry.threads[i] = std::move(registry.threads.back());
+          registry.threads.pop_back();
+        }
+        else
+        {
+          ++i;
+        }
+      }
+    }
+
+    // Timestamps are relative to the first span, in microseconds as the format expects
+    uint64_t origin = UINT64_MAX;
+    for(const DumpedSpan& span : spans)
+    {
+      origin = twn::min<uint64_t>(origin, span.event.startNs);
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"TWN streams\"}}");
+
+    for(int threadId : threadIds)
+    {
+      fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Thread %d\"}}", threadId, threadId);
+    }
+
+    for(const DumpedSpan& span : spans)
+    {
+      const StreamTraceEvent& event = span.event;
+      fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"twn_stream\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"stream\":\"%p\",\"bytes\":%llu}}",
+        event.name, span.threadId, (event.startNs - origin) / 1000.0, event.durationNs / 1000.0, event.stream, static_cast<unsigned long long>(event.bytes));
+    }
+
+    fprintf(out, "\n]}\n");
+  }
+
+  /*static*/ bool StreamTrace::Dump(const char* path)
+  {
+    FILE* out = fopen(path, "w");
+    if(out == nullptr)
+    {
+      return false;
+    }
+
+    Dump(out);
+
+    bool ok = ferror(out) == 0;
+    return (fclose(out) == 0) && ok;
+  }
+
+  /*static*/ void StreamTrace::Reset()
+  {
+    Registry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+
+    for(size_t i = 0; i < registry.threads.size();)
+    {
+      ThreadTrace& trace = *registry.threads[i];
+      if(trace.exited.load(std::memory_order_acquire))
+      {
+        registry.threads[i] = std::move(registry.threads.back());
+        registry.threads.pop_back();
+      }
+      else
+      {
+        // Live threads may be recording, so only their owners touch the ring; spans before the current head are skipped from now on
+        trace.floor.store(trace.head.load(std::memory_order_acquire), std::memory_order_relaxed);
+        ++i;
+      }
+    }
+  }
+}
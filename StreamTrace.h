@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+// Timeline tracing of the crypto streams in Chrome trace-event format, to see where a chain of streams (serializer -> compressor ->
+// encryptor -> file) spends its time and where it stalls. NextWrite/AdvanceWrite/NextRead/AdvanceRead and Cipher calls are recorded as
+// spans tagged with the stream they ran on, into a fixed-size ring buffer per thread, so recording takes no locks; once a thread's
+// buffer is full its oldest spans are overwritten. StreamTrace::Dump writes JSON that chrome://tracing and ui.perfetto.dev load as is.
+// Compiled in when TWN_STREAM_TRACE is defined to 1, and then only records while StreamTrace::SetEnabled(true) is in effect.
+#if !defined(TWN_STREAM_TRACE)
+#define TWN_STREAM_TRACE 0
+#endif
+
+namespace TWN
+{
+  struct StreamTraceEvent
+  {
+    const char* name; // Not copied, so a string literal
+    const void* stream;
+    uint64_t startNs;
+    uint64_t durationNs;
+    uint64_t bytes;
+  };
+
+  class StreamTrace
+  {
+  public:
+    static const int ThreadCapacity = 1 << 13; // Spans kept per thread
+
+#if TWN_STREAM_TRACE
+    static void SetEnabled(bool enabled) { s_enabled.store(enabled, std::memory_order_relaxed); }
+    static bool IsEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+#else
+    static void SetEnabled(bool) {}
+    static bool IsEnabled() { return false; }
+#endif
+
+    // Trace clock, in nanoseconds
+    static uint64_t Now();
+
+    // Add a span to the calling thread's buffer
+    static void Record(const char* name, const void* stream, uint64_t startNs, uint64_t endNs, uint64_t bytes);
+
+    // Write the spans of every thread, including those that have exited, as a trace-event JSON document. Spans being recorded while
+    // this runs may be left out. The buffers of exited threads are freed once written, so their spans are in one dump only.
+    static void Dump(FILE* out);
+    static bool Dump(const char* path);
+
+    // Drop every span recorded so far, and the buffers of threads that have exited
+    static void Reset();
+
+  private:
+#if TWN_STREAM_TRACE
+    static std::atomic<bool> s_enabled;
+#endif
+  };
+
+  // Records a span from construction to destruction
+  class StreamTraceSpan
+  {
+  public:
+    StreamTraceSpan(const char* name, const void* stream, uint64_t bytes)
+      : m_name(StreamTrace::IsEnabled() ? name : nullptr)
+      , m_stream(stream)
+      , m_bytes(bytes)
+      , m_start(m_name != nullptr ? StreamTrace::Now() : 0)
+    {
+
+    }
+
+    ~StreamTraceSpan()
+    {
+      if(m_name != nullptr)
+      {
+        StreamTrace::Record(m_name, m_stream, m_start, StreamTrace::Now(), m_bytes);
+      }
+    }
+
+  private:
+    StreamTraceSpan(const StreamTraceSpan&) = delete;
+    StreamTraceSpan& operator=(const StreamTraceSpan&) = delete;
+
+    const char* m_name;
+    const void* m_stream;
+    uint64_t m_bytes;
+    uint64_t m_start;
+  };
+}
+
+// For use in stream member functions; traces the rest of the enclosing scope as a span on this stream, or with _FOR, on the stream
+// identified by stream (for code in a base class, whose this isn't the address of the stream as a whole)
+#if TWN_STREAM_TRACE
+#define TWN_STREAM_TRACE_CONCAT2(a, b) a##b
+#define TWN_STREAM_TRACE_CONCAT(a, b) TWN_STREAM_TRACE_CONCAT2(a, b)
+#define TWN_STREAM_TRACE_SPAN_FOR(name, stream, bytes) \
+  ::TWN::StreamTraceSpan TWN_STREAM_TRACE_CONCAT(streamTraceSpan, __LINE__)(name, stream, static_cast<uint64_t>(bytes))
+#else
+#define TWN_STREAM_TRACE_SPAN_FOR(name, stream, bytes)
+#endif
+
+#define TWN_STREAM_TRACE_SPAN(name, bytes) TWN_STREAM_TRACE_SPAN_FOR(name, this, bytes)
@@ -0,0 +1,657 @@
+#include "UringFileStream.h"
+
+#if defined(__linux__)
+
+#include "Buffer.h"
+
+#include "Common/Assert.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace TWN
+{
+  //////////////////////////////////////////////////////////////////////////
+  // UringQueue
+  //////////////////////////////////////////////////////////////////////////
+
+  UringQueue::UringQueue()
+    : m_fd(-1)
+    , m_sqRing(MAP_FAILED)
+    , m_cqRing(MAP_FAILED)
+    , m_sqRingSize(0)
+    , m_cqRingSize(0)
+    , m_sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED))
+    , m_sqesSize(0)
+    , m_sqTail(nullptr)
+    , m_sqMask(nullptr)
+    , m_sqArray(nullptr)
+    , m_cqHead(nullptr)
+    , m_cqTail(nullptr)
+    , m_cqMask(nullptr)
+    , m_cqes(nullptr)
+  {
+
+  }
+
+  UringQueue::~UringQueue()
+  {
+    Release();
+  }
+
+  bool UringQueue::Init(unsigned entries)
+  {
+    Release();
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if(m_fd < 0)
+    {
+      m_fd = -1;
+      return false;
+    }
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels map both rings with one mmap
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      m_sqRingSize = m_cqRingSize = twn::max<size_t>(m_sqRingSize, m_cqRingSize);
+    }
+
+    m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sqRing == MAP_FAILED)
+    {
+      Release();
+      return false;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      m_cqRing = m_sqRing;
+    }
+    else
+    {
+      m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+      if(m_cqRing == MAP_FAILED)
+      {
+        Release();
+        return false;
+      }
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if(m_sqes == MAP_FAILED)
+    {
+      Release();
+      return false;
+    }
+
+    uint8_t* sq = static_cast<uint8_t*>(m_sqRing);
+    uint8_t* cq = static_cast<uint8_t*>(m_cqRing);
+
+    m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    m_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    m_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    return true;
+  }
+
+  void UringQueue::Release()
+  {
+    if(m_sqes != MAP_FAILED)
+    {
+      munmap(m_sqes, m_sqesSize);
+      m_sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    }
+
+    if(m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+    {
+      munmap(m_cqRing, m_cqRingSize);
+    }
+
+    if(m_sqRing != MAP_FAILED)
+    {
+      munmap(m_sqRing, m_sqRingSize);
+    }
+
+    m_sqRing = m_cqRing = MAP_FAILED;
+
+    if(m_fd >= 0)
+    {
+      close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  bool UringQueue::RegisterBuffers(const struct iovec* buffers, unsigned count)
+  {
+    return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+  }
+
+  bool UringQueue::Submit(uint8_t opcode, int fd, void* data, unsigned len, uint64_t offset, int bufferIndex, uint64_t userData)
+  {
+    // This is the only producer, so the tail can be read plainly; the kernel only needs to see the entry before the new tail
+    unsigned tail = *m_sqTail;
+    unsigned index = tail & *m_sqMask;
+
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    if(bufferIndex >= 0)
+    {
+      sqe->buf_index = static_cast<uint16_t>(bufferIndex);
+    }
+
+    m_sqArray[index] = index;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    for(;;)
+    {
+      long submitted = syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0);
+
+      if(submitted >= 0 || errno != EINTR)
+      {
+        return submitted == 1;
+      }
+    }
+  }
+
+  bool UringQueue::Reap(uint64_t& userData, int& result, bool wait)
+  {
+    for(;;)
+    {
+      unsigned head = *m_cqHead;
+
+      if(head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE))
+      {
+        const struct io_uring_cqe& cqe = m_cqes[head & *m_cqMask];
+        userData = cqe.user_data;
+        result = cqe.res;
+
+        __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+
+      if(!wait)
+      {
+        return false;
+      }
+
+      if(syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+      {
+        return false;
+      }
+    }
+  }
+
+  // Set up the queue and register the request buffers with it, falling back to plain reads/writes if registering fails (e.g. RLIMIT_MEMLOCK)
+  template<typename TRequest>
+  static bool InitQueue(UringQueue& queue, std::vector<std::unique_ptr<TRequest>>& requests, bool& fixedBuffers)
+  {
+    if(!queue.Init(static_cast<unsigned>(requests.size())))
+    {
+      return false;
+    }
+
+    std::vector<struct iovec> buffers(requests.size());
+    for(size_t i = 0; i < requests.size(); ++i)
+    {
+      buffers[i].iov_base = requests[i]->buffer.GetData();
+      buffers[i].iov_len = requests[i]->buffer.GetSize();
+    }
+
+    fixedBuffers = queue.RegisterBuffers(buffers.data(), static_cast<unsigned>(buffers.size()));
+    return true;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // UringFileWriteStream
+  //////////////////////////////////////////////////////////////////////////
+
+  UringFileWriteStream::UringFileWriteStream(int queueDepth, size_t bufferSize)
+    : m_fd(-1)
+    , m_fixedBuffers(false)
+    , m_bufferSize(static_cast<int>(bufferSize))
+    , m_current(0)
+    , m_position(0)
+    , m_failed(false)
+  {
+    TWN_REQUIRE(queueDepth > 0);
+
+    for(int i = 0; i < queueDepth; ++i)
+    {
+      m_requests.emplace_back(new Request(bufferSize));
+    }
+  }
+
+  UringFileWriteStream::~UringFileWriteStream()
+  {
+    Close();
+  }
+
+  bool UringFileWriteStream::Open(const char* path)
+  {
+    Close();
+
+    m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd < 0)
+    {
+      return false;
+    }
+
+    if(!InitQueue(m_queue, m_requests, m_fixedBuffers))
+    {
+      close(m_fd);
+      m_fd = -1;
+      return false;
+    }
+
+    m_current = 0;
+    m_position = 0;
+    m_failed = false;
+    m_requests[m_current]->used = 0;
+
+    return true;
+  }
+
+  bool UringFileWriteStream::Close()
+  {
+    if(m_fd < 0)
+    {
+      return true;
+    }
+
+    bool ok = Flush();
+
+    m_queue.Release();
+    ok = close(m_fd) == 0 && ok;
+    m_fd = -1;
+
+    return ok;
+  }
+
+  bool UringFileWriteStream::NextWrite(Buffer& buffer)
+  {
+    TWN_REQUIRE(m_fd >= 0);
+
+    if(m_requests[m_current]->used == m_bufferSize && !SubmitCurrent())
+    {
+      return false;
+    }
+
+    Request& request = *m_requests[m_current];
+    buffer.SetData(request.buffer.GetData() + request.used, m_bufferSize - request.used);
+    return !m_failed;
+  }
+
+  bool UringFileWriteStream::AdvanceWrite(int bytes)
+  {
+    Request& request = *m_requests[m_current];
+    TWN_REQUIRE(bytes <= m_bufferSize - request.used);
+
+    request.used += bytes;
+
+    if(request.used == m_bufferSize)
+    {
+      return SubmitCurrent();
+    }
+
+    return !m_failed;
+  }
+
+  bool UringFileWriteStream::Seek(uint64_t offset)
+  {
+    if(offset == GetPosition())
+    {
+      return !m_failed;
+    }
+
+    // io_uring doesn't order writes against each other, so one to the new position could land before an earlier write still in flight
+    // to the same range, and then be overwritten by it; wait for everything already written first
+    bool ok = Flush();
+    m_position = offset;
+    return ok;
+  }
+
+  uint64_t UringFileWriteStream::GetPosition() const
+  {
+    return m_position + m_requests[m_current]->used;
+  }
+
+  bool UringFileWriteStream::Flush()
+  {
+    PROF_EX(UringFileWriteStream, Flush);
+
+    bool ok = SubmitCurrent();
+
+    for(std::unique_ptr<Request>& request : m_requests)
+    {
+      while(request->inFlight && WaitForCompletion())
+      {
+      }
+    }
+
+    return ok && !m_failed;
+  }
+
+  bool UringFileWriteStream::SubmitCurrent()
+  {
+    Request& request = *m_requests[m_current];
+
+    if(request.used == 0)
+    {
+      return !m_failed;
+    }
+
+    request.offset = m_position;
+    request.done = 0;
+    m_position += request.used;
+
+    if(!SubmitRequest(m_current))
+    {
+      m_failed = true;
+    }
+
+    // Move on to the next buffer, waiting for its last write if it's still in flight
+    m_current = (m_current + 1) % static_cast<int>(m_requests.size());
+
+    Request& next = *m_requests[m_current];
+    while(next.inFlight && WaitForCompletion())
+    {
+    }
+
+    next.used = 0;
+    return !m_failed;
+  }
+
+  bool UringFileWriteStream::SubmitRequest(int index)
+  {
+    Request& request = *m_requests[index];
+
+    request.inFlight = m_queue.Submit(m_fixedBuffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, m_fd, request.buffer.GetData() + request.done,
+      request.used - request.done, request.offset + request.done, m_fixedBuffers ? index : -1, index);
+
+    return request.inFlight;
+  }
+
+  bool UringFileWriteStream::WaitForCompletion()
+  {
+    uint64_t index = 0;
+    int result = 0;
+
+    if(!m_queue.Reap(index, result, true))
+    {
+      // Without completions nothing in flight can finish; give up on all of it rather than wait forever
+      m_failed = true;
+      for(std::unique_ptr<Request>& request : m_requests)
+      {
+        request->inFlight = false;
+      }
+
+      return false;
+    }
+
+    Request& request = *m_requests[index];
+    request.inFlight = false;
+
+    if(result <= 0)
+    {
+      m_failed = true;
+    }
+    else
+    {
+      // Short writes are resubmitted for the rest of the buffer
+      request.done += result;
+
+      if(request.done < request.used && !SubmitRequest(static_cast<int>(index)))
+      {
+        m_failed = true;
+      }
+    }
+
+    return true;
+  }
+
+
+  //////////////////////////////////////////////////////////////////////////
+  // UringFileReadStream
+  //////////////////////////////////////////////////////////////////////////
+
+  UringFileReadStream::UringFileReadStream(int queueDepth, size_t bufferSize)
+    : m_fd(-1)
+    , m_fixedBuffers(false)
+    , m_bufferSize(static_cast<int>(bufferSize))
+    , m_head(0)
+    , m_headOpen(false)
+    , m_nextOffset(0)
+    , m_position(0)
+    , m_size(0)
+    , m_failed(false)
+  {
+    TWN_REQUIRE(queueDepth > 0);
+
+    for(int i = 0; i < queueDepth; ++i)
+    {
+      m_requests.emplace_back(new Request(bufferSize));
+    }
+  }
+
+  UringFileReadStream::~UringFileReadStream()
+  {
+    Close();
+  }
+
+  bool UringFileReadStream::Open(const char* path)
+  {
+    Close();
+
+    m_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(m_fd < 0)
+    {
+      return false;
+    }
+
+    struct stat info;
+    if(fstat(m_fd, &info) != 0 || !InitQueue(m_queue, m_requests, m_fixedBuffers))
+    {
+      close(m_fd);
+      m_fd = -1;
+      return false;
+    }
+
+    m_size = static_cast<uint64_t>(info.st_size);
+    m_failed = false;
+
+    return Seek(0);
+  }
+
+  void UringFileReadStream::Close()
+  {
+    if(m_fd >= 0)
+    {
+      Drain();
+      m_queue.Release();
+      close(m_fd);
+      m_fd = -1;
+    }
+  }
+
+  bool UringFileReadStream::NextRead(Buffer& buffer)
+  {
+    TWN_REQUIRE(m_fd >= 0);
+
+    Request* head = m_requests[m_head].get();
+
+    // Once the head is used up, reuse it to read further ahead; it goes to the back of the queue
+    if(m_headOpen && head->readPos == head->filled)
+    {
+      m_headOpen = false;
+      head->len = 0;
+      StartRead(m_head);
+
+      m_head = (m_head + 1) % static_cast<int>(m_requests.size());
+      head = m_requests[m_head].get();
+    }
+
+    if(!m_headOpen)
+    {
+      PROF_EX(UringFileReadStream, Wait);
+
+      while(head->inFlight && WaitForCompletion())
+      {
+      }
+
+      if(m_failed || head->filled == 0)
+      {
+        return false;
+      }
+
+      m_headOpen = true;
+    }
+
+    buffer.SetData(head->buffer.GetData() + head->readPos, head->filled - head->readPos);
+    return true;
+  }
+
+  bool UringFileReadStream::AdvanceRead(int bytes)
+  {
+    Request& head = *m_requests[m_head];
+    TWN_REQUIRE(m_headOpen && bytes <= head.filled - head.readPos);
+
+    if(m_headOpen && bytes <= head.filled - head.readPos)
+    {
+      head.readPos += bytes;
+      m_position += bytes;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool UringFileReadStream::Seek(uint64_t offset)
+  {
+    if(offset > m_size)
+    {
+      return false;
+    }
+
+    // Reads already in flight are for the old position; let them finish, then queue reads from the new one
+    Drain();
+
+    m_head = 0;
+    m_headOpen = false;
+    m_nextOffset = offset;
+    m_position = offset;
+
+    for(size_t i = 0; i < m_requests.size(); ++i)
+    {
+      m_requests[i]->len = 0;
+      StartRead(static_cast<int>(i));
+    }
+
+    return !m_failed;
+  }
+
+  void UringFileReadStream::StartRead(int index)
+  {
+    Request& request = *m_requests[index];
+    request.filled = 0;
+    request.readPos = 0;
+
+    if(m_nextOffset < m_size)
+    {
+      request.offset = m_nextOffset;
+      request.len = static_cast<int>(twn::min<uint64_t>(m_bufferSize, m_size - m_nextOffset));
+      m_nextOffset += request.len;
+
+      if(!SubmitRequest(index))
+      {
+        m_failed = true;
+      }
+    }
+  }
+
+  bool UringFileReadStream::SubmitRequest(int index)
+  {
+    Request& request = *m_requests[index];
+
+    request.inFlight = m_queue.Submit(m_fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ, m_fd, request.buffer.GetData() + request.filled,
+      request.len - request.filled, request.offset + request.filled, m_fixedBuffers ? index : -1, index);
+
+    return request.inFlight;
+  }
+
+  bool UringFileReadStream::WaitForCompletion()
+  {
+    uint64_t index = 0;
+    int result = 0;
+
+    if(!m_queue.Reap(index, result, true))
+    {
+      m_failed = true;
+      for(std::unique_ptr<Request>& request : m_requests)
+      {
+        request->inFlight = false;
+      }
+
+      return false;
+    }
+
+    Request& request = *m_requests[index];
+    request.inFlight = false;
+
+    if(result < 0)
+    {
+      m_failed = true;
+    }
+    else if(result == 0)
+    {
+      // The file got shorter since it was opened
+      request.len = request.filled;
+    }
+    else
+    {
+      // Short reads are resubmitted for the rest of the buffer, so every buffer covers the range it was queued for
+      request.filled += result;
+
+      if(request.filled < request.len && !SubmitRequest(static_cast<int>(index)))
+      {
+        m_failed = true;
+      }
+    }
+
+    return true;
+  }
+
+  void UringFileReadStream::Drain()
+  {
+    for(std::unique_ptr<Request>& request : m_requests)
+    {
+      while(request->inFlight && WaitForCompletion())
+      {
+      }
+    }
+  }
+}
+
+#endif
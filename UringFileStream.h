@@ -0,0 +1,163 @@
+#pragma once
+
+#include "EncryptionStream.h"
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <memory>
+#include <vector>
+
+namespace TWN
+{
+  // Minimal io_uring submission/completion queue pair for the file streams, driven directly through the system calls
+  class UringQueue
+  {
+  public:
+    UringQueue();
+    ~UringQueue();
+
+    bool Init(unsigned entries);
+    void Release();
+
+    // Registering buffers lets the kernel skip mapping them on every request (IORING_OP_READ_FIXED / WRITE_FIXED)
+    bool RegisterBuffers(const struct iovec* buffers, unsigned count);
+
+    // Queue a read or write and submit it straight away
+    bool Submit(uint8_t opcode, int fd, void* data, unsigned len, uint64_t offset, int bufferIndex, uint64_t userData);
+
+    // Take one completion off the queue, waiting for one if wait is set
+    bool Reap(uint64_t& userData, int& result, bool wait);
+
+  private:
+    UringQueue(const UringQueue&) = delete;
+    UringQueue& operator=(const UringQueue&) = delete;
+
+    int m_fd;
+    void* m_sqRing;
+    void* m_cqRing;
+    size_t m_sqRingSize;
+    size_t m_cqRingSize;
+    struct io_uring_sqe* m_sqes;
+    size_t m_sqesSize;
+
+    unsigned* m_sqTail;
+    unsigned* m_sqMask;
+    unsigned* m_sqArray;
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned* m_cqMask;
+    struct io_uring_cqe* m_cqes;
+  };
+
+  // Writes a file through io_uring with up to queueDepth writes in flight, from buffers registered with the kernel.
+  // NextWrite hands out those buffers directly, so an EncryptionStream on top ciphers straight into the memory the kernel writes from.
+  // Seeking waits for the writes in flight, since io_uring could otherwise complete a later overlapping write before an earlier one.
+  class UringFileWriteStream : public SeekableWriteStream
+  {
+  public:
+    static const int DefaultQueueDepth = 8;
+    static const size_t DefaultBufferSize = 256 * 1024;
+
+    UringFileWriteStream(int queueDepth = DefaultQueueDepth, size_t bufferSize = DefaultBufferSize);
+    ~UringFileWriteStream();
+
+    // Creates or truncates the file
+    bool Open(const char* path);
+
+    // Flushes and closes the file; returns false if any write failed
+    bool Close();
+
+    bool NextWrite(Buffer& buffer) override;
+    bool AdvanceWrite(int bytes) override;
+
+    bool Seek(uint64_t offset) override;
+    uint64_t GetPosition() const override;
+
+    // Submit the buffer being filled and wait for every write to complete
+    bool Flush();
+
+  private:
+    struct Request
+    {
+      Request(size_t size) : buffer(size), used(0), done(0), offset(0), inFlight(false) {}
+
+      CryptoBuffer buffer;
+      int used;
+      int done; // Bytes the kernel has written so far
+      uint64_t offset;
+      bool inFlight;
+    };
+
+    bool SubmitCurrent();
+    bool SubmitRequest(int index);
+    bool WaitForCompletion();
+
+    UringQueue m_queue;
+    int m_fd;
+    bool m_fixedBuffers;
+    std::vector<std::unique_ptr<Request>> m_requests;
+    int m_bufferSize;
+    int m_current;
+    uint64_t m_position; // File offset of the buffer being filled
+    bool m_failed;
+  };
+
+  // Reads a file through io_uring, keeping up to queueDepth reads in flight ahead of the reader, into buffers registered with the kernel.
+  // The buffers handed out are writable and are always refilled from the file, so a DecryptionStream on top can decrypt them in place, even when seeking.
+  class UringFileReadStream : public SeekableReadStream
+  {
+  public:
+    static const int DefaultQueueDepth = 8;
+    static const size_t DefaultBufferSize = 256 * 1024;
+
+    UringFileReadStream(int queueDepth = DefaultQueueDepth, size_t bufferSize = DefaultBufferSize);
+    ~UringFileReadStream();
+
+    bool Open(const char* path);
+    void Close();
+
+    bool NextRead(Buffer& buffer) override;
+    bool AdvanceRead(int bytes) override;
+
+    bool Seek(uint64_t offset) override;
+    uint64_t GetPosition() const override { return m_position; }
+    uint64_t GetSize() const override { return m_size; }
+
+    bool HasFailed() const { return m_failed; }
+
+  private:
+    struct Request
+    {
+      Request(size_t size) : buffer(size), len(0), filled(0), readPos(0), offset(0), inFlight(false) {}
+
+      CryptoBuffer buffer;
+      int len;
+      int filled; // Bytes the kernel has read so far
+      int readPos;
+      uint64_t offset;
+      bool inFlight;
+    };
+
+    void StartRead(int index);
+    bool SubmitRequest(int index);
+    bool WaitForCompletion();
+    void Drain();
+
+    UringQueue m_queue;
+    int m_fd;
+    bool m_fixedBuffers;
+    std::vector<std::unique_ptr<Request>> m_requests;
+    int m_bufferSize;
+    int m_head; // Request being read; the rest follow it in file order
+    bool m_headOpen;
+    uint64_t m_nextOffset;
+    uint64_t m_position;
+    uint64_t m_size;
+    bool m_failed;
+  };
+}
+
+#endif